@@ -1,11 +1,38 @@
 """Type hint and docstrings for fasttokenizer."""
 
+from typing import Dict, List, Tuple, Union
+
 from fasttokenizer import _fasttokenizer
 
-__all__ = ['Segmenter']
+__all__ = ['Segmenter', 'Vocabulary']
 __version__ = _fasttokenizer.__version__
 
 
+class Vocabulary(_fasttokenizer.Vocabulary):
+    """Maps tokens to int32 IDs.
+
+    Args:
+        tokens (str or List[str]): Path of a vocabulary file with a token
+            per line, anything after a tab on a line is ignored. Or a list
+            of tokens. IDs are positions counted from 0.
+        unk_token (str, optional): Token whose ID is given to tokens
+            missing from the vocabulary. If it is not in the vocabulary
+            either, unknown tokens get len(vocab).
+            Defaults to "<unk>".
+    """
+
+    def __init__(
+        self,
+        tokens: Union[str, List[str]],
+        unk_token: str = "<unk>",
+    ):
+        super().__init__(tokens, unk_token)
+
+    def find(self, token: str) -> int:
+        """ID of a token, unk_id if it is not in the vocabulary."""
+        return super().find(token)
+
+
 class Segmenter(_fasttokenizer.Segmenter):
     """A universal text segmenter that works for all languages.
 
@@ -13,10 +40,36 @@ class Segmenter(_fasttokenizer.Segmenter):
         protected_dash_split (bool, optional): Protect dashes by annotating
             if there should be a space preceding or following it.
             Defaults to False.
+        cache_size (int, optional): Maximum number of lines and of
+            whitespace delimited chunks whose outputs are cached and reused.
+            Worthwhile for corpora with many repeated lines.
+            Defaults to 0 which disables the cache.
+        protected_patterns (List[str], optional): ICU regular expressions
+            whose matches are kept as single tokens, like text enclosed in
+            \\x1F separators. Where several match, the first listed wins.
+            Long lines are split at spaces, so matches should not hold any.
+            Raises ValueError if a pattern does not compile.
+            Defaults to none.
+        protected_builtins (List[str], optional): Built-in patterns kept as
+            single tokens, "url" and "email". Defaults to none.
     """
 
-    def __init__(self, protected_dash_split=False):
-        super().__init__(protected_dash_split)
+    def __init__(
+        self,
+        protected_dash_split=False,
+        cache_size=0,
+        protected_patterns: List[str] = (),
+        protected_builtins: List[str] = (),
+    ):
+        builtins = {
+            "url": _fasttokenizer.Segmenter.ProtectedBuiltin.URLS,
+            "email": _fasttokenizer.Segmenter.ProtectedBuiltin.EMAILS,
+        }
+        flags = 0
+        for name in protected_builtins:
+            flags |= int(builtins[name])
+        super().__init__(
+            protected_dash_split, cache_size, list(protected_patterns), flags)
 
     def normalize(self, text: str) -> str:
         """Normalize an input text.
@@ -50,6 +103,226 @@ class Segmenter(_fasttokenizer.Segmenter):
         """Perform normalize then segment on an input text."""
         return super().normalize_and_segment(text)
 
+    def segment_spans(self, text: str) -> List[Tuple[int, int, int]]:
+        """Segment a given input text into token spans.
+
+        Each span is a tuple of (begin, end, flags) where begin and end are
+        character offsets into text. Protected sequences are kept as a single
+        span and whitespace only tokens are left out.
+
+        flags is non-zero for protected dashes, 1 if the token is preceded
+        by an @ symbol and 2 if it is followed by one.
+
+        eg. with protected_dash_split
+            "a-b c" -> [(0, 1, 0), (1, 2, 3), (2, 3, 0), (4, 5, 0)]
+        """
+        return super().segment_spans(text)
+
+    def normalize_and_segment_spans(
+        self,
+        text: str,
+    ) -> Tuple[str, List[Tuple[int, int, int]]]:
+        """Perform normalize then segment into token spans on an input text.
+
+        Returns the normalized text and spans with offsets into it.
+        """
+        return super().normalize_and_segment_spans(text)
+
+    def segment_ids(self, text: str, vocab: Vocabulary) -> 'numpy.ndarray':
+        """Segment a given input text and look up the IDs of its tokens.
+
+        Tokens are those of segment_spans, protected dashes include their
+        @ symbols. No joined string is built.
+
+        Returns an int32 numpy array, numpy is only needed by this call.
+        """
+        return super().segment_ids(text, vocab)
+
+    def normalize_and_segment_ids(
+        self,
+        text: str,
+        vocab: Vocabulary,
+    ) -> 'numpy.ndarray':
+        """Perform normalize then segment_ids on an input text."""
+        return super().normalize_and_segment_ids(text, vocab)
+
     def desegment(self, text: str) -> str:
         """Desegment a segmented sentence using english rules."""
         return super().desegment(text)
+
+    def normalize_batch(
+        self,
+        texts: List[str],
+        num_threads: int = 4,
+    ) -> List[str]:
+        """Normalize a batch of texts using multiple threads.
+
+        The GIL is released while the batch is processed.
+        """
+        return super().normalize_batch(texts, num_threads)
+
+    def segment_batch(
+        self,
+        texts: List[str],
+        num_threads: int = 4,
+    ) -> List[str]:
+        """Segment a batch of texts using multiple threads.
+
+        The GIL is released while the batch is processed.
+        """
+        return super().segment_batch(texts, num_threads)
+
+    def normalize_and_segment_batch(
+        self,
+        texts: List[str],
+        num_threads: int = 4,
+    ) -> List[str]:
+        """Perform normalize then segment on a batch of texts using multiple
+        threads.
+
+        The GIL is released while the batch is processed.
+        """
+        return super().normalize_and_segment_batch(texts, num_threads)
+
+    def desegment_batch(
+        self,
+        texts: List[str],
+        num_threads: int = 4,
+    ) -> List[str]:
+        """Desegment a batch of segmented sentences using multiple threads.
+
+        The GIL is released while the batch is processed.
+        """
+        return super().desegment_batch(texts, num_threads)
+
+    def process_buffers(
+        self,
+        data,
+        offsets=None,
+        mode: str = "normalize_and_segment",
+        num_threads: int = 4,
+        tokens: bool = False,
+    ) -> Tuple['numpy.ndarray', ...]:
+        """Process a batch of lines held in buffers using multiple threads.
+
+        Lines are given either as a UTF-8 data buffer and int32 or int64
+        offsets, line i being data[offsets[i]:offsets[i + 1]] as in Arrow
+        string arrays, or as a 1-D numpy bytes array when offsets is None.
+        Contiguous buffers are read without copying.
+
+        mode is one of "normalize", "segment", "normalize_and_segment" and
+        "desegment".
+
+        Returns numpy arrays with no Python object per line or token:
+            (data, offsets): uint8 data and int64 offsets of output lines.
+            With tokens, (data, token_offsets, line_offsets): uint8 data of
+            tokens back to back, int64 offsets of tokens into data and int64
+            offsets of lines into tokens.
+
+        The GIL is released while the batch is processed.
+        """
+        if offsets is not None:
+            import numpy as np
+            data = np.frombuffer(data, dtype=np.uint8)
+
+        mode = getattr(_fasttokenizer.Segmenter.Mode, mode.upper())
+        return super().process_buffers(
+            data, offsets, mode, num_threads, tokens)
+
+    def process_arrow(
+        self,
+        array,
+        mode: str = "normalize_and_segment",
+        num_threads: int = 4,
+        tokens: bool = False,
+    ):
+        """Process a pyarrow string array using multiple threads.
+
+        Buffers of the array are read without copying and outputs are
+        wrapped without copying, see process_buffers. Null lines stay null
+        in the output, whatever their offsets point at.
+
+        Returns a pyarrow LargeString array of output lines, or with tokens
+        a LargeList of LargeString array of the tokens of each line.
+        Chunked arrays are processed chunk by chunk.
+        """
+        import numpy as np
+        import pyarrow as pa
+
+        if isinstance(array, pa.ChunkedArray):
+            return pa.chunked_array([
+                self.process_arrow(chunk, mode, num_threads, tokens)
+                for chunk in array.chunks
+            ])
+
+        if pa.types.is_string(array.type) or pa.types.is_binary(array.type):
+            offset_type = np.int32
+        elif (pa.types.is_large_string(array.type)
+              or pa.types.is_large_binary(array.type)):
+            offset_type = np.int64
+        else:
+            raise TypeError("Expected a string array, got %s" % array.type)
+
+        _, offsets, data = array.buffers()[:3]
+        if offsets is None:
+            offsets = np.zeros(1, dtype=offset_type)
+        else:
+            offsets = np.frombuffer(offsets, dtype=offset_type)
+            offsets = offsets[array.offset:array.offset + len(array) + 1]
+        if data is None:
+            data = b""
+
+        # Outputs start at bit 0, unlike the validity of a sliced array
+        validity = None
+        if array.null_count > 0:
+            validity = array.is_valid().buffers()[1]
+
+        outputs = self.process_buffers(
+            data, offsets, mode, num_threads, tokens)
+        if not tokens:
+            out_data, out_offsets = outputs
+            return pa.LargeStringArray.from_buffers(
+                len(out_offsets) - 1,
+                pa.py_buffer(out_offsets),
+                pa.py_buffer(out_data),
+                validity,
+                array.null_count)
+
+        out_data, token_offsets, line_offsets = outputs
+        values = pa.LargeStringArray.from_buffers(
+            len(token_offsets) - 1,
+            pa.py_buffer(token_offsets),
+            pa.py_buffer(out_data))
+        return pa.LargeListArray.from_buffers(
+            pa.large_list(pa.large_string()),
+            len(line_offsets) - 1,
+            [validity, pa.py_buffer(line_offsets)],
+            array.null_count,
+            children=[values])
+
+    def set_invalid_utf8(self, policy: str):
+        """Set the handling of input that is not well-formed UTF-8.
+
+        policy is "replace" to turn ill-formed sequences into U+FFFD, which
+        is the default, "skip" to give an empty output or "error" to raise
+        ValueError. Only bytes and buffer inputs can be ill-formed.
+        """
+        policies = {
+            "replace": _fasttokenizer.Segmenter.InvalidUtf8.REPLACE,
+            "skip": _fasttokenizer.Segmenter.InvalidUtf8.SKIP,
+            "error": _fasttokenizer.Segmenter.InvalidUtf8.THROW,
+        }
+        super().set_invalid_utf8(policies[policy])
+
+    def stats(self) -> Dict[str, int]:
+        """Counters accumulated since construction or the last reset_stats.
+
+        Batch functions add the counters of their worker threads.
+        Per stage timings (in nanoseconds), bytes and BreakIterator segment
+        counts are only present when built with -DENABLE_STATS=ON.
+        """
+        return super().stats()
+
+    def reset_stats(self):
+        """Reset all counters to zero."""
+        super().reset_stats()
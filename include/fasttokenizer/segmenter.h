@@ -1,17 +1,171 @@
+#ifndef SEGMENTER_H
+#define SEGMENTER_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
-#include <unicode/regex.h>
+#include <unicode/uniset.h>
 #include <unicode/brkiter.h>
 #include <unicode/normalizer2.h>
+#include <unicode/utext.h>
+
+#include "fasttokenizer/protected_patterns.h"
+#include "fasttokenizer/text_scan.h"
+
+class ThreadPool;
 
 #ifdef TOKENIZER_NAMESPACE
 namespace TOKENIZER_NAMESPACE {
 #endif
 
+/**
+ * Location of a segmented token in the input text.
+ */
+struct TokenSpan {
+    enum Flags : uint8_t {
+        NONE = 0,
+        AT_PREFIX = 1,  // Token is preceded by '@', eg. "@-"
+        AT_SUFFIX = 2,  // Token is followed by '@', eg. "-@"
+    };
+
+    size_t begin;  // Byte offset of the first byte of the token
+    size_t end;  // Byte offset past the last byte of the token
+    uint8_t flags;
+
+    // Token text is not a plain substring of the input text
+    bool synthesized() const { return flags != NONE; };
+};
+
+/**
+ * Counters of lines going through each code path.
+ * Fields below cache_chunk_misses are only counted when built with
+ * TOKENIZER_STATS, stages are timed in nanoseconds of wall clock time.
+ */
+struct SegmenterStats {
+    size_t normalize_lines = 0;  // Lines normalized
+    size_t normalize_quick_lines = 0;  // Lines already in normalized form
+    size_t invalid_lines = 0;  // Ill-formed lines skipped or rejected
+
+    size_t cache_line_hits = 0;  // Lines found in the cache
+    size_t cache_line_misses = 0;  // Lines added to the cache
+    size_t cache_chunk_hits = 0;  // Whitespace delimited chunks found
+    size_t cache_chunk_misses = 0;  // Whitespace delimited chunks added
+
+    size_t segment_lines = 0;  // Lines segmented
+    size_t desegment_lines = 0;  // Lines desegmented
+    size_t ascii_lines = 0;  // Lines handled without decoding to UTF-16
+    size_t break_segments = 0;  // Segments returned by the BreakIterator
+    size_t bytes_in = 0;  // UTF-8 bytes of input lines
+    size_t bytes_out = 0;  // UTF-8 bytes written to outputs
+
+    uint64_t ascii_ns = 0;  // Byte level paths for ASCII lines
+    uint64_t decode_ns = 0;  // UTF-8 to UTF-16 conversion
+    uint64_t normalize_ns = 0;  // normalize_inbuf
+    uint64_t segment_ns = 0;  // protect_and_segment_inbuf
+    uint64_t desegment_ns = 0;  // desegment_inbuf
+    uint64_t encode_ns = 0;  // Trimming and UTF-16 to UTF-8 conversion
+
+    void merge(const SegmenterStats& other) {
+        normalize_lines += other.normalize_lines;
+        normalize_quick_lines += other.normalize_quick_lines;
+        invalid_lines += other.invalid_lines;
+
+        cache_line_hits += other.cache_line_hits;
+        cache_line_misses += other.cache_line_misses;
+        cache_chunk_hits += other.cache_chunk_hits;
+        cache_chunk_misses += other.cache_chunk_misses;
+
+        segment_lines += other.segment_lines;
+        desegment_lines += other.desegment_lines;
+        ascii_lines += other.ascii_lines;
+        break_segments += other.break_segments;
+        bytes_in += other.bytes_in;
+        bytes_out += other.bytes_out;
+
+        ascii_ns += other.ascii_ns;
+        decode_ns += other.decode_ns;
+        normalize_ns += other.normalize_ns;
+        segment_ns += other.segment_ns;
+        desegment_ns += other.desegment_ns;
+        encode_ns += other.encode_ns;
+    };
+
+    // Call f(name, value) on each counter
+    template <typename F>
+    void for_each(F f) const {
+        f("normalize_lines", (uint64_t) normalize_lines);
+        f("normalize_quick_lines", (uint64_t) normalize_quick_lines);
+        f("invalid_lines", (uint64_t) invalid_lines);
+        f("cache_line_hits", (uint64_t) cache_line_hits);
+        f("cache_line_misses", (uint64_t) cache_line_misses);
+        f("cache_chunk_hits", (uint64_t) cache_chunk_hits);
+        f("cache_chunk_misses", (uint64_t) cache_chunk_misses);
+#ifdef TOKENIZER_STATS
+        f("segment_lines", (uint64_t) segment_lines);
+        f("desegment_lines", (uint64_t) desegment_lines);
+        f("ascii_lines", (uint64_t) ascii_lines);
+        f("break_segments", (uint64_t) break_segments);
+        f("bytes_in", (uint64_t) bytes_in);
+        f("bytes_out", (uint64_t) bytes_out);
+
+        f("ascii_ns", ascii_ns);
+        f("decode_ns", decode_ns);
+        f("normalize_ns", normalize_ns);
+        f("segment_ns", segment_ns);
+        f("desegment_ns", desegment_ns);
+        f("encode_ns", encode_ns);
+#endif
+    };
+};
+
+// Instrumentation of the hot path, compiled out unless TOKENIZER_STATS is set
+// TOKENIZER_STATS_LINE starts timing a line written to out, each LAP adds
+// the time since the previous lap to a stage and END also counts the bytes
+// written to out.
+#ifdef TOKENIZER_STATS
+#define TOKENIZER_STATS_ADD(field, value) (stats.field += (value))
+#define TOKENIZER_STATS_LINE(text, out) \
+    stats.bytes_in += (text).length(); \
+    size_t stats_out_begin = (out).size(); \
+    uint64_t stats_clock = stats_now()
+#define TOKENIZER_STATS_LAP(field) stats_lap(stats.field, stats_clock)
+#define TOKENIZER_STATS_END(field, out) \
+    stats_lap(stats.field, stats_clock); \
+    stats.bytes_out += (out).size() - stats_out_begin
+#else
+#define TOKENIZER_STATS_ADD(field, value) ((void) 0)
+#define TOKENIZER_STATS_LINE(text, out) ((void) 0)
+#define TOKENIZER_STATS_LAP(field) ((void) 0)
+#define TOKENIZER_STATS_END(field, out) ((void) 0)
+#endif
+
+struct SegmenterRules;
+class SegmenterCache;
+
 class Segmenter {
+    // Times private stages in isolation, see src/bench
+    friend struct SegmenterBenchmark;
+    friend class SegmenterStream;
+
+    public:
+        // Functions that can be applied on batches of text
+        enum Mode { NORMALIZE, SEGMENT, NORMALIZE_AND_SEGMENT, DESEGMENT };
+
+        // Handling of text that is not well-formed UTF-8
+        enum InvalidUtf8 {
+            REPLACE,  // Ill-formed sequences become U+FFFD
+            SKIP,  // The output is empty, no spans are returned
+            THROW,  // std::invalid_argument is thrown
+        };
+
     private:
         bool protected_dash_split;
+        size_t long_line_bytes;
+        InvalidUtf8 invalid_utf8;
 
         // Placeholder variables
         UErrorCode icu_status;
@@ -19,41 +173,199 @@ class Segmenter {
         icu::UnicodeString outbuf;
         icu::UnicodeString tempbuf;  // Reserved for normalize_inbuf
 
-        // Private ICU objects
-        icu::RegexMatcher* non_whitespace_matcher;
-        icu::RegexMatcher* other_letter_matcher;
-        icu::RegexMatcher* protect_matcher;
-        icu::RegexMatcher* word_and_space_matcher;
+        // When set, tokens are recorded here instead of written to outbuf
+        std::vector<TokenSpan>* spans;
+
+        SegmenterStats stats;
 
-        icu::UnicodeSet* left_shift_chars;
-        icu::UnicodeSet* right_shift_chars;
-        icu::UnicodeSet* both_shift_chars;
-        icu::UnicodeSet* numeric_chars;
-        icu::UnicodeSet* whitespace_chars;
+        // Compiled character classes, shared with clones
+        std::shared_ptr<const SegmenterRules> rules;
 
-        const icu::Normalizer2* nfc_normalizer;
-        const icu::Normalizer2* nfkc_normalizer;
+        // Outputs of lines and chunks, shared with clones, null if disabled
+        std::shared_ptr<SegmenterCache> cache;
+        std::string cache_key;
+        std::string cache_value;
 
+        // Private ICU objects
         icu::BreakIterator* break_iterator;
+        UText break_text;  // Reused to point break_iterator into inbuf
+
+        // Matches patterns shared with clones, null if there are none
+        std::unique_ptr<ProtectedMatcher> protector;
+
+        // Worker pool for batch functions, created on first use, and the
+        // counters of its workers
+        mutable std::mutex batch_mutex;
+        ThreadPool* pool;
+        std::vector<Segmenter*> workers;
+        SegmenterStats batch_stats;
 
         // Private functions
-        void normalize_inbuf(int32_t start, int32_t length);
+        void decode_inbuf(icu::StringPiece text);
+        void append_token(int32_t start, int32_t end, uint8_t flags=0);
+        bool normalize_inbuf(int32_t start, int32_t length);
         void break_inbuf(int32_t start, int32_t length);
         void segment_inbuf(int32_t start, int32_t length);
         void protect_and_segment_inbuf(int32_t start, int32_t length);
+        void match_and_segment_inbuf(int32_t start, int32_t length);
+        void segment_chunks_inbuf(int32_t start, int32_t length);
         void desegment_inbuf(int32_t start, int32_t length);
 
+        // Returns false if text is skipped under the invalid_utf8 policy,
+        // only called when it is not REPLACE
+        bool accept_utf8(icu::StringPiece text);
+
+        // Byte level segmentation for pure ASCII text
+        static bool can_segment_ascii(icu::StringPiece text);
+        void segment_ascii(
+            icu::StringPiece text,
+            std::string& out,
+            bool trim=true
+        );
+        void segment_ascii_spans(
+            icu::StringPiece text,
+            std::vector<TokenSpan>& out
+        );
+
+        // Desegmentation without UTF-16 conversion
+        // Returns false if text is not well-formed UTF-8.
+        bool desegment_utf8(icu::StringPiece text, std::string& out);
+
+        // Remove leading and trailing whitespace of out[offset:] like
+        // icu::UnicodeString::trim
+        void trim_utf8(std::string& out, size_t offset);
+
+        // Segment without trimming the output, for streams and pieces
+        void segment_untrimmed(
+            bool normalize,
+            icu::StringPiece text,
+            std::string& out
+        );
+
+        // Pieces of text split at points where applying mode on each piece
+        // and joining the outputs gives the same result as on the whole
+        bool is_split_point(icu::StringPiece text, size_t pos, bool& complete);
+        void split_text(
+            Mode mode,
+            icu::StringPiece text,
+            size_t piece_bytes,
+            std::vector<icu::StringPiece>& pieces
+        );
+
+        // Line cache, cache_insert adds out[out_begin:] as the output of text
+        bool cache_find(Mode mode, icu::StringPiece text, std::string& out);
+        void cache_insert(
+            Mode mode,
+            icu::StringPiece text,
+            const std::string& out,
+            size_t out_begin
+        );
+
+        static uint64_t stats_now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        };
+
+        static void stats_lap(uint64_t& field, uint64_t& clock) {
+            uint64_t now = stats_now();
+            field += now - clock;
+            clock = now;
+        };
+        void process_batch(
+            Mode mode,
+            const std::vector<std::string>& texts,
+            std::vector<std::string>& outs,
+            int num_threads
+        ) {
+            std::vector<icu::StringPiece> pieces(texts.begin(), texts.end());
+            process_batch(mode, pieces, outs, num_threads);
+        };
+
+        Segmenter(
+            std::shared_ptr<const SegmenterRules> rules,
+            std::shared_ptr<SegmenterCache> cache,
+            std::shared_ptr<const ProtectedPatterns> patterns,
+            const bool protected_dash_split
+        );
+
     public:
-        Segmenter(const bool protected_dash_split=false);
+        // cache_size is the maximum number of lines and of chunks kept in a
+        // cache of outputs shared with clones, 0 disables the cache.
+        // Matches of protected_patterns, ICU regular expressions, and of the
+        // ProtectedPatterns::Builtin flags in protected_builtins are kept as
+        // single tokens like text enclosed in \x1F separators. Long lines
+        // and streams are split at spaces, so matches should not hold any.
+        // Throws std::invalid_argument if a pattern does not compile.
+        Segmenter(
+            const bool protected_dash_split=false,
+            const size_t cache_size=0,
+            const std::vector<std::string>& protected_patterns={},
+            const int protected_builtins=ProtectedPatterns::NONE
+        );
         ~Segmenter();
         Segmenter* clone();
 
+        // Lines longer than long_line_bytes are split into pieces of about
+        // that size which batch functions process on separate threads,
+        // 0 disables splitting. Outputs are the same either way.
+        void set_long_line_bytes(size_t long_line_bytes) {
+            this->long_line_bytes = long_line_bytes;
+        };
+
+        // Ill-formed UTF-8 is replaced by default. Other policies validate
+        // each text before it is decoded and count ill-formed ones in
+        // invalid_lines, ASCII text is let through without a second pass.
+        // Streams apply the policy to each piece they process.
+        void set_invalid_utf8(InvalidUtf8 invalid_utf8) {
+            this->invalid_utf8 = invalid_utf8;
+        };
+
+        // Counters accumulated since construction or the last reset
+        // Batch functions add the counters of their workers.
+        SegmenterStats get_stats() const {
+            SegmenterStats total = stats;
+            std::lock_guard<std::mutex> lock(batch_mutex);
+            total.merge(batch_stats);
+            return total;
+        };
+        void reset_stats() {
+            stats = SegmenterStats();
+            std::lock_guard<std::mutex> lock(batch_mutex);
+            batch_stats = SegmenterStats();
+        };
+
         // Normalize
-        void normalize(const std::string& text, std::string& out) {
-            inbuf = icu::UnicodeString::fromUTF8(icu::StringPiece(text));
+        void normalize(icu::StringPiece text, std::string& out) {
+            ++stats.normalize_lines;
+            TOKENIZER_STATS_LINE(text, out);
+
+            // ASCII is unchanged by NFC and NFKC
+            if (is_ascii(text.data(), text.length())) {
+                ++stats.normalize_quick_lines;
+                TOKENIZER_STATS_ADD(ascii_lines, 1);
+                out.append(text.data(), text.length());
+                TOKENIZER_STATS_END(ascii_ns, out);
+                return;
+            };
+
+            if (invalid_utf8 != REPLACE && !accept_utf8(text)) return;
+            if (cache && cache_find(NORMALIZE, text, out)) return;
+            size_t out_begin = out.size();
+
+            decode_inbuf(text);
+            TOKENIZER_STATS_LAP(decode_ns);
             outbuf.remove();
-            normalize_inbuf(0, inbuf.length());
-            outbuf.toUTF8String(out);
+            bool is_normalized = normalize_inbuf(0, inbuf.length());
+            TOKENIZER_STATS_LAP(normalize_ns);
+            if (is_normalized) {
+                ++stats.normalize_quick_lines;
+                inbuf.toUTF8String(out);
+            } else {
+                outbuf.toUTF8String(out);
+            };
+            TOKENIZER_STATS_END(encode_ns, out);
+
+            if (cache) cache_insert(NORMALIZE, text, out, out_begin);
         };
 
         std::string normalize(const std::string& text) {
@@ -63,13 +375,32 @@ class Segmenter {
         };
 
         // Segment
-        void segment(const std::string& text, std::string& out) {
-            inbuf = icu::UnicodeString::fromUTF8(icu::StringPiece(text));
+        void segment(icu::StringPiece text, std::string& out) {
+            TOKENIZER_STATS_ADD(segment_lines, 1);
+            TOKENIZER_STATS_LINE(text, out);
+
+            if (can_segment_ascii(text)) {
+                TOKENIZER_STATS_ADD(ascii_lines, 1);
+                segment_ascii(text, out);
+                TOKENIZER_STATS_END(ascii_ns, out);
+                return;
+            };
+
+            if (invalid_utf8 != REPLACE && !accept_utf8(text)) return;
+            if (cache && cache_find(SEGMENT, text, out)) return;
+            size_t out_begin = out.size();
+
+            decode_inbuf(text);
+            TOKENIZER_STATS_LAP(decode_ns);
             outbuf.remove();
             protect_and_segment_inbuf(0, inbuf.length());
+            TOKENIZER_STATS_LAP(segment_ns);
             outbuf.trim();
 
             outbuf.toUTF8String(out);
+            TOKENIZER_STATS_END(encode_ns, out);
+
+            if (cache) cache_insert(SEGMENT, text, out, out_begin);
         };
 
         std::string segment(const std::string& text) {
@@ -79,17 +410,43 @@ class Segmenter {
         };
 
         // Normalize and segment
-        void normalize_and_segment(const std::string& text, std::string& out) {
-            inbuf = icu::UnicodeString::fromUTF8(icu::StringPiece(text));
-            outbuf.remove();
-            normalize_inbuf(0, inbuf.length());
+        void normalize_and_segment(icu::StringPiece text, std::string& out) {
+            ++stats.normalize_lines;
+            TOKENIZER_STATS_ADD(segment_lines, 1);
+            TOKENIZER_STATS_LINE(text, out);
+
+            if (can_segment_ascii(text)) {
+                ++stats.normalize_quick_lines;
+                TOKENIZER_STATS_ADD(ascii_lines, 1);
+                segment_ascii(text, out);
+                TOKENIZER_STATS_END(ascii_ns, out);
+                return;
+            };
 
-            inbuf = outbuf;
+            if (invalid_utf8 != REPLACE && !accept_utf8(text)) return;
+            if (cache && cache_find(NORMALIZE_AND_SEGMENT, text, out)) return;
+            size_t out_begin = out.size();
+
+            decode_inbuf(text);
+            TOKENIZER_STATS_LAP(decode_ns);
             outbuf.remove();
+            if (normalize_inbuf(0, inbuf.length())) {
+                ++stats.normalize_quick_lines;
+            } else {
+                inbuf.swap(outbuf);
+                outbuf.remove();
+            };
+            TOKENIZER_STATS_LAP(normalize_ns);
             protect_and_segment_inbuf(0, inbuf.length());
+            TOKENIZER_STATS_LAP(segment_ns);
 
             outbuf.trim();
             outbuf.toUTF8String(out);
+            TOKENIZER_STATS_END(encode_ns, out);
+
+            if (cache) {
+                cache_insert(NORMALIZE_AND_SEGMENT, text, out, out_begin);
+            };
         };
 
         std::string normalize_and_segment(const std::string& text) {
@@ -98,14 +455,54 @@ class Segmenter {
             return out;
         };
 
+        // Segment into token spans
+        // Spans hold byte offsets into text, protected sequences are kept as
+        // a single span and whitespace only tokens are left out.
+        void segment_spans(
+            icu::StringPiece text,
+            std::vector<TokenSpan>& out
+        );
+
+        std::vector<TokenSpan> segment_spans(const std::string& text) {
+            std::vector<TokenSpan> out;
+            segment_spans(text, out);
+            return out;
+        };
+
+        // Normalize and segment into token spans
+        // Spans hold byte offsets into the normalized text.
+        void normalize_and_segment_spans(
+            icu::StringPiece text,
+            std::string& normalized,
+            std::vector<TokenSpan>& out
+        );
+
         // Desegment
-        void desegment(const std::string& text, std::string& out) {
-            inbuf = icu::UnicodeString::fromUTF8(icu::StringPiece(text));
+        void desegment(icu::StringPiece text, std::string& out) {
+            TOKENIZER_STATS_ADD(desegment_lines, 1);
+            TOKENIZER_STATS_LINE(text, out);
+
+            if (invalid_utf8 != REPLACE && !accept_utf8(text)) return;
+            if (cache && cache_find(DESEGMENT, text, out)) return;
+            size_t out_begin = out.size();
+
+            if (desegment_utf8(text, out)) {
+                TOKENIZER_STATS_END(desegment_ns, out);
+                if (cache) cache_insert(DESEGMENT, text, out, out_begin);
+                return;
+            };
+
+            decode_inbuf(text);
+            TOKENIZER_STATS_LAP(decode_ns);
             outbuf.remove();
             desegment_inbuf(0, inbuf.length());
+            TOKENIZER_STATS_LAP(desegment_ns);
             outbuf.trim();
 
             outbuf.toUTF8String(out);
+            TOKENIZER_STATS_END(encode_ns, out);
+
+            if (cache) cache_insert(DESEGMENT, text, out, out_begin);
         };
 
         std::string desegment(const std::string& text) {
@@ -113,8 +510,161 @@ class Segmenter {
             desegment(text, out);
             return out;
         };
+
+        // Apply a single mode on text
+        void process(Mode mode, icu::StringPiece text, std::string& out);
+
+        // Apply a single mode on UTF-16 text, for callers that hold text as
+        // UTF-16 already. Read-only aliases of text are not copied and the
+        // line cache is not used. The output is valid until the next call
+        // and may alias text.
+        const icu::UnicodeString& process_utf16(
+            Mode mode,
+            const icu::UnicodeString& text
+        );
+
+        // Long lines, for callers running pieces on threads of their own.
+        // split_long_line gives the pieces of text when it is longer than
+        // long_line_bytes and can be split under mode, otherwise it returns
+        // false and leaves pieces empty. Appending process_piece of each
+        // piece in order to out, then finish_pieces on what was appended
+        // from offset on, gives the output of mode on the whole text.
+        // Pieces can be processed by different clones.
+        bool split_long_line(
+            Mode mode,
+            icu::StringPiece text,
+            std::vector<icu::StringPiece>& pieces
+        );
+        void process_piece(Mode mode, icu::StringPiece piece, std::string& out);
+        void finish_pieces(Mode mode, std::string& out, size_t offset) {
+            if (mode != NORMALIZE) trim_utf8(out, offset);
+        };
+
+        // Batch functions
+        // Lines are processed by num_threads cloned segmenters which are kept
+        // alive between calls, this segmenter itself is never used. Batch
+        // calls on the same object are serialized and may run concurrently
+        // with any other call, while all other calls, including get_stats
+        // and the setters, must not run concurrently with each other.
+        void process_batch(
+            Mode mode,
+            const std::vector<icu::StringPiece>& texts,
+            std::vector<std::string>& outs,
+            int num_threads=4
+        );
+
+        void normalize_batch(
+            const std::vector<std::string>& texts,
+            std::vector<std::string>& outs,
+            int num_threads=4
+        ) {
+            process_batch(NORMALIZE, texts, outs, num_threads);
+        };
+
+        std::vector<std::string> normalize_batch(
+            const std::vector<std::string>& texts,
+            int num_threads=4
+        ) {
+            std::vector<std::string> outs;
+            normalize_batch(texts, outs, num_threads);
+            return outs;
+        };
+
+        void segment_batch(
+            const std::vector<std::string>& texts,
+            std::vector<std::string>& outs,
+            int num_threads=4
+        ) {
+            process_batch(SEGMENT, texts, outs, num_threads);
+        };
+
+        std::vector<std::string> segment_batch(
+            const std::vector<std::string>& texts,
+            int num_threads=4
+        ) {
+            std::vector<std::string> outs;
+            segment_batch(texts, outs, num_threads);
+            return outs;
+        };
+
+        void normalize_and_segment_batch(
+            const std::vector<std::string>& texts,
+            std::vector<std::string>& outs,
+            int num_threads=4
+        ) {
+            process_batch(NORMALIZE_AND_SEGMENT, texts, outs, num_threads);
+        };
+
+        std::vector<std::string> normalize_and_segment_batch(
+            const std::vector<std::string>& texts,
+            int num_threads=4
+        ) {
+            std::vector<std::string> outs;
+            normalize_and_segment_batch(texts, outs, num_threads);
+            return outs;
+        };
+
+        void desegment_batch(
+            const std::vector<std::string>& texts,
+            std::vector<std::string>& outs,
+            int num_threads=4
+        ) {
+            process_batch(DESEGMENT, texts, outs, num_threads);
+        };
+
+        std::vector<std::string> desegment_batch(
+            const std::vector<std::string>& texts,
+            int num_threads=4
+        ) {
+            std::vector<std::string> outs;
+            desegment_batch(texts, outs, num_threads);
+            return outs;
+        };
+};
+
+/**
+ * Normalizes and/or segments a document of unbounded length that is fed in
+ * chunks of any size, chunks do not have to end on character boundaries.
+ *
+ * Output is appended to out as soon as it can no longer change and is the
+ * same as that of the one-shot functions on the whole document. Text is held
+ * back from the last space after which the rest can be processed on its own,
+ * so memory stays bounded as long as the document has spaces and protected
+ * sequences are closed.
+ */
+class SegmenterStream {
+    private:
+        Segmenter& segmenter;
+        Segmenter::Mode mode;
+
+        std::string pending;  // Input not processed yet
+        size_t scan_pos;  // Bytes of pending checked for split points
+        size_t split_pos;  // Last split point found in pending
+        bool in_protected;  // Inside a \x1F protected sequence at scan_pos
+
+        std::string output;  // Output of the last processed text
+        std::string trailing;  // Trimmable end of the output so far
+        bool started;  // Anything but trimmable characters was written
+
+        void process(size_t length, std::string& out);
+
+    public:
+        // The segmenter is used by the stream and must outlive it
+        SegmenterStream(
+            Segmenter& segmenter,
+            const bool normalize=true,
+            const bool segment=true
+        );
+
+        // Add a chunk of the document
+        void feed(icu::StringPiece chunk, std::string& out);
+
+        // End the document, the stream can then be reused for another one
+        void flush(std::string& out);
 };
 
 #ifdef TOKENIZER_NAMESPACE
 };
 #endif
+
+#endif
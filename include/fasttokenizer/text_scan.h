@@ -0,0 +1,59 @@
+#ifndef TEXT_SCAN_H
+#define TEXT_SCAN_H
+
+#include <cstddef>
+#include <vector>
+
+#ifdef TOKENIZER_NAMESPACE
+namespace TOKENIZER_NAMESPACE {
+#endif
+
+/**
+ * Byte scans over UTF-8 text that run before any ICU work.
+ *
+ * Checks of ASCII, UTF-8, spaces and links have AVX2, SSE4.2 and scalar versions,
+ * the best one the CPU supports is picked on first use. Setting the
+ * environment variable FASTTOKENIZER_SIMD to "sse4.2" or "scalar" picks a
+ * lower one.
+ */
+
+// Instruction set of the checks, "avx2", "sse4.2" or "scalar"
+const char* text_scan_isa();
+
+// Check if all bytes are below 0x80
+bool is_ascii(const char* data, size_t size);
+
+// Length of the longest prefix of data that is well-formed UTF-8, size if
+// all of it is. Surrogates, overlong forms and code points above U+10FFFF
+// are ill-formed, as for ICU.
+size_t utf8_valid_prefix(const char* data, size_t size);
+
+inline bool is_valid_utf8(const char* data, size_t size) {
+    return utf8_valid_prefix(data, size) == size;
+}
+
+// First byte in [begin, end) that is below 0x21 or not ASCII, end if there
+// is none. Every White_Space character starts with such a byte.
+const char* find_space_candidate(const char* begin, const char* end);
+
+// First byte in [begin, end) that is '@' or starts "://" or "www." in any
+// case, end if there is none. Built-in URL and email patterns are anchored
+// on these.
+const char* find_link_candidate(const char* begin, const char* end);
+
+// Append the offsets of newlines in data[begin:end] to ends until it holds
+// max_ends offsets. Returns the offset scanning stopped at, past the last
+// newline appended if ends is full, end otherwise.
+size_t find_newlines(
+    const char* data,
+    size_t begin,
+    size_t end,
+    std::vector<size_t>& ends,
+    size_t max_ends
+);
+
+#ifdef TOKENIZER_NAMESPACE
+};
+#endif
+
+#endif
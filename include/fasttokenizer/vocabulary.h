@@ -0,0 +1,89 @@
+#ifndef VOCABULARY_H
+#define VOCABULARY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <unicode/stringpiece.h>
+
+#include "fasttokenizer/segmenter.h"
+
+#ifdef TOKENIZER_NAMESPACE
+namespace TOKENIZER_NAMESPACE {
+#endif
+
+/**
+ * Maps tokens to int32 IDs.
+ *
+ * Tokens are kept back to back in a single buffer and looked up through an
+ * open addressing table of 8 byte slots holding a hash and an ID, so a
+ * lookup usually touches one slot and the token bytes it is compared with.
+ * The table is read-only once loaded and can be shared between threads.
+ */
+class Vocabulary {
+    private:
+        struct Slot {
+            uint32_t hash;
+            int32_t id;  // -1 if empty
+        };
+
+        // Token i is tokens[offsets[i]:offsets[i + 1]]
+        std::string tokens;
+        std::vector<uint32_t> offsets;
+        std::vector<Slot> slots;
+        uint32_t mask;
+        int32_t unk_id;
+
+        // FNV-1a, h continues the hash of preceding bytes
+        static uint32_t hash(
+            const char* data,
+            size_t size,
+            uint32_t h=2166136261u
+        );
+        void add(icu::StringPiece token);
+        void build_table();
+
+        // ID of token with an @ before and/or after it, without joining them
+        int32_t find_affixed(
+            icu::StringPiece token,
+            bool at_prefix,
+            bool at_suffix
+        ) const;
+
+    public:
+        // Load a vocabulary file holding a token per line, IDs are line
+        // numbers counted from 0. Anything after a tab on a line is ignored,
+        // so frequency and score columns are allowed. Tokens missing from
+        // the vocabulary get the ID of unk_token, or size() if unk_token is
+        // not in it either. Throws std::runtime_error if path can't be read.
+        Vocabulary(
+            const std::string& path,
+            const std::string& unk_token="<unk>"
+        );
+
+        // Vocabulary of tokens in order of their IDs
+        Vocabulary(
+            const std::vector<std::string>& tokens,
+            const std::string& unk_token="<unk>"
+        );
+
+        size_t size() const { return offsets.size() - 1; };
+        int32_t get_unk_id() const { return unk_id; };
+
+        // ID of token, the unknown token ID if it is not in the vocabulary
+        int32_t find(icu::StringPiece token) const;
+
+        // Append the IDs of the tokens at spans of text to ids
+        void find_spans(
+            icu::StringPiece text,
+            const std::vector<TokenSpan>& spans,
+            std::vector<int32_t>& ids
+        ) const;
+};
+
+#ifdef TOKENIZER_NAMESPACE
+};
+#endif
+
+#endif
@@ -0,0 +1,369 @@
+#include <cstring>
+
+#include <unicode/brkiter.h>
+#include <unicode/uchar.h>
+
+#include "fasttokenizer/segmenter.h"
+
+using namespace icu;
+
+#ifdef TOKENIZER_NAMESPACE
+namespace TOKENIZER_NAMESPACE {
+#endif
+
+static const char UNIT_SEPARATOR = '\x1F';
+
+/**
+ * Word break classes of ASCII characters under the ICU word BreakIterator.
+ * ICU tailors the Unicode properties (eg. colon is not a MidLetter) and the
+ * tailoring changes between versions, so classes are probed from the linked
+ * ICU rather than hardcoded.
+ */
+enum AsciiClass : uint8_t {
+    OTHER,
+    LETTER,         // ALetter
+    NUMERIC,        // Numeric
+    EXTEND_NUM_LET, // ExtendNumLet
+    MID_LETTER,     // MidLetter
+    MID_NUM_LET,    // MidNumLet and Single_Quote
+    MID_NUM,        // MidNum
+    SPACE,          // WSegSpace
+    CR,             // CR
+};
+
+struct AsciiTable {
+    bool valid;
+    uint8_t word_break[128];
+    bool separator[128];  // [:Z:], segments starting with these are dropped
+    bool trimmed[128];  // Removed by icu::UnicodeString::trim
+    bool whitespace[128];  // White_Space, tokens made of these have no span
+
+    AsciiTable();
+};
+
+/**
+ * Check if the word BreakIterator keeps s as a single segment.
+ */
+static bool is_one_segment(BreakIterator* break_iterator, const char* s) {
+    UnicodeString us;
+    for (; *s; ++s) us.append((char16_t)*s);
+    break_iterator->setText(us);
+    break_iterator->first();
+    return break_iterator->next() == us.length();
+};
+
+AsciiTable::AsciiTable() : valid(false) {
+    UErrorCode icu_status = U_ZERO_ERROR;
+    BreakIterator* break_iterator = BreakIterator::createWordInstance(
+        Locale::getUS(), icu_status);
+    if (U_FAILURE(icu_status)) {
+        delete break_iterator;
+        return;
+    };
+
+    for (int c=0; c<128; ++c) {
+        separator[c] = (U_GET_GC_MASK(c) & U_GC_Z_MASK) != 0;
+        trimmed[c] = c == 0x20 || u_isWhitespace(c);
+        whitespace[c] = u_isUWhiteSpace(c);
+
+        if (c == 0) {
+            // Probes are null terminated, but NUL is a plain control
+            word_break[c] = OTHER;
+            continue;
+        };
+
+        char a[] = {'a', (char)c, 0};
+        char b[] = {(char)c, 'a', 0};
+        if (is_one_segment(break_iterator, a)
+            && is_one_segment(break_iterator, b)
+        ) {
+            char letter[] = {(char)c, '.', 'a', 0};
+            char numeric[] = {(char)c, ',', '1', 0};
+            if (is_one_segment(break_iterator, letter)) {
+                word_break[c] = LETTER;
+            } else if (is_one_segment(break_iterator, numeric)) {
+                word_break[c] = NUMERIC;
+            } else {
+                word_break[c] = EXTEND_NUM_LET;
+            };
+            continue;
+        };
+
+        char mid_letter[] = {'a', (char)c, 'a', 0};
+        char mid_num[] = {'1', (char)c, '1', 0};
+        char repeated[] = {(char)c, (char)c, 0};
+        char crlf[] = {(char)c, '\n', 0};
+        bool is_mid_letter = is_one_segment(break_iterator, mid_letter);
+        bool is_mid_num = is_one_segment(break_iterator, mid_num);
+        if (is_mid_letter && is_mid_num) {
+            word_break[c] = MID_NUM_LET;
+        } else if (is_mid_letter) {
+            word_break[c] = MID_LETTER;
+        } else if (is_mid_num) {
+            word_break[c] = MID_NUM;
+        } else if (is_one_segment(break_iterator, repeated)) {
+            word_break[c] = SPACE;
+        } else if (is_one_segment(break_iterator, crlf)) {
+            word_break[c] = CR;
+        } else {
+            word_break[c] = OTHER;
+        };
+    };
+    delete break_iterator;
+
+    // Segmentation below relies on these
+    valid = word_break[(uint8_t)'a'] == LETTER
+        && word_break[(uint8_t)'1'] == NUMERIC
+        && word_break[(uint8_t)'.'] == MID_NUM_LET
+        && word_break[(uint8_t)','] == MID_NUM
+        && word_break[(uint8_t)' '] == SPACE
+        && separator[(uint8_t)' '];
+};
+
+static const AsciiTable& ascii_table() {
+    static const AsciiTable table;
+    return table;
+};
+
+static inline bool is_word(uint8_t cls) {
+    return cls == LETTER || cls == NUMERIC || cls == EXTEND_NUM_LET;
+};
+
+/**
+ * Find the end of the word break segment that starts at text[i].
+ * Segments never extend past end.
+ */
+static size_t segment_end(
+    const uint8_t* word_break,
+    const char* text,
+    size_t i,
+    size_t end
+) {
+    uint8_t cls = word_break[(uint8_t)text[i]];
+
+    switch (cls) {
+    case SPACE:
+        // WB3d
+        while (++i < end && word_break[(uint8_t)text[i]] == SPACE);
+        return i;
+
+    case CR:
+        // WB3
+        if (i + 1 < end && text[i + 1] == '\n') return i + 2;
+        return i + 1;
+
+    case LETTER:
+    case NUMERIC:
+    case EXTEND_NUM_LET:
+        break;
+
+    default:
+        return i + 1;
+    };
+
+    uint8_t prev = cls;
+    size_t k = i + 1;
+    while (k < end) {
+        cls = word_break[(uint8_t)text[k]];
+
+        // WB5, WB8, WB9, WB10, WB13a, WB13b
+        if (is_word(cls)) {
+            prev = cls;
+            ++k;
+            continue;
+        };
+
+        // WB6, WB7, WB11, WB12
+        if (k + 1 < end) {
+            uint8_t next = word_break[(uint8_t)text[k + 1]];
+            bool letter_mid = cls == MID_LETTER || cls == MID_NUM_LET;
+            bool numeric_mid = cls == MID_NUM || cls == MID_NUM_LET;
+            if (
+                (prev == LETTER && next == LETTER && letter_mid) ||
+                (prev == NUMERIC && next == NUMERIC && numeric_mid)
+            ) {
+                prev = next;
+                k += 2;
+                continue;
+            };
+        };
+        break;
+    };
+    return k;
+};
+
+/**
+ * Collects tokens into a whitespace joined string.
+ */
+struct AsciiStringSink {
+    StringPiece text;
+    std::string& out;
+
+    void token(size_t begin, size_t end, uint8_t flags) {
+        if (flags & TokenSpan::AT_PREFIX) out.push_back('@');
+        out.append(text.data() + begin, end - begin);
+        if (flags & TokenSpan::AT_SUFFIX) out.push_back('@');
+        out.push_back(' ');
+    };
+
+    void protected_token(size_t begin, size_t end) {
+        // Joined string output has always kept the closing separator
+        token(begin, end + 1, TokenSpan::NONE);
+    };
+};
+
+/**
+ * Collects tokens as spans.
+ */
+struct AsciiSpanSink {
+    StringPiece text;
+    std::vector<TokenSpan>& out;
+
+    void token(size_t begin, size_t end, uint8_t flags) {
+        // Leave out tokens that would be lost when splitting by whitespace
+        const AsciiTable& table = ascii_table();
+        for (size_t i=begin; i<end; ++i) {
+            if (!table.whitespace[(uint8_t)text.data()[i]]) {
+                out.push_back({begin, end, flags});
+                return;
+            };
+        };
+    };
+
+    void protected_token(size_t begin, size_t end) {
+        token(begin, end, TokenSpan::NONE);
+    };
+};
+
+/**
+ * Byte level equivalent of break_inbuf.
+ */
+template <class Sink>
+static void break_ascii(
+    StringPiece text,
+    size_t start,
+    size_t end,
+    bool protected_dash_split,
+    Sink& sink
+) {
+    const AsciiTable& table = ascii_table();
+    const char* data = text.data();
+    size_t p0 = start;
+    while (p0 < end) {
+        size_t p1 = segment_end(table.word_break, data, p0, end);
+
+        if (table.separator[(uint8_t)data[p0]]) {
+            // pass
+
+        } else if (protected_dash_split && p1 - p0 == 1 && data[p0] == '-') {
+            // Neighbours are looked up in the full text like break_inbuf
+            uint8_t flags = TokenSpan::NONE;
+            if (p0 > 0 && !table.separator[(uint8_t)data[p0 - 1]]) {
+                flags |= TokenSpan::AT_PREFIX;
+            };
+            if (p1 < (size_t)text.length() && !table.separator[(uint8_t)data[p1]]) {
+                flags |= TokenSpan::AT_SUFFIX;
+            };
+            sink.token(p0, p1, flags);
+
+        } else {
+            sink.token(p0, p1, TokenSpan::NONE);
+        };
+
+        p0 = p1;
+    };
+};
+
+/**
+ * Byte level equivalent of match_and_segment_inbuf.
+ */
+template <class Sink>
+static void match_and_break_ascii(
+    StringPiece text,
+    size_t start,
+    size_t end,
+    bool protected_dash_split,
+    ProtectedMatcher* protector,
+    Sink& sink
+) {
+    if (protector == nullptr) {
+        break_ascii(text, start, end, protected_dash_split, sink);
+        return;
+    };
+
+    size_t m0, m1;
+    size_t p0 = start;
+    protector->reset(text.data() + start, end - start);
+    while (protector->next(m0, m1)) {
+        break_ascii(text, p0, start + m0, protected_dash_split, sink);
+        sink.token(start + m0, start + m1, TokenSpan::NONE);
+        p0 = start + m1;
+    };
+    break_ascii(text, p0, end, protected_dash_split, sink);
+};
+
+/**
+ * Byte level equivalent of protect_and_segment_inbuf.
+ * ASCII text has no Lo characters, so segment_inbuf reduces to break_inbuf.
+ */
+template <class Sink>
+static void protect_and_segment_ascii(
+    StringPiece text,
+    bool protected_dash_split,
+    ProtectedMatcher* protector,
+    Sink& sink
+) {
+    const char* data = text.data();
+    size_t length = text.length();
+    size_t p0 = 0;
+    while (p0 < length) {
+        const char* p1 = (const char*) std::memchr(
+            data + p0, UNIT_SEPARATOR, length - p0);
+        if (p1 == nullptr) break;
+        const char* p2 = (const char*) std::memchr(
+            p1 + 1, UNIT_SEPARATOR, data + length - p1 - 1);
+        if (p2 == nullptr) break;
+
+        match_and_break_ascii(
+            text, p0, p1 - data, protected_dash_split, protector, sink);
+        sink.protected_token(p1 + 1 - data, p2 - data);
+        p0 = p2 + 1 - data;
+    };
+    match_and_break_ascii(
+        text, p0, length, protected_dash_split, protector, sink);
+};
+
+bool Segmenter::can_segment_ascii(StringPiece text) {
+    return ascii_table().valid && is_ascii(text.data(), text.length());
+};
+
+void Segmenter::segment_ascii(StringPiece text, std::string& out, bool trim) {
+    size_t offset = out.length();
+    AsciiStringSink sink = {text, out};
+    protect_and_segment_ascii(
+        text, protected_dash_split, protector.get(), sink);
+    if (!trim) return;
+
+    // Same as outbuf.trim()
+    const AsciiTable& table = ascii_table();
+    size_t end = out.length();
+    while (end > offset && table.trimmed[(uint8_t)out[end - 1]]) --end;
+    out.resize(end);
+
+    size_t begin = offset;
+    while (begin < end && table.trimmed[(uint8_t)out[begin]]) ++begin;
+    if (begin > offset) out.erase(offset, begin - offset);
+};
+
+void Segmenter::segment_ascii_spans(
+    StringPiece text,
+    std::vector<TokenSpan>& out
+) {
+    AsciiSpanSink sink = {text, out};
+    protect_and_segment_ascii(
+        text, protected_dash_split, protector.get(), sink);
+};
+
+#ifdef TOKENIZER_NAMESPACE
+}; // namespace
+#endif
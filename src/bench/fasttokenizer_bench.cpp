@@ -0,0 +1,375 @@
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "fasttokenizer/segmenter.h"
+
+using namespace icu;
+
+#ifdef TOKENIZER_NAMESPACE
+namespace TOKENIZER_NAMESPACE {
+#endif
+
+/**
+ * Runs the private stages of a segmenter on a single line.
+ * Each stage reads inbuf and writes outbuf like the public functions do.
+ */
+struct SegmenterBenchmark {
+    enum Stage {
+        NORMALIZE,
+        PROTECT_AND_SEGMENT,
+        SEGMENT,
+        BREAK,
+        DESEGMENT,
+    };
+
+    static void run_stage(
+        Segmenter& segmenter,
+        Stage stage,
+        const UnicodeString& text
+    ) {
+        segmenter.inbuf = text;
+        segmenter.outbuf.remove();
+        int32_t length = segmenter.inbuf.length();
+
+        switch (stage) {
+        case NORMALIZE:
+            segmenter.normalize_inbuf(0, length);
+            break;
+
+        case PROTECT_AND_SEGMENT:
+            segmenter.protect_and_segment_inbuf(0, length);
+            break;
+
+        case SEGMENT:
+            segmenter.segment_inbuf(0, length);
+            break;
+
+        case BREAK:
+            segmenter.break_inbuf(0, length);
+            break;
+
+        case DESEGMENT:
+            segmenter.desegment_inbuf(0, length);
+            break;
+        }
+        benchmark::DoNotOptimize(segmenter.outbuf.getBuffer());
+    };
+};
+
+#ifdef TOKENIZER_NAMESPACE
+}; // namespace
+
+using namespace TOKENIZER_NAMESPACE;
+#endif
+
+typedef std::vector<std::string> vecstr;
+
+/**
+ * A named set of input lines.
+ * desegment_lines holds the segmented lines, the input of desegmentation.
+ */
+typedef struct {
+    std::string name;
+    vecstr lines;
+    vecstr desegment_lines;
+    size_t num_bytes;
+    size_t desegment_num_bytes;
+} SampleSet;
+
+static const char* LATIN_LINES[] = {
+    "A typical master's programme has a duration of 1-1.5 years.",
+    "L'élève a reçu 15,5 points sur 20 à l'examen de mathématiques.",
+    "Die Straße ist 3,2 km lang und führt über die Brücke.",
+    "¿Dónde está la estación? ¡Está a 200 m de aquí!",
+    "Tiếng Việt có sáu thanh điệu khác nhau trong chữ Quốc ngữ.",
+    "Zażółć gęślą jaźń, powiedział \"pan\" Kowalski (w 1999 r.).",
+    "It costs $25.99 (excl. VAT) - or €23,50 - per month.",
+    "Ørsted's data-driven state-of-the-art approach, e.g. 2.5x faster.",
+};
+
+static const char* ASCII_LINES[] = {
+    "A typical master's programme has a duration of 1-1.5 years.",
+    "Hello World! This is a test of the tokenizer, isn't it?",
+    "The price is $1,234.56 (about 20% off) as of 2020-05-17.",
+    "See https://example.com/a/b?c=d&e=f for more details.",
+    "\"Quoted\" text, [brackets] and {braces}; semi-colons: too.",
+    "state-of-the-art co-operation re-entry e-mail x-ray",
+    "Mr. O'Neil's dog can't run 3.5km/h... or can it?!",
+    "user@example.com wrote: 100 / 3 = 33.33 | done \\ ok",
+};
+
+static const char* CJK_LINES[] = {
+    "今天天气很好，我们去公园散步吧。",
+    "这个项目的预算是1,500万元人民币（约合210万美元）。",
+    "東京都は日本の首都であり、人口は約1400万人です。",
+    "私はコーヒーが好きですが、紅茶も時々飲みます。",
+    "カタカナとひらがなと漢字を混ぜて書きます。",
+    "서울은 대한민국의 수도이며 인구는 약 970만 명입니다.",
+    "한국어 문장은 띄어쓰기를 사용합니다.",
+    "「你好」她说：“我们明天见！”",
+};
+
+static const char* THAI_LINES[] = {
+    "ภาษาไทยเป็นภาษาที่ไม่มีการเว้นวรรคระหว่างคำ",
+    "กรุงเทพมหานครเป็นเมืองหลวงของประเทศไทย",
+    "วันนี้อากาศดีมาก เราไปเที่ยวทะเลกันเถอะ",
+    "ราคาสินค้านี้คือ 1,250 บาท รวมภาษีมูลค่าเพิ่มแล้ว",
+    "นักเรียนทุกคนต้องมาโรงเรียนก่อนเวลา 8.00 น.",
+    "ผมชอบกินข้าวผัดกะเพราไก่ไข่ดาว",
+};
+
+static const char* ARABIC_LINES[] = {
+    "اللغة العربية هي إحدى اللغات الرسمية في الأمم المتحدة.",
+    "يبلغ عدد سكان القاهرة حوالي ٢٠ مليون نسمة.",
+    "ذهبتُ إلى المكتبةِ لأشتريَ كتاباً جديداً.",
+    "فارسی زبان رسمی ایران، افغانستان و تاجیکستان است.",
+    "השפה העברית נכתבת מימין לשמאל.",
+    "السعر: ١٢٫٥ دولار (شامل الضريبة) - أليس كذلك؟",
+};
+
+static const char* MIXED_LINES[] = {
+    "Ｆｕｌｌｗｉｄｔｈ ＡＢＣ １２３ and ｶﾀｶﾅ need NFKC.",
+    "The word 東京 means \"eastern capital\" in Japanese.",
+    "Emoji 👍🏽 and flags 🇸🇬 in a sentence 😀!",
+    "Москва - столица России, население ~12,6 млн.",
+    "Ελληνικά: Η Αθήνα είναι η πρωτεύουσα της Ελλάδας.",
+    "हिन्दी भारत की राजभाषा है और १२३ करोड़ लोग रहते हैं।",
+    "ﬁne ligatures, ² superscripts, ½ fractions and № signs.",
+    "Combining e\xcc\x81 and Å vs A\xcc\x8a in one line.",
+};
+
+static const char* PROTECTED_LINES[] = {
+    "Visit \x1Fhttps://example.com/a-b/c.d?e=f\x1F for details.",
+    "Call \x1F+65 6123-4567\x1F or mail \x1Fuser@example.com\x1F now.",
+    "Keep \x1F" "1.5-2.5\x1F as is but split 1.5-2.5 here.",
+    "\x1F<b>\x1F" "Bold\x1F</b>\x1F text in \x1F<i>\x1Fitalics\x1F</i>\x1F.",
+    "東京の\x1FURL: https://例え.jp/パス\x1Fを保護します。",
+    "Unclosed \x1F separator keeps the rest segmented.",
+};
+
+// Long lines are built by repeating the mixed sets up to this many bytes
+static const size_t LONG_LINE_BYTES = 64 * 1024;
+static const size_t NUM_LONG_LINES = 4;
+
+template <size_t N>
+static vecstr to_lines(const char* (&lines)[N]) {
+    return vecstr(lines, lines + N);
+};
+
+static vecstr make_long_lines() {
+    vecstr sources;
+    for (const vecstr& lines: {
+        to_lines(LATIN_LINES), to_lines(CJK_LINES), to_lines(THAI_LINES),
+        to_lines(ARABIC_LINES), to_lines(MIXED_LINES)
+    }) {
+        sources.insert(sources.end(), lines.begin(), lines.end());
+    };
+
+    vecstr long_lines(NUM_LONG_LINES);
+    size_t i = 0;
+    for (std::string& line: long_lines) {
+        while (line.size() < LONG_LINE_BYTES) {
+            line += sources[i++ % sources.size()];
+            line += ' ';
+        };
+    };
+    return long_lines;
+};
+
+static std::vector<SampleSet> make_sample_sets() {
+    std::vector<SampleSet> sample_sets = {
+        {"ascii", to_lines(ASCII_LINES), {}, 0, 0},
+        {"latin", to_lines(LATIN_LINES), {}, 0, 0},
+        {"cjk", to_lines(CJK_LINES), {}, 0, 0},
+        {"thai", to_lines(THAI_LINES), {}, 0, 0},
+        {"arabic", to_lines(ARABIC_LINES), {}, 0, 0},
+        {"mixed", to_lines(MIXED_LINES), {}, 0, 0},
+        {"long", make_long_lines(), {}, 0, 0},
+        {"protected", to_lines(PROTECTED_LINES), {}, 0, 0},
+    };
+
+    Segmenter segmenter;
+    for (SampleSet& sample_set: sample_sets) {
+        for (const std::string& line: sample_set.lines) {
+            sample_set.desegment_lines.push_back(
+                segmenter.normalize_and_segment(line));
+            sample_set.num_bytes += line.size();
+            sample_set.desegment_num_bytes +=
+                sample_set.desegment_lines.back().size();
+        };
+    };
+    return sample_sets;
+};
+
+static void set_rates(
+    benchmark::State& state,
+    size_t num_bytes,
+    size_t num_lines
+) {
+    state.SetBytesProcessed(state.iterations() * num_bytes);
+    state.counters["lines/s"] = benchmark::Counter(
+        state.iterations() * num_lines, benchmark::Counter::kIsRate);
+};
+
+static void bench_stage(
+    benchmark::State& state,
+    SegmenterBenchmark::Stage stage,
+    const SampleSet* sample_set
+) {
+    const vecstr& lines = stage == SegmenterBenchmark::DESEGMENT
+        ? sample_set->desegment_lines : sample_set->lines;
+    size_t num_bytes = stage == SegmenterBenchmark::DESEGMENT
+        ? sample_set->desegment_num_bytes : sample_set->num_bytes;
+
+    // Decoding is left out of the timed loop
+    std::vector<UnicodeString> texts;
+    for (const std::string& line: lines) {
+        texts.push_back(UnicodeString::fromUTF8(line));
+    };
+
+    Segmenter segmenter;
+    for (auto _: state) {
+        for (const UnicodeString& text: texts) {
+            SegmenterBenchmark::run_stage(segmenter, stage, text);
+        };
+    };
+    set_rates(state, num_bytes, lines.size());
+};
+
+enum Function {
+    NORMALIZE,
+    SEGMENT,
+    NORMALIZE_AND_SEGMENT,
+    DESEGMENT,
+    SEGMENT_SPANS,
+    SEGMENT_PROTECTED,
+    NORMALIZE_AND_SEGMENT_BATCH,
+};
+
+// Protected patterns of SEGMENT_PROTECTED, along with the built-ins
+static const vecstr PROTECTED_PATTERNS = {"\\{\\w+\\}"};
+
+static void bench_function(
+    benchmark::State& state,
+    Function function,
+    const SampleSet* sample_set
+) {
+    const vecstr& lines = function == DESEGMENT
+        ? sample_set->desegment_lines : sample_set->lines;
+    size_t num_bytes = function == DESEGMENT
+        ? sample_set->desegment_num_bytes : sample_set->num_bytes;
+
+    bool is_protected = function == SEGMENT_PROTECTED;
+    Segmenter segmenter(
+        false, 0,
+        is_protected ? PROTECTED_PATTERNS : vecstr(),
+        is_protected ? ProtectedPatterns::URLS | ProtectedPatterns::EMAILS
+            : ProtectedPatterns::NONE);
+    std::string out;
+    std::vector<TokenSpan> spans;
+    vecstr outs;
+
+    for (auto _: state) {
+        if (function == NORMALIZE_AND_SEGMENT_BATCH) {
+            segmenter.normalize_and_segment_batch(lines, outs);
+            benchmark::DoNotOptimize(outs.data());
+            continue;
+        };
+
+        for (const std::string& line: lines) {
+            out.clear();
+            spans.clear();
+
+            switch (function) {
+            case NORMALIZE:
+                segmenter.normalize(line, out);
+                break;
+
+            case SEGMENT:
+            case SEGMENT_PROTECTED:
+                segmenter.segment(line, out);
+                break;
+
+            case DESEGMENT:
+                segmenter.desegment(line, out);
+                break;
+
+            case SEGMENT_SPANS:
+                segmenter.segment_spans(line, spans);
+                break;
+
+            default:
+                segmenter.normalize_and_segment(line, out);
+                break;
+            }
+            benchmark::DoNotOptimize(out.data());
+            benchmark::DoNotOptimize(spans.data());
+        };
+    };
+    set_rates(state, num_bytes, lines.size());
+};
+
+static void bench_clone(benchmark::State& state) {
+    Segmenter segmenter;
+    for (auto _: state) {
+        Segmenter* segmenter_copy = segmenter.clone();
+        benchmark::DoNotOptimize(segmenter_copy);
+        delete segmenter_copy;
+    };
+};
+
+static void bench_construct(benchmark::State& state) {
+    for (auto _: state) {
+        Segmenter* segmenter = new Segmenter();
+        benchmark::DoNotOptimize(segmenter);
+        delete segmenter;
+    };
+};
+
+int main(int argc, char** argv) {
+    // Sample sets have to outlive the benchmarks that refer to them
+    static const std::vector<SampleSet> sample_sets = make_sample_sets();
+
+    const std::pair<const char*, SegmenterBenchmark::Stage> stages[] = {
+        {"normalize_inbuf", SegmenterBenchmark::NORMALIZE},
+        {"protect_and_segment_inbuf", SegmenterBenchmark::PROTECT_AND_SEGMENT},
+        {"segment_inbuf", SegmenterBenchmark::SEGMENT},
+        {"break_inbuf", SegmenterBenchmark::BREAK},
+        {"desegment_inbuf", SegmenterBenchmark::DESEGMENT},
+    };
+    const std::pair<const char*, Function> functions[] = {
+        {"normalize", NORMALIZE},
+        {"segment", SEGMENT},
+        {"normalize_and_segment", NORMALIZE_AND_SEGMENT},
+        {"desegment", DESEGMENT},
+        {"segment_spans", SEGMENT_SPANS},
+        {"segment_protected", SEGMENT_PROTECTED},
+        {"normalize_and_segment_batch", NORMALIZE_AND_SEGMENT_BATCH},
+    };
+
+    for (const auto& stage: stages) {
+        for (const SampleSet& sample_set: sample_sets) {
+            std::string name = std::string(stage.first) + "/" + sample_set.name;
+            benchmark::RegisterBenchmark(
+                name.c_str(), bench_stage, stage.second, &sample_set);
+        };
+    };
+    for (const auto& function: functions) {
+        for (const SampleSet& sample_set: sample_sets) {
+            std::string name =
+                std::string(function.first) + "/" + sample_set.name;
+            benchmark::RegisterBenchmark(
+                name.c_str(), bench_function, function.second, &sample_set);
+        };
+    };
+    benchmark::RegisterBenchmark("clone", bench_clone);
+    benchmark::RegisterBenchmark("construct", bench_construct);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,364 @@
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+#include <unicode/unistr.h>
+
+#include "fasttokenizer/protected_patterns.h"
+#include "fasttokenizer/text_scan.h"
+
+using namespace icu;
+
+#ifdef TOKENIZER_NAMESPACE
+namespace TOKENIZER_NAMESPACE {
+#endif
+
+/**
+ * Classes of ASCII characters in URLs and emails.
+ */
+enum UrlClass : uint8_t {
+    ALPHA = 1,
+    ALNUM = 2,
+    SCHEME = 4,  // Letters, digits and '+'
+    DOMAIN = 8,  // Letters, digits, '.' and '-'
+    EMAIL_LOCAL = 16,  // Letters, digits and ".%+-_"
+    URL = 32,  // Printable characters but "<>\"`{}|\\^"
+    URL_TRAILING = 64,  // At the end, these more likely end a sentence
+};
+
+struct UrlTable {
+    uint8_t classes[128];
+
+    UrlTable() {
+        for (int c=0; c<128; ++c) {
+            bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+            bool alnum = alpha || (c >= '0' && c <= '9');
+            uint8_t flags = 0;
+            if (alpha) flags |= ALPHA;
+            if (alnum) flags |= ALNUM | SCHEME | DOMAIN | EMAIL_LOCAL;
+            if (c == '+') flags |= SCHEME;
+            if (c == '.' || c == '-') flags |= DOMAIN;
+            if (c && std::strchr(".%+-_", c)) flags |= EMAIL_LOCAL;
+            if (c > 0x20 && c < 0x7F && !std::strchr("<>\"`{}|\\^", c)) {
+                flags |= URL;
+            };
+            if (c && std::strchr(".,;:!?'\"]}*", c)) flags |= URL_TRAILING;
+            classes[c] = flags;
+        };
+    };
+};
+
+static const UrlTable& url_table() {
+    static const UrlTable table;
+    return table;
+};
+
+/**
+ * Scanners of built-in patterns over bytes or UTF-16 code units.
+ * Only ASCII characters can be part of a match.
+ */
+template <typename T>
+struct UrlScanner {
+    const T* text;
+    size_t length;
+    const uint8_t* classes;
+
+    bool is(size_t i, uint8_t flags) const {
+        uint32_t c = (typename std::make_unsigned<T>::type) text[i];
+        return c < 128 && (classes[c] & flags);
+    };
+
+    // Index of the first '@', "://" or "www." at or after i, or of a
+    // character that may start one
+    size_t next_candidate(size_t i) const;
+
+    uint32_t lower(size_t i) const {
+        uint32_t c = (typename std::make_unsigned<T>::type) text[i];
+        return c >= 'A' && c <= 'Z' ? c + 0x20 : c;
+    };
+
+    // End of the URL whose address starts at text[i]
+    size_t url_end(size_t i) const {
+        size_t end = i;
+        int parens = 0;
+        for (; end < length && is(end, URL); ++end) {
+            if (text[end] == '(') ++parens;
+            if (text[end] == ')') --parens;
+        };
+
+        // Closing parentheses are kept when the URL opened them
+        while (end > i) {
+            if (text[end - 1] == ')' && parens < 0) {
+                ++parens;
+            } else if (!is(end - 1, URL_TRAILING)) {
+                break;
+            };
+            --end;
+        };
+        return end;
+    };
+
+    // URL with a scheme around "://" at text[i], not starting before from
+    bool scheme_url(size_t from, size_t i, size_t& begin, size_t& end) const {
+        if (i + 3 >= length || text[i + 1] != '/' || text[i + 2] != '/') {
+            return false;
+        };
+        begin = i;
+        while (begin > from && is(begin - 1, SCHEME)) --begin;
+        while (begin < i && !is(begin, ALPHA)) ++begin;
+        if (begin == i) return false;
+
+        end = url_end(i + 3);
+        return end > i + 3;
+    };
+
+    // URL starting with "www." at text[i]
+    bool www_url(size_t i, size_t& begin, size_t& end) const {
+        if (i > 0 && is(i - 1, DOMAIN)) return false;
+        if (i + 4 >= length || lower(i + 1) != 'w' || lower(i + 2) != 'w'
+            || text[i + 3] != '.' || !is(i + 4, ALNUM)) {
+            return false;
+        };
+        begin = i;
+        end = url_end(i + 4);
+        return true;
+    };
+
+    // Email around '@' at text[i], not starting before from
+    bool email(size_t from, size_t i, size_t& begin, size_t& end) const {
+        begin = i;
+        while (begin > from && is(begin - 1, EMAIL_LOCAL)) --begin;
+        while (begin < i && text[begin] == '.') ++begin;
+        if (begin == i) return false;
+
+        // Domain has at least two labels
+        end = i + 1;
+        while (end < length && is(end, DOMAIN)) ++end;
+        while (end > i + 1 && !is(end - 1, ALNUM)) --end;
+        if (end == i + 1 || !is(i + 1, ALNUM)) return false;
+        for (size_t k=i + 2; k<end; ++k) {
+            if (text[k] == '.') return true;
+        };
+        return false;
+    };
+
+    // Leftmost match at or after from
+    bool find(int builtins, size_t from, size_t& begin, size_t& end) const {
+        bool urls = builtins & ProtectedPatterns::URLS;
+        bool emails = builtins & ProtectedPatterns::EMAILS;
+        for (size_t i=from; (i = next_candidate(i)) < length; ++i) {
+            switch (text[i]) {
+            case '@':
+                if (emails && email(from, i, begin, end)) return true;
+                break;
+            case ':':
+                if (urls && scheme_url(from, i, begin, end)) return true;
+                break;
+            default:
+                if (urls && www_url(i, begin, end)) return true;
+                break;
+            };
+        };
+        return false;
+    };
+};
+
+template <>
+size_t UrlScanner<char>::next_candidate(size_t i) const {
+    return find_link_candidate(text + i, text + length) - text;
+};
+
+template <>
+size_t UrlScanner<char16_t>::next_candidate(size_t i) const {
+    for (; i < length; ++i) {
+        char16_t c = text[i];
+        if (c == '@' || c == ':' || (c | 0x20) == 'w') break;
+    };
+    return i;
+};
+
+/**
+ * Check if a pattern refers to its groups by number or name, which only
+ * works at the start of an alternation where group numbers do not shift.
+ * Escapes like [\1] give false positives, which only cost an alternation.
+ * References to missing groups do not compile on their own.
+ */
+static bool has_backreferences(const UnicodeString& source) {
+    for (int32_t i=0; i + 1 < source.length(); ++i) {
+        if (source[i] != '\\') continue;
+        char16_t c = source[++i];
+        if ((c >= '1' && c <= '9') || c == 'k') return true;
+    };
+    return false;
+};
+
+static RegexPattern* compile_alternation(const UnicodeString& combined) {
+    UParseError parse_error;
+    UErrorCode status = U_ZERO_ERROR;
+    std::unique_ptr<RegexPattern> regex(
+        RegexPattern::compile(combined, 0, parse_error, status));
+    if (U_FAILURE(status)) {
+        throw std::invalid_argument(
+            std::string("Invalid protected patterns: ") + u_errorName(status));
+    };
+    return regex.release();
+};
+
+ProtectedPatterns::ProtectedPatterns(
+    const std::vector<std::string>& patterns,
+    const int builtins
+)
+    : builtins(builtins)
+{
+    // Patterns are checked on their own first, so that none can change the
+    // meaning of the others in the alternation, eg. with a stray ')'
+    UnicodeString combined;
+    for (const std::string& pattern: patterns) {
+        UnicodeString source = UnicodeString::fromUTF8(pattern);
+        UParseError parse_error;
+        UErrorCode status = U_ZERO_ERROR;
+        std::unique_ptr<RegexPattern> compiled(
+            RegexPattern::compile(source, 0, parse_error, status));
+        if (U_FAILURE(status)) {
+            throw std::invalid_argument(
+                "Invalid protected pattern \"" + pattern + "\": "
+                + u_errorName(status) + " at offset "
+                + std::to_string(parse_error.offset));
+        };
+
+        if (!combined.isEmpty() && has_backreferences(source)) {
+            regexes.emplace_back(compile_alternation(combined));
+            combined.remove();
+        };
+        if (!combined.isEmpty()) combined.append((char16_t) '|');
+        combined.append(UNICODE_STRING_SIMPLE("(?:"));
+        combined.append(source);
+        combined.append((char16_t) ')');
+    };
+    if (!combined.isEmpty()) {
+        regexes.emplace_back(compile_alternation(combined));
+    };
+};
+
+ProtectedMatcher::ProtectedMatcher(
+    std::shared_ptr<const ProtectedPatterns> patterns
+)
+    : patterns(patterns)
+    , text(UTEXT_INITIALIZER)
+    , bytes(nullptr)
+    , units(nullptr)
+    , length(0)
+    , pos(0)
+    , builtin_begin(NO_MATCH)
+    , builtin_end(NO_MATCH)
+{
+    for (const std::unique_ptr<RegexPattern>& regex: patterns->regexes) {
+        UErrorCode status = U_ZERO_ERROR;
+        RegexMatch match = {
+            std::unique_ptr<RegexMatcher>(regex->matcher(status)),
+            NO_MATCH, NO_MATCH};
+        if (U_FAILURE(status)) {
+            throw std::runtime_error(
+                std::string("Failed to create matcher: ")
+                + u_errorName(status));
+        };
+        regex_matches.push_back(std::move(match));
+    };
+};
+
+ProtectedMatcher::~ProtectedMatcher() {
+    // Matchers hold shallow clones of text
+    regex_matches.clear();
+    utext_close(&text);
+};
+
+void ProtectedMatcher::reset(const char* text, size_t length) {
+    bytes = text;
+    units = nullptr;
+    this->length = length;
+    pos = 0;
+    if (patterns->builtins != ProtectedPatterns::NONE) find_builtin();
+
+    if (!regex_matches.empty()) {
+        // ICU matches UTF-16 held in one chunk faster than UTF-8 even with
+        // the copy, see reset in the header, and widening ASCII keeps
+        // offsets the same
+        UErrorCode status = U_ZERO_ERROR;
+        if (is_ascii(text, length)) {
+            wide.resize(length);
+            for (size_t i=0; i<length; ++i) wide[i] = (uint8_t) text[i];
+            utext_openUChars(&this->text, wide.data(), length, &status);
+        } else {
+            utext_openUTF8(&this->text, text, length, &status);
+        };
+        for (RegexMatch& match: regex_matches) {
+            match.matcher->reset(&this->text);
+            find_regex(match);
+        };
+    };
+};
+
+void ProtectedMatcher::reset(const char16_t* text, size_t length) {
+    bytes = nullptr;
+    units = text;
+    this->length = length;
+    pos = 0;
+    if (patterns->builtins != ProtectedPatterns::NONE) find_builtin();
+
+    if (!regex_matches.empty()) {
+        UErrorCode status = U_ZERO_ERROR;
+        utext_openUChars(&this->text, text, length, &status);
+        for (RegexMatch& match: regex_matches) {
+            match.matcher->reset(&this->text);
+            find_regex(match);
+        };
+    };
+};
+
+void ProtectedMatcher::find_builtin() {
+    const uint8_t* classes = url_table().classes;
+    bool found = bytes != nullptr
+        ? UrlScanner<char>{bytes, length, classes}.find(
+            patterns->builtins, pos, builtin_begin, builtin_end)
+        : UrlScanner<char16_t>{units, length, classes}.find(
+            patterns->builtins, pos, builtin_begin, builtin_end);
+    if (!found) builtin_begin = NO_MATCH;
+};
+
+void ProtectedMatcher::find_regex(RegexMatch& match) {
+    UErrorCode status = U_ZERO_ERROR;
+    bool found = match.matcher->find((int64_t) pos, status);
+    while (found && U_SUCCESS(status)) {
+        match.begin = match.matcher->start64(status);
+        match.end = match.matcher->end64(status);
+        if (match.end > match.begin) return;
+
+        // Steps past empty matches
+        found = match.matcher->find(status);
+    };
+    match.begin = NO_MATCH;
+};
+
+bool ProtectedMatcher::next(size_t& begin, size_t& end) {
+    // Matches found before are kept until the last match overlaps them
+    if (builtin_begin != NO_MATCH && builtin_begin < pos) find_builtin();
+    begin = builtin_begin;
+    end = builtin_end;
+
+    // The leftmost match wins, on ties built-ins and earlier patterns do
+    for (RegexMatch& match: regex_matches) {
+        if (match.begin != NO_MATCH && match.begin < pos) find_regex(match);
+        if (match.begin < begin) {
+            begin = match.begin;
+            end = match.end;
+        };
+    };
+
+    if (begin == NO_MATCH) return false;
+    pos = end;
+    return true;
+};
+
+#ifdef TOKENIZER_NAMESPACE
+}; // namespace
+#endif
@@ -0,0 +1,96 @@
+#ifndef BUFFER_LINES_H
+#define BUFFER_LINES_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unicode/stringpiece.h>
+
+/**
+ * Lines of an Arrow string layout, line i is data[offsets[i]:offsets[i + 1]].
+ * Throws std::invalid_argument, a ValueError in python, for offsets out of
+ * order or past size.
+ */
+template <typename Offset>
+inline void offset_lines(
+    const char* data,
+    size_t size,
+    const Offset* offsets,
+    size_t num_offsets,
+    std::vector<icu::StringPiece>& lines
+) {
+    for (size_t i=1; i<num_offsets; ++i) {
+        if (offsets[i - 1] < 0 || offsets[i] < offsets[i - 1]
+            || (uint64_t) offsets[i] > size
+        ) {
+            throw std::invalid_argument("Offsets are out of order or bounds.");
+        };
+        lines.push_back(icu::StringPiece(
+            data + offsets[i - 1], offsets[i] - offsets[i - 1]));
+    };
+}
+
+/**
+ * Lines of a numpy fixed width bytes array, items are padded with NULs.
+ */
+inline void fixed_width_lines(
+    const char* items,
+    size_t num_items,
+    size_t width,
+    std::vector<icu::StringPiece>& lines
+) {
+    const char* item = items;
+    for (size_t i=0; i<num_items; ++i, item += width) {
+        size_t length = width;
+        while (length > 0 && item[length - 1] == '\0') --length;
+        lines.push_back(icu::StringPiece(item, length));
+    };
+}
+
+/**
+ * Pack outputs into UTF-8 data and int64 offsets, as in an Arrow
+ * LargeString array. With tokens, data holds the space separated tokens
+ * of outputs back to back, token_offsets index data and line_offsets index
+ * tokens, as in an Arrow LargeList of LargeString.
+ */
+inline void pack_outputs(
+    const std::vector<std::string>& outs,
+    bool tokens,
+    std::vector<uint8_t>& data,
+    std::vector<int64_t>& token_offsets,
+    std::vector<int64_t>& line_offsets
+) {
+    size_t total_size = 0;
+    for (const std::string& out: outs) total_size += out.size();
+    data.clear();
+    data.reserve(total_size);
+    token_offsets.assign(1, 0);
+    line_offsets.assign(1, 0);
+    line_offsets.reserve(outs.size() + 1);
+
+    for (const std::string& out: outs) {
+        if (!tokens) {
+            data.insert(data.end(), out.begin(), out.end());
+            line_offsets.push_back(data.size());
+            continue;
+        };
+
+        // Tokens of joined strings are separated by single spaces
+        size_t begin = 0;
+        while (begin < out.size()) {
+            size_t end = out.find(' ', begin);
+            if (end == std::string::npos) end = out.size();
+            if (end > begin) {
+                data.insert(data.end(),
+                    out.begin() + begin, out.begin() + end);
+                token_offsets.push_back(data.size());
+            };
+            begin = end + 1;
+        };
+        line_offsets.push_back(token_offsets.size() - 1);
+    };
+}
+
+#endif
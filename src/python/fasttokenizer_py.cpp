@@ -1,10 +1,16 @@
+#include <cstring>
 #include <string>
+#include <tuple>
 #include <vector>
 
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
 #include "fasttokenizer/segmenter.h"
+#include "fasttokenizer/vocabulary.h"
+#include "buffer_lines.h"
+#include "str_utf16.h"
 
 namespace py = pybind11;
 
@@ -12,29 +18,361 @@ namespace py = pybind11;
 using namespace TOKENIZER_NAMESPACE ;
 #endif
 
+typedef std::tuple<size_t, size_t, uint8_t> PySpan;
+
+/**
+ * Convert byte offsets of spans into code point offsets used by python str.
+ */
+static std::vector<PySpan> to_py_spans(
+    const std::string& text,
+    const std::vector<TokenSpan>& spans
+) {
+    std::vector<PySpan> py_spans;
+    py_spans.reserve(spans.size());
+
+    size_t i = 0;
+    size_t num_chars = 0;
+    for (const TokenSpan& span: spans) {
+        for (; i < span.begin; ++i) {
+            if ((text[i] & 0xC0) != 0x80) ++num_chars;
+        };
+        size_t begin = num_chars;
+
+        for (; i < span.end; ++i) {
+            if ((text[i] & 0xC0) != 0x80) ++num_chars;
+        };
+        py_spans.emplace_back(begin, num_chars, span.flags);
+    };
+    return py_spans;
+};
+
+/**
+ * Apply mode on a str, reading its PEP 393 representation in place.
+ *
+ * ASCII strings are valid UTF-8 as stored and take the byte level paths.
+ * Others are processed as UTF-16: UCS2 strings are aliased without copying,
+ * UCS1 and UCS4 strings are widened or encoded straight into UTF-16, and
+ * the result is decoded from the UTF-16 output. Other objects, like bytes,
+ * are converted to std::string as before.
+ */
+static py::object process_str(
+    Segmenter& self,
+    Segmenter::Mode mode,
+    py::object text
+) {
+    PyObject* obj = text.ptr();
+    if (!PyUnicode_Check(obj)) {
+        std::string out;
+        self.process(mode, text.cast<std::string>(), out);
+        return py::str(out);
+    };
+#if PY_VERSION_HEX < 0x030C0000
+    if (PyUnicode_READY(obj) != 0) throw py::error_already_set();
+#endif
+
+    Py_ssize_t length = PyUnicode_GET_LENGTH(obj);
+    const void* data = PyUnicode_DATA(obj);
+    PyObject* result;
+
+    if (PyUnicode_IS_ASCII(obj)) {
+        std::string out;
+        self.process(mode, icu::StringPiece((const char*) data, length), out);
+        result = PyUnicode_DecodeUTF8(out.data(), out.size(), nullptr);
+    } else {
+        icu::UnicodeString utf16;
+        str_to_utf16(data, length, PyUnicode_KIND(obj), utf16);
+
+        const icu::UnicodeString& out = self.process_utf16(mode, utf16);
+        int byte_order = PY_LITTLE_ENDIAN ? -1 : 1;
+        result = PyUnicode_DecodeUTF16(
+            (const char*) out.getBuffer(), out.length() * 2,
+            "surrogatepass", &byte_order);
+    };
+
+    if (result == nullptr) throw py::error_already_set();
+    return py::reinterpret_steal<py::object>(result);
+};
+
+/**
+ * Copy token IDs into a numpy array.
+ */
+static py::array_t<int32_t> to_py_ids(const std::vector<int32_t>& ids) {
+    return py::array_t<int32_t>(ids.size(), ids.data());
+};
+
+/**
+ * Move values into a numpy array that frees them, without copying.
+ */
+template <typename T>
+static py::array_t<T> to_py_array(std::vector<T>&& values) {
+    std::vector<T>* owned = new std::vector<T>(std::move(values));
+    py::capsule free_values(owned, [](void* p) {
+        delete (std::vector<T>*) p;
+    });
+    return py::array_t<T>(owned->size(), owned->data(), free_values);
+};
+
+/**
+ * Process lines held in buffers and pack the outputs into numpy arrays.
+ *
+ * Input is either an Arrow string layout of a UTF-8 data buffer and an
+ * int32 or int64 offsets array, or a numpy fixed width bytes array whose
+ * items are lines padded with NULs when offsets is None. Contiguous inputs
+ * are read in place.
+ *
+ * Outputs are a UTF-8 data buffer and int64 offsets, as in an Arrow
+ * LargeString array. With tokens, data holds tokens back to back and
+ * token offsets into it come with line offsets into the tokens, as in an
+ * Arrow LargeList of LargeString.
+ */
+static py::tuple process_buffers(
+    Segmenter& self,
+    py::object data,
+    py::object offsets,
+    Segmenter::Mode mode,
+    int num_threads,
+    bool tokens
+) {
+    std::vector<icu::StringPiece> lines;
+    py::array data_array = py::array::ensure(data, py::array::c_style);
+    py::array offsets_array;
+    if (!data_array || data_array.ndim() != 1) {
+        throw py::type_error("Expected a 1-D data buffer.");
+    };
+
+    if (offsets.is_none()) {
+        if (data_array.dtype().kind() != 'S') {
+            throw py::type_error("Expected a numpy bytes array.");
+        };
+        fixed_width_lines((const char*) data_array.data(),
+            data_array.size(), data_array.itemsize(), lines);
+    } else {
+        const char* bytes = (const char*) data_array.data();
+        size_t size = data_array.nbytes();
+
+        offsets_array = py::array::ensure(offsets, py::array::c_style);
+        if (!offsets_array || offsets_array.dtype().kind() != 'i'
+            || offsets_array.ndim() != 1
+        ) {
+            throw py::type_error("Expected 1-D integer offsets.");
+        };
+        size_t num_offsets = offsets_array.size();
+        if (offsets_array.itemsize() == 4) {
+            offset_lines(bytes, size,
+                (const int32_t*) offsets_array.data(), num_offsets, lines);
+        } else if (offsets_array.itemsize() == 8) {
+            offset_lines(bytes, size,
+                (const int64_t*) offsets_array.data(), num_offsets, lines);
+        } else {
+            throw py::type_error("Expected int32 or int64 offsets.");
+        };
+    };
+
+    std::vector<uint8_t> out_data;
+    std::vector<int64_t> token_offsets;
+    std::vector<int64_t> line_offsets;
+    {
+        py::gil_scoped_release release;
+        std::vector<std::string> outs;
+        self.process_batch(mode, lines, outs, num_threads);
+        pack_outputs(outs, tokens, out_data, token_offsets, line_offsets);
+    };
+
+    if (!tokens) {
+        return py::make_tuple(
+            to_py_array(std::move(out_data)),
+            to_py_array(std::move(line_offsets)));
+    };
+    return py::make_tuple(
+        to_py_array(std::move(out_data)),
+        to_py_array(std::move(token_offsets)),
+        to_py_array(std::move(line_offsets)));
+};
+
 PYBIND11_MODULE(_fasttokenizer, m) {
-    py::class_<Segmenter>(m, "Segmenter")
-        .def(py::init<const bool>())
+    py::class_<Vocabulary>(m, "Vocabulary")
+        .def(
+            py::init<const std::string&, const std::string&>(),
+            py::arg("path"),
+            py::arg("unk_token") = "<unk>"
+        )
+        .def(
+            py::init<const std::vector<std::string>&, const std::string&>(),
+            py::arg("tokens"),
+            py::arg("unk_token") = "<unk>"
+        )
+        .def("__len__", &Vocabulary::size)
+        .def_property_readonly("unk_id", &Vocabulary::get_unk_id)
+        .def(
+            "find",
+            [](const Vocabulary& self, const std::string& token) {
+                return self.find(token);
+            }
+        );
+
+    py::class_<Segmenter> segmenter(m, "Segmenter");
+
+    py::enum_<Segmenter::Mode>(segmenter, "Mode")
+        .value("NORMALIZE", Segmenter::NORMALIZE)
+        .value("SEGMENT", Segmenter::SEGMENT)
+        .value("NORMALIZE_AND_SEGMENT", Segmenter::NORMALIZE_AND_SEGMENT)
+        .value("DESEGMENT", Segmenter::DESEGMENT);
+
+    py::enum_<Segmenter::InvalidUtf8>(segmenter, "InvalidUtf8")
+        .value("REPLACE", Segmenter::REPLACE)
+        .value("SKIP", Segmenter::SKIP)
+        .value("THROW", Segmenter::THROW);
+
+    py::enum_<ProtectedPatterns::Builtin>(
+        segmenter, "ProtectedBuiltin", py::arithmetic())
+        .value("NONE", ProtectedPatterns::NONE)
+        .value("URLS", ProtectedPatterns::URLS)
+        .value("EMAILS", ProtectedPatterns::EMAILS);
+
+    segmenter
+        .def(
+            py::init<
+                const bool,
+                const size_t,
+                const std::vector<std::string>&,
+                const int
+            >(),
+            py::arg("protected_dash_split") = false,
+            py::arg("cache_size") = 0,
+            py::arg("protected_patterns") = std::vector<std::string>(),
+            py::arg("protected_builtins") = (int) ProtectedPatterns::NONE
+        )
         .def("clone", &Segmenter::clone, "Clone this segmenter.")
+        .def(
+            "stats",
+            [](const Segmenter& self) {
+                py::dict stats;
+                self.get_stats().for_each(
+                    [&](const char* name, uint64_t value) {
+                        stats[name] = value;
+                    });
+                return stats;
+            }
+        )
+        .def("reset_stats", &Segmenter::reset_stats)
+        .def(
+            "set_long_line_bytes",
+            &Segmenter::set_long_line_bytes,
+            py::arg("long_line_bytes")
+        )
+        .def(
+            "set_invalid_utf8",
+            &Segmenter::set_invalid_utf8,
+            py::arg("invalid_utf8")
+        )
         .def(
             "normalize",
-            (std::string (Segmenter::*)(const std::string&))
-            &Segmenter::normalize
+            [](Segmenter& self, py::object text) {
+                return process_str(self, Segmenter::NORMALIZE, text);
+            }
         )
         .def(
             "segment",
-            (std::string (Segmenter::*)(const std::string&))
-            &Segmenter::segment
+            [](Segmenter& self, py::object text) {
+                return process_str(self, Segmenter::SEGMENT, text);
+            }
         )
         .def(
             "normalize_and_segment",
-            (std::string (Segmenter::*)(const std::string&))
-            &Segmenter::normalize_and_segment
+            [](Segmenter& self, py::object text) {
+                return process_str(
+                    self, Segmenter::NORMALIZE_AND_SEGMENT, text);
+            }
         )
         .def(
             "desegment",
-            (std::string (Segmenter::*)(const std::string&))
-            &Segmenter::desegment
+            [](Segmenter& self, py::object text) {
+                return process_str(self, Segmenter::DESEGMENT, text);
+            }
+        )
+        .def(
+            "segment_spans",
+            [](Segmenter& self, const std::string& text) {
+                std::vector<TokenSpan> spans;
+                self.segment_spans(text, spans);
+                return to_py_spans(text, spans);
+            }
+        )
+        .def(
+            "segment_ids",
+            [](Segmenter& self, const std::string& text,
+                const Vocabulary& vocab
+            ) {
+                std::vector<TokenSpan> spans;
+                std::vector<int32_t> ids;
+                self.segment_spans(text, spans);
+                vocab.find_spans(text, spans, ids);
+                return to_py_ids(ids);
+            },
+            py::arg("text"), py::arg("vocab")
+        )
+        .def(
+            "normalize_and_segment_ids",
+            [](Segmenter& self, const std::string& text,
+                const Vocabulary& vocab
+            ) {
+                std::string normalized;
+                std::vector<TokenSpan> spans;
+                std::vector<int32_t> ids;
+                self.normalize_and_segment_spans(text, normalized, spans);
+                vocab.find_spans(normalized, spans, ids);
+                return to_py_ids(ids);
+            },
+            py::arg("text"), py::arg("vocab")
+        )
+        .def(
+            "normalize_and_segment_spans",
+            [](Segmenter& self, const std::string& text) {
+                std::string normalized;
+                std::vector<TokenSpan> spans;
+                self.normalize_and_segment_spans(text, normalized, spans);
+                return std::make_pair(
+                    normalized, to_py_spans(normalized, spans));
+            }
+        )
+        .def(
+            "normalize_batch",
+            (std::vector<std::string> (Segmenter::*)(
+                const std::vector<std::string>&, int))
+            &Segmenter::normalize_batch,
+            py::arg("texts"), py::arg("num_threads") = 4,
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "segment_batch",
+            (std::vector<std::string> (Segmenter::*)(
+                const std::vector<std::string>&, int))
+            &Segmenter::segment_batch,
+            py::arg("texts"), py::arg("num_threads") = 4,
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "normalize_and_segment_batch",
+            (std::vector<std::string> (Segmenter::*)(
+                const std::vector<std::string>&, int))
+            &Segmenter::normalize_and_segment_batch,
+            py::arg("texts"), py::arg("num_threads") = 4,
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "desegment_batch",
+            (std::vector<std::string> (Segmenter::*)(
+                const std::vector<std::string>&, int))
+            &Segmenter::desegment_batch,
+            py::arg("texts"), py::arg("num_threads") = 4,
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "process_buffers",
+            &process_buffers,
+            py::arg("data"), py::arg("offsets") = py::none(),
+            py::arg("mode") = Segmenter::NORMALIZE_AND_SEGMENT,
+            py::arg("num_threads") = 4, py::arg("tokens") = false
         );
 
 #ifdef TOKENIZER_VERSION_INFO
@@ -0,0 +1,50 @@
+#ifndef STR_UTF16_H
+#define STR_UTF16_H
+
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+
+#include <unicode/unistr.h>
+#include <unicode/utf16.h>
+
+/**
+ * Set utf16 to the text of a PEP 393 str holding length code points of
+ * kind bytes each, as given by PyUnicode_KIND. UCS2 text is aliased without
+ * copying, UCS1 text is widened and UCS4 text is encoded into UTF-16. Lone
+ * surrogates are kept as they are.
+ *
+ * Throws std::length_error, a ValueError in python, for text that does not
+ * fit into a UnicodeString.
+ */
+inline void str_to_utf16(
+    const void* data,
+    size_t length,
+    int kind,
+    icu::UnicodeString& utf16
+) {
+    // UCS4 code points take up to 2 code units
+    size_t max_units = kind == 4 ? 2 * (uint64_t) length : length;
+    if (length > INT32_MAX || max_units > INT32_MAX) {
+        throw std::length_error("Text is too long for UTF-16 processing.");
+    };
+
+    if (kind == 2) {
+        utf16.setTo(false, (const char16_t*) data, (int32_t) length);
+        return;
+    };
+
+    char16_t* buffer = utf16.getBuffer((int32_t) max_units);
+    if (buffer == nullptr) throw std::bad_alloc();
+    int32_t j = 0;
+    if (kind == 1) {
+        const uint8_t* chars = (const uint8_t*) data;
+        for (size_t i=0; i<length; ++i) buffer[j++] = chars[i];
+    } else {
+        const uint32_t* chars = (const uint32_t*) data;
+        for (size_t i=0; i<length; ++i) U16_APPEND_UNSAFE(buffer, j, chars[i]);
+    };
+    utf16.releaseBuffer(j);
+}
+
+#endif
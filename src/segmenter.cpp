@@ -1,6 +1,20 @@
-#include <unicode/regex.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <unicode/uniset.h>
 #include <unicode/brkiter.h>
 #include <unicode/normalizer2.h>
+#include <unicode/uchar.h>
+#include <unicode/ustring.h>
+#include <unicode/utf8.h>
+
+#include "ThreadPool.h"
 
 #include "fasttokenizer/segmenter.h"
 
@@ -10,102 +24,430 @@ using namespace icu;
 namespace TOKENIZER_NAMESPACE {
 #endif
 
-static const UnicodeString u_dash(icu::UnicodeString("-"));
-static const UnicodeString u_apos(icu::UnicodeString('\''));
-static const UnicodeString u_quote(icu::UnicodeString('\"'));
+static const char16_t u_unit_separator = 0x1F;
 
-static const UnicodeString u_bdash(icu::UnicodeString("@-@"));
-static const UnicodeString u_ldash(icu::UnicodeString("@-"));
-static const UnicodeString u_rdash(icu::UnicodeString("-@"));
+/**
+ * Flags of code points used to classify tokens.
+ */
+enum CharClass : uint8_t {
+    RIGHT_SHIFT = 1,  // right_shift_chars
+    LEFT_SHIFT = 2,  // left_shift_chars
+    BOTH_SHIFT = 4,  // both_shift_chars
+    NUMERIC = 8,  // numeric_chars
+    SEPARATOR = 16,  // whitespace_chars
+    SPACE = 32,  // space_chars
+    TRIMMED = 64,  // Removed by icu::UnicodeString::trim
+};
 
-Segmenter::Segmenter(const bool protected_dash_split)
-    : protected_dash_split(protected_dash_split)
+#ifdef TOKENIZER_STATS
+// Span functions write no text
+static const std::string NO_OUTPUT;
+#endif
+
+// Chunks shorter than this many UTF-16 units are not cached
+static const int32_t MIN_CACHED_CHUNK_LENGTH = 8;
+
+// Number of lines a batch worker claims at a time
+static const size_t BATCH_BLOCKSIZE = 64;
+
+// Batch lines longer than this are split into pieces by default
+static const size_t DEFAULT_LONG_LINE_BYTES = 1 << 20;
+
+/**
+ * Character classes and ICU objects that never change after construction.
+ * Frozen sets and normalizers are safe to use from multiple threads, the
+ * break iterator is only a prototype that segmenters clone.
+ */
+struct SegmenterRules {
+    // Same character classes as ICU regex \s and \w
+    UnicodeSet space_chars;
+    UnicodeSet other_letter_chars;
+    UnicodeSet other_letter_run_chars;
+    UnicodeSet word_and_space_chars;
+
+    UnicodeSet left_shift_chars;
+    UnicodeSet right_shift_chars;
+    UnicodeSet both_shift_chars;
+    UnicodeSet numeric_chars;
+    UnicodeSet whitespace_chars;
+
+    // Characters that attach to a preceding space in word breaking
+    UnicodeSet word_extend_chars;
+
+    // CharClass flags of each UTF-16 code unit, lone surrogates included
+    std::unique_ptr<uint8_t[]> bmp_classes;
+
+    const Normalizer2* nfc_normalizer;
+    const Normalizer2* nfkc_normalizer;
+
+    std::unique_ptr<BreakIterator> break_iterator;
+
+    SegmenterRules(UErrorCode& icu_status)
+        : space_chars(UnicodeString("[\\p{WhiteSpace}]"), icu_status)
+        , other_letter_chars(UnicodeString("[:Lo:]"), icu_status)
+        , other_letter_run_chars(
+            UnicodeString("[[:Lo:][:Lm:][:Mn:][:Sk:]]"), icu_status)
+        , word_and_space_chars(UnicodeString(
+            "[\\p{Alphabetic}\\p{M}\\p{Nd}\\p{Pc}\\u200c\\u200d\\p{WhiteSpace}]"
+        ), icu_status)
+
+        , left_shift_chars(
+            UnicodeString("[[:Pf:][:Pe:][,.?!:;%]]"), icu_status)
+        , right_shift_chars(
+            UnicodeString("[[:Sc:][:Pi:][:Ps:][¿¡]]"), icu_status)
+        , both_shift_chars(UnicodeString("[|/\\\\]"), icu_status)
+        , numeric_chars(UnicodeString("[:N:]"), icu_status)
+        , whitespace_chars(UnicodeString("[:Z:]"), icu_status)
+
+        , word_extend_chars(UnicodeString(
+            "[\\p{WB=Extend}\\p{WB=Format}\\p{WB=ZWJ}]"), icu_status)
+
+        , bmp_classes(new uint8_t[0x10000]())
+
+        , nfc_normalizer(Normalizer2::getNFCInstance(icu_status))
+        , nfkc_normalizer(Normalizer2::getNFKCInstance(icu_status))
+
+        , break_iterator(BreakIterator::createWordInstance(
+            Locale::getUS(), icu_status))
+    {
+        space_chars.freeze();
+        other_letter_chars.freeze();
+        other_letter_run_chars.freeze();
+        word_and_space_chars.freeze();
+
+        left_shift_chars.freeze();
+        right_shift_chars.freeze();
+        both_shift_chars.freeze();
+        numeric_chars.freeze();
+        whitespace_chars.freeze();
+
+        word_extend_chars.freeze();
+
+        add_bmp_class(right_shift_chars, RIGHT_SHIFT);
+        add_bmp_class(left_shift_chars, LEFT_SHIFT);
+        add_bmp_class(both_shift_chars, BOTH_SHIFT);
+        add_bmp_class(numeric_chars, NUMERIC);
+        add_bmp_class(whitespace_chars, SEPARATOR);
+        add_bmp_class(space_chars, SPACE);
+        for (UChar32 c=0; c<=0xFFFF; ++c) {
+            if (c == 0x20 || u_isWhitespace(c)) bmp_classes[c] |= TRIMMED;
+        };
+    };
+
+    void add_bmp_class(const UnicodeSet& chars, uint8_t flag) {
+        for (int32_t i=0; i<chars.getRangeCount(); ++i) {
+            UChar32 end = std::min(chars.getRangeEnd(i), (UChar32) 0xFFFF);
+            for (UChar32 c=chars.getRangeStart(i); c<=end; ++c) {
+                bmp_classes[c] |= flag;
+            };
+        };
+    };
+
+    uint8_t char_class(UChar32 c) const {
+        if (c <= 0xFFFF) return bmp_classes[c];
+
+        // Supplementary code points are rare enough to look up in the sets
+        uint8_t flags = 0;
+        if (right_shift_chars.contains(c)) flags |= RIGHT_SHIFT;
+        if (left_shift_chars.contains(c)) flags |= LEFT_SHIFT;
+        if (both_shift_chars.contains(c)) flags |= BOTH_SHIFT;
+        if (numeric_chars.contains(c)) flags |= NUMERIC;
+        if (whitespace_chars.contains(c)) flags |= SEPARATOR;
+        if (space_chars.contains(c)) flags |= SPACE;
+        if (u_isWhitespace(c)) flags |= TRIMMED;
+        return flags;
+    };
+};
+
+/**
+ * Bounded map from inputs to outputs, shared between a segmenter and its
+ * clones. Keys are spread over shards with their own lock and a full shard
+ * evicts its oldest entry.
+ * Entries are indexed by the hash of their key, which is computed once per
+ * lookup, and a key colliding with another one replaces it.
+ */
+class SegmenterCache {
+    private:
+        struct Entry {
+            size_t key_length;
+            std::string data;  // Key followed by value
+        };
+
+        struct Shard {
+            std::mutex mutex;
+            std::unordered_map<size_t, Entry> entries;
 
+            // Hashes in insertion order, used as a ring once the shard is full
+            std::vector<size_t> hashes;
+            size_t oldest = 0;
+        };
+
+        static const size_t MAX_SHARDS = 64;
+
+        size_t num_shards;
+        size_t shard_capacity;
+        std::unique_ptr<Shard[]> shards;
+        std::hash<std::string> hash;
+
+    public:
+        SegmenterCache(size_t capacity)
+            : num_shards(std::min(capacity, MAX_SHARDS))
+            , shard_capacity(capacity / num_shards)
+            , shards(new Shard[num_shards])
+        {};
+
+        // Append the output of key to value if present
+        bool find(const std::string& key, std::string& value) {
+            size_t h = hash(key);
+            Shard& shard = shards[h % num_shards];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            auto it = shard.entries.find(h);
+            if (it == shard.entries.end()) return false;
+            const Entry& entry = it->second;
+            if (entry.data.compare(0, entry.key_length, key) != 0) return false;
+            value.append(entry.data, entry.key_length, std::string::npos);
+            return true;
+        };
+
+        void insert(const std::string& key, const std::string& value) {
+            size_t h = hash(key);
+            Shard& shard = shards[h % num_shards];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            Entry& entry = shard.entries[h];
+            bool is_new = entry.data.empty();
+            entry.key_length = key.size();
+            entry.data.assign(key).append(value);
+            if (!is_new) return;
+
+            if (shard.hashes.size() < shard_capacity) {
+                shard.hashes.push_back(h);
+                return;
+            };
+            shard.entries.erase(shard.hashes[shard.oldest]);
+            shard.hashes[shard.oldest] = h;
+            shard.oldest = (shard.oldest + 1) % shard_capacity;
+        };
+};
+
+Segmenter::Segmenter(
+    const bool protected_dash_split,
+    const size_t cache_size,
+    const std::vector<std::string>& protected_patterns,
+    const int protected_builtins
+)
+    : protected_dash_split(protected_dash_split)
+    , long_line_bytes(DEFAULT_LONG_LINE_BYTES)
+    , invalid_utf8(REPLACE)
     , icu_status(U_ZERO_ERROR)
-    , non_whitespace_matcher(new RegexMatcher("\\S+", 0, icu_status))
-    , other_letter_matcher(new RegexMatcher(
-        "(\\p{Lo}[\\p{Lm}\\p{Mn}\\p{Sk}]*)+", 0, icu_status))
-    , protect_matcher(new RegexMatcher("\u001F[^\u001F]*\u001F", 0, icu_status))
-    , word_and_space_matcher(new RegexMatcher("[\\w\\s]+", 0, icu_status))
-
-    , left_shift_chars(new UnicodeSet(
-        UnicodeString("[[:Pf:][:Pe:][,.?!:;%]]"), icu_status))
-    , right_shift_chars(new UnicodeSet(
-        UnicodeString("[[:Sc:][:Pi:][:Ps:][¿¡]]"), icu_status))
-    , both_shift_chars(new UnicodeSet(
-        UnicodeString("[|/\\\\]"), icu_status))
-    , numeric_chars(new UnicodeSet(
-        UnicodeString("[:N:]"), icu_status))
-    , whitespace_chars(new UnicodeSet(
-        UnicodeString("[:Z:]"), icu_status))
-
-    , nfc_normalizer(Normalizer2::getNFCInstance(icu_status))
-    , nfkc_normalizer(Normalizer2::getNFKCInstance(icu_status))
-
-    , break_iterator(BreakIterator::createWordInstance(
-        Locale::getUS(), icu_status))
+    , spans(nullptr)
+    , rules(std::make_shared<SegmenterRules>(icu_status))
+    , cache(cache_size > 0 ? std::make_shared<SegmenterCache>(cache_size)
+        : nullptr)
+    , break_iterator(rules->break_iterator->clone())
+    , break_text(UTEXT_INITIALIZER)
+    , pool(nullptr)
 {
-    left_shift_chars->freeze();
-    right_shift_chars->freeze();
-    both_shift_chars->freeze();
-    numeric_chars->freeze();
-    whitespace_chars->freeze();
+    auto patterns = std::make_shared<const ProtectedPatterns>(
+        protected_patterns, protected_builtins);
+    if (!patterns->empty()) protector.reset(new ProtectedMatcher(patterns));
 };
 
-Segmenter::~Segmenter() {
-    delete non_whitespace_matcher;
-    delete other_letter_matcher;
-    delete protect_matcher;
-    delete word_and_space_matcher;
-
-    delete left_shift_chars;
-    delete right_shift_chars;
-    delete both_shift_chars;
-    delete numeric_chars;
-    delete whitespace_chars;
+Segmenter::Segmenter(
+    std::shared_ptr<const SegmenterRules> rules,
+    std::shared_ptr<SegmenterCache> cache,
+    std::shared_ptr<const ProtectedPatterns> patterns,
+    const bool protected_dash_split
+)
+    : protected_dash_split(protected_dash_split)
+    , long_line_bytes(DEFAULT_LONG_LINE_BYTES)
+    , invalid_utf8(REPLACE)
+    , icu_status(U_ZERO_ERROR)
+    , spans(nullptr)
+    , rules(rules)
+    , cache(cache)
+    , break_iterator(rules->break_iterator->clone())
+    , break_text(UTEXT_INITIALIZER)
+    , protector(patterns ? new ProtectedMatcher(patterns) : nullptr)
+    , pool(nullptr)
+{};
 
+Segmenter::~Segmenter() {
     delete break_iterator;
+    utext_close(&break_text);
+
+    // Pool has to be joined before its segmenters are released
+    delete pool;
+    for (Segmenter* worker: workers) delete worker;
 };
 
 Segmenter* Segmenter::clone() {
-    // Recreating a new segmenter is quick enough for current use cases.
-    return new Segmenter(protected_dash_split);
+    // Clones share the compiled rules, patterns and cache and only own their
+    // buffers and matchers
+    Segmenter* copy = new Segmenter(
+        rules, cache,
+        protector ? protector->get_patterns() : nullptr,
+        protected_dash_split);
+    copy->long_line_bytes = long_line_bytes;
+    copy->invalid_utf8 = invalid_utf8;
+    return copy;
+};
+
+bool Segmenter::accept_utf8(StringPiece text) {
+    size_t valid = utf8_valid_prefix(text.data(), text.length());
+    if (valid == (size_t) text.length()) return true;
+
+    ++stats.invalid_lines;
+    if (invalid_utf8 == THROW) {
+        throw std::invalid_argument(
+            "Invalid UTF-8 at byte " + std::to_string(valid));
+    };
+    return false;
+};
+
+/**
+ * Decode text into inbuf, reusing its capacity once it has grown to the
+ * longest line. Ill-formed sequences become U+FFFD as with
+ * UnicodeString::fromUTF8.
+ */
+void Segmenter::decode_inbuf(StringPiece text) {
+    // UTF-16 never needs more code units than UTF-8 needs bytes
+    int32_t capacity = text.length() + 1;
+    // inbuf and outbuf trade buffers when normalized output is swapped in
+    // and outbuf is overwritten after decoding, so take the one that fits
+    if (inbuf.getCapacity() < capacity && outbuf.getCapacity() >= capacity) {
+        inbuf.swap(outbuf);
+    };
+    char16_t* buffer = inbuf.getBuffer(capacity);
+    int32_t length = 0;
+    UErrorCode status = U_ZERO_ERROR;
+    u_strFromUTF8WithSub(
+        buffer, capacity, &length, text.data(), text.length(),
+        0xFFFD, nullptr, &status);
+    inbuf.releaseBuffer(U_SUCCESS(status) ? length : 0);
+};
+
+/**
+ * Convert UTF-16 offsets of inbuf into byte offsets of text.
+ * inbuf is decoded from text with UnicodeString::fromUTF8 so ill-formed
+ * sequences are stepped over the same way, each becoming a single U+FFFD.
+ */
+static void utf16_to_utf8_spans(
+    StringPiece text,
+    std::vector<TokenSpan>& spans
+) {
+    const uint8_t* s = (const uint8_t*) text.data();
+    int32_t length = (int32_t) text.length();
+    int32_t i = 0;
+    size_t upos = 0;
+    UChar32 c;
+
+    for (TokenSpan& span: spans) {
+        while (upos < span.begin) {
+            U8_NEXT(s, i, length, c);
+            upos += c < 0 ? 1 : U16_LENGTH(c);
+        };
+        span.begin = i;
+
+        while (upos < span.end) {
+            U8_NEXT(s, i, length, c);
+            upos += c < 0 ? 1 : U16_LENGTH(c);
+        };
+        span.end = i;
+    };
+};
+
+/**
+ * Write inbuf[start:end] as a token.
+ */
+void Segmenter::append_token(int32_t start, int32_t end, uint8_t flags) {
+    if (spans != nullptr) {
+        // Leave out tokens that would be lost when splitting by whitespace
+        for (int32_t i=start; i<end; ++i) {
+            if (!u_isUWhiteSpace(inbuf[i])) {
+                spans->push_back({(size_t)start, (size_t)end, flags});
+                return;
+            };
+        };
+        return;
+    };
+
+    if (flags & TokenSpan::AT_PREFIX) outbuf.append('@');
+    outbuf.append(inbuf, start, end - start);
+    if (flags & TokenSpan::AT_SUFFIX) outbuf.append('@');
+    outbuf.append(' ');
 };
 
 /**
  * Normalize input buffer using NFKC for word characters and NFC for others.
+ * Returns true without writing to outbuf if input is already normalized.
  */
-void Segmenter::normalize_inbuf(int32_t start, int32_t length) {
+bool Segmenter::normalize_inbuf(int32_t start, int32_t length) {
     int32_t p0, p1;
     icu_status = U_ZERO_ERROR;
 
     // Normalize with NFC
-    nfc_normalizer->normalize(
-        inbuf.tempSubString(start, length),
-        tempbuf,
-        icu_status
-    );
+    // Only the part after the quick check span has to be normalized.
+    UnicodeString src = inbuf.tempSubString(start, length);
+    const UnicodeString* nfc_text = &src;
+    int32_t span = rules->nfc_normalizer->spanQuickCheckYes(src, icu_status);
+    if (span < length) {
+        tempbuf.setTo(src, 0, span);
+        rules->nfc_normalizer->normalizeSecondAndAppend(
+            tempbuf,
+            src.tempSubString(span),
+            icu_status
+        );
+        nfc_text = &tempbuf;
+    };
+    bool is_normalized = nfc_text == &src;
 
     // Normalize words with NFKC
-    word_and_space_matcher->reset(tempbuf);
+    const char16_t* buffer = nfc_text->getBuffer();
+    int32_t nfc_length = nfc_text->length();
     p0 = 0;
-    while (word_and_space_matcher->find()) {
+    while (p0 < nfc_length) {
         // Non words can remain as NFC
-        p1 = word_and_space_matcher->start(icu_status);
-        outbuf.append(tempbuf.tempSubString(p0, p1 - p0));
+        p1 = p0 + rules->word_and_space_chars.span(
+            buffer + p0, nfc_length - p0, USET_SPAN_NOT_CONTAINED);
+        if (!is_normalized) outbuf.append(*nfc_text, p0, p1 - p0);
         p0 = p1;
+        if (p0 == nfc_length) break;
 
         // Words should be normalized as NFKC
-        p1 = word_and_space_matcher->end(icu_status);
-        nfkc_normalizer->normalizeSecondAndAppend(
-            outbuf,
-            tempbuf.tempSubString(p0, p1 - p0),
-            icu_status
-        );
+        // The quick check span can be copied if it does not combine with
+        // what is already in outbuf.
+        p1 = p0 + rules->word_and_space_chars.span(
+            buffer + p0, nfc_length - p0, USET_SPAN_CONTAINED);
+        UnicodeString word = nfc_text->tempSubString(p0, p1 - p0);
+        span = 0;
+        const Normalizer2* nfkc_normalizer = rules->nfkc_normalizer;
+        if (nfkc_normalizer->hasBoundaryBefore(word.char32At(0))) {
+            span = nfkc_normalizer->spanQuickCheckYes(word, icu_status);
+        };
+
+        if (is_normalized) {
+            if (span == word.length()) {
+                p0 = p1;
+                continue;
+            };
+            outbuf.append(*nfc_text, 0, p0);
+            is_normalized = false;
+        };
+
+        outbuf.append(word, 0, span);
+        if (span < word.length()) {
+            rules->nfkc_normalizer->normalizeSecondAndAppend(
+                outbuf,
+                word.tempSubString(span),
+                icu_status
+            );
+        };
         p0 = p1;
     };
-    // Non words can remain as NFC
-    outbuf.append(tempbuf.tempSubString(p0, tempbuf.length() - p0));
+
+    return is_normalized;
 };
 
 /**
@@ -113,37 +455,42 @@ void Segmenter::normalize_inbuf(int32_t start, int32_t length) {
  */
 void Segmenter::break_inbuf(int32_t start, int32_t length) {
     int32_t p0, p1;
-    break_iterator->setText(inbuf.tempSubString(start, length));
+
+    // Setting a UnicodeString would copy it, a UText only points into it
+    UErrorCode status = U_ZERO_ERROR;
+    utext_openUChars(&break_text, inbuf.getBuffer() + start, length, &status);
+    break_iterator->setText(&break_text, status);
 
     p0 = break_iterator->first();
     p1 = break_iterator->next();
     while (p1 != BreakIterator::DONE) {
+        TOKENIZER_STATS_ADD(break_segments, 1);
+
         // For each segment, trim and if not empty, append to outbuf
-        UnicodeString usegment = inbuf.tempSubString(start + p0, p1 - p0);
+        char16_t first_char = inbuf[start + p0];
 
-        if (whitespace_chars->contains(usegment[0])) {
+        if (rules->bmp_classes[first_char] & SEPARATOR) {
             // pass
 
-        } else if (protected_dash_split && (usegment == u_dash)) {
+        } else if (protected_dash_split && p1 - p0 == 1 && first_char == '-') {
             char16_t prev_char = inbuf[start + p0 - 1];
             char16_t next_char = inbuf[start + p1];
+            uint8_t flags = TokenSpan::NONE;
 
-            if (!whitespace_chars->contains(prev_char)) {
+            if (!(rules->bmp_classes[prev_char] & SEPARATOR)) {
                 if (prev_char != 65535) {  // 2 ** 16 - 1
-                    outbuf.append('@');
+                    flags |= TokenSpan::AT_PREFIX;
                 };
             };
-            outbuf.append(usegment);
-            if (!whitespace_chars->contains(next_char)) {
+            if (!(rules->bmp_classes[next_char] & SEPARATOR)) {
                 if (next_char != 65535) {  // 2 ** 16 - 1
-                    outbuf.append('@');
+                    flags |= TokenSpan::AT_SUFFIX;
                 };
             };
-            outbuf.append(' ');
+            append_token(start + p0, start + p1, flags);
 
         } else {
-            outbuf.append(usegment);
-            outbuf.append(' ');
+            append_token(start + p0, start + p1);
         };
 
         p0 = p1;
@@ -159,18 +506,20 @@ void Segmenter::segment_inbuf(int32_t start, int32_t length) {
     icu_status = U_ZERO_ERROR;
 
     // Segment Lo and apply break_iterator on reamining.
-    other_letter_matcher->reset(inbuf.tempSubString(start, length));
+    const char16_t* buffer = inbuf.getBuffer() + start;
     p0 = 0;
-    while (other_letter_matcher->find()) {
+    while (p0 < length) {
         // Apply ICU WordBreakIterator on non-Lo substrings
-        p1 = other_letter_matcher->start(icu_status);
+        p1 = p0 + rules->other_letter_chars.span(
+            buffer + p0, length - p0, USET_SPAN_NOT_CONTAINED);
+        if (p1 == length) break;
         break_inbuf(start + p0, p1 - p0);
         p0 = p1;
 
         // Do not break Lo
-        p1 = other_letter_matcher->end(icu_status);
-        outbuf.append(inbuf.tempSubString(start + p0, p1 - p0));
-        outbuf.append(' ');
+        p1 = p0 + rules->other_letter_run_chars.span(
+            buffer + p0, length - p0, USET_SPAN_CONTAINED);
+        append_token(start + p0, start + p1);
         p0 = p1;
     };
     // Apply ICU WordBreakIterator on non-Lo substrings
@@ -185,22 +534,125 @@ void Segmenter::protect_and_segment_inbuf(int32_t start, int32_t length) {
     icu_status = U_ZERO_ERROR;
 
     // Segment by unit separators
-    protect_matcher->reset(inbuf.tempSubString(start, length));
-    p0 = 0;
-    while (protect_matcher->find()) {
+    int32_t end = start + length;
+    p0 = start;
+    while ((p1 = inbuf.indexOf(u_unit_separator, p0, end - p0)) >= 0) {
+        int32_t p2 = inbuf.indexOf(u_unit_separator, p1 + 1, end - p1 - 1);
+        if (p2 < 0) break;
+
         // Apply segmentation to un-protected substring
-        p1 = protect_matcher->start(icu_status);
-        segment_inbuf(start + p0, p1 - p0);
-        p0 = p1;
+        match_and_segment_inbuf(p0, p1 - p0);
 
         // Protect substring
-        p1 = protect_matcher->end(icu_status);
-        outbuf.append(inbuf.tempSubString(start + p0 + 1, p1 - p0 - 1));
-        outbuf.append(' ');
-        p0 = p1;
+        // Joined string output has always kept the closing separator
+        if (spans != nullptr) {
+            append_token(p1 + 1, p2);
+        } else {
+            append_token(p1 + 1, p2 + 1);
+        };
+        p0 = p2 + 1;
     };
     // Apply segmentation to un-protected substring
-    segment_inbuf(start + p0, length - p0);
+    match_and_segment_inbuf(p0, end - p0);
+};
+
+/**
+ * Keep matches of protected patterns unsegmented and apply segmentation to
+ * the text between them. Unlike enclosed sequences, matches are written
+ * without anything after them.
+ */
+void Segmenter::match_and_segment_inbuf(int32_t start, int32_t length) {
+    if (protector == nullptr) {
+        segment_chunks_inbuf(start, length);
+        return;
+    };
+
+    size_t m0, m1;
+    int32_t p0 = start;
+    protector->reset(inbuf.getBuffer() + start, length);
+    while (protector->next(m0, m1)) {
+        segment_chunks_inbuf(p0, start + m0 - p0);
+        append_token(start + m0, start + m1);
+        p0 = start + m1;
+    };
+    segment_chunks_inbuf(p0, start + length - p0);
+};
+
+/**
+ * Apply segment_inbuf on chunks delimited by spaces, reusing cached outputs.
+ * Word breaks always surround a run of spaces unless it is followed by a
+ * character that attaches to it, so chunks split elsewhere are segmented
+ * the same way on their own. Spaces produce no tokens.
+ *
+ * Only chunks between spaces or the ends of inbuf are cached. Short chunks
+ * are segmented faster than they are looked up, so they are segmented
+ * together with their neighbours instead.
+ */
+void Segmenter::segment_chunks_inbuf(int32_t start, int32_t length) {
+    if (cache == nullptr || spans != nullptr) {
+        segment_inbuf(start, length);
+        return;
+    };
+
+    const char16_t* buffer = inbuf.getBuffer();
+    int32_t end = start + length;
+    int32_t p0, p1, p2;
+    int32_t pending = start;  // Start of chunks left to segment
+    p0 = start;
+    while (p0 < end) {
+        // Find the chunk inbuf[p0:p1] and the spaces inbuf[p1:p2] after it
+        p1 = p0;
+        while (true) {
+            while (p1 < end && buffer[p1] != 0x20) ++p1;
+            p2 = p1;
+            while (p2 < end && buffer[p2] == 0x20) ++p2;
+            if (p2 == end || !rules->word_extend_chars.contains(
+                inbuf.char32At(p2))) break;
+            p1 = p2;
+        };
+
+        // Dashes next to a protected sequence depend on it
+        bool cacheable = p1 - p0 >= MIN_CACHED_CHUNK_LENGTH
+            && (p0 == 0 || buffer[p0 - 1] == 0x20)
+            && (p1 == inbuf.length() || buffer[p1] == 0x20);
+
+        if (cacheable) {
+            if (p0 > pending) segment_inbuf(pending, p0 - pending);
+
+            cache_key.assign(1, 'C');
+            cache_key.append((const char*) (buffer + p0), (p1 - p0) * 2);
+            cache_value.clear();
+
+            if (cache->find(cache_key, cache_value)) {
+                ++stats.cache_chunk_hits;
+                outbuf.append(
+                    (const char16_t*) cache_value.data(),
+                    cache_value.size() / 2);
+            } else {
+                ++stats.cache_chunk_misses;
+                int32_t out_begin = outbuf.length();
+                segment_inbuf(p0, p1 - p0);
+                cache_value.assign(
+                    (const char*) (outbuf.getBuffer() + out_begin),
+                    (outbuf.length() - out_begin) * 2);
+                cache->insert(cache_key, cache_value);
+            };
+            pending = p2;
+        };
+        p0 = p2;
+    };
+    if (end > pending) segment_inbuf(pending, end - pending);
+};
+
+/**
+ * Check if word is the ASCII string s.
+ */
+static inline bool is_word(const char16_t* word, int32_t length, const char* s) {
+    int32_t i = 0;
+    for (; i < length && s[i] != 0; ++i) {
+        if (word[i] != (char16_t) s[i]) return false;
+    };
+    return i == length && s[i] == 0;
 };
 
 /**
@@ -215,82 +667,774 @@ void Segmenter::desegment_inbuf(int32_t start, int32_t length) {
     bool in_apos = false;
     bool in_quote = false;
     bool prepend_space = true;
-    UnicodeString prev_usegment;
+    int32_t prev_p1 = 0;  // End of the previous word, 0 if there is none
 
-    non_whitespace_matcher->reset(inbuf.tempSubString(start, length));
-    while (non_whitespace_matcher->find()) {
-        p0 = non_whitespace_matcher->start(icu_status);
-        p1 = non_whitespace_matcher->end(icu_status);
+    const char16_t* buffer = inbuf.getBuffer() + start;
+    p1 = 0;
+    while (true) {
+        // Find the next \S+ run
+        p0 = p1 + rules->space_chars.span(
+            buffer + p1, length - p1, USET_SPAN_CONTAINED);
+        if (p0 == length) break;
+        p1 = p0 + rules->space_chars.span(
+            buffer + p0, length - p0, USET_SPAN_NOT_CONTAINED);
 
-        // Get word
-        UnicodeString usegment = inbuf.tempSubString(start + p0, p1 - p0);
+        // Get word and the class of its character if it is a single one
+        const char16_t* word = buffer + p0;
+        int32_t word_length = p1 - p0;
+        uint8_t word_class = 0;
+        if (word_length == 1) {
+            word_class = rules->bmp_classes[word[0]];
+        } else if (word_length == 2
+            && U16_IS_LEAD(word[0]) && U16_IS_TRAIL(word[1])
+        ) {
+            word_class = rules->char_class(
+                U16_GET_SUPPLEMENTARY(word[0], word[1]));
+        };
 
-        if (right_shift_chars->contains(usegment)) {
+        if (word_class & RIGHT_SHIFT) {
             if (prepend_space) outbuf.append(' ');
-            outbuf.append(usegment);
+            outbuf.append(word, word_length);
             prepend_space = false;
 
-        } else if (left_shift_chars->contains(usegment)) {
-            outbuf.append(usegment);
+        } else if (word_class & LEFT_SHIFT) {
+            outbuf.append(word, word_length);
             prepend_space = true;
 
-        } else if (both_shift_chars->contains(usegment)) {
-            outbuf.append(usegment);
+        } else if (word_class & BOTH_SHIFT) {
+            outbuf.append(word, word_length);
             prepend_space = false;
 
-        } else if (usegment == u_bdash) {
+        } else if (is_word(word, word_length, "@-@")) {
             outbuf.append('-');
             prepend_space = false;
 
-        } else if (usegment == u_ldash) {
+        } else if (is_word(word, word_length, "@-")) {
             outbuf.append('-');
             prepend_space = true;
 
-        } else if (usegment == u_rdash) {
+        } else if (is_word(word, word_length, "-@")) {
             if (prepend_space) outbuf.append(' ');
             outbuf.append('-');
             prepend_space = false;
 
-        } else if (usegment == u_apos) {
-            if (prev_usegment.endsWith('s')) {
-                outbuf.append(usegment);
+        } else if (is_word(word, word_length, "'")) {
+            if (prev_p1 > 0 && buffer[prev_p1 - 1] == 's') {
+                outbuf.append(word, word_length);
                 prepend_space = true;
             } else if (in_apos) {
-                outbuf.append(usegment);
+                outbuf.append(word, word_length);
                 prepend_space = true;
                 in_apos = false;
             } else {
                 if (prepend_space) outbuf.append(' ');
-                outbuf.append(usegment);
+                outbuf.append(word, word_length);
                 prepend_space = false;
                 in_apos = true;
             };
 
-        } else if (usegment == u_quote) {
-            char16_t prev_last_char =
-                prev_usegment[prev_usegment.length() - 1];
-            if (numeric_chars->contains(prev_last_char)) {
-                outbuf.append(usegment);
+        } else if (is_word(word, word_length, "\"")) {
+            char16_t prev_last_char = prev_p1 > 0 ? buffer[prev_p1 - 1] : 0xFFFF;
+            if (rules->bmp_classes[prev_last_char] & NUMERIC) {
+                outbuf.append(word, word_length);
                 prepend_space = true;
             } else if (in_quote) {
-                outbuf.append(usegment);
+                outbuf.append(word, word_length);
                 prepend_space = true;
                 in_quote = false;
             } else {
                 if (prepend_space) outbuf.append(' ');
-                outbuf.append(usegment);
+                outbuf.append(word, word_length);
                 prepend_space = false;
                 in_quote = true;
             }
 
         } else {
             if (prepend_space) outbuf.append(' ');
-            outbuf.append(usegment);
+            outbuf.append(word, word_length);
+            prepend_space = true;
+        };
+
+        prev_p1 = p1;
+    };
+};
+
+/**
+ * Same as desegment_inbuf followed by outbuf.trim() but works on UTF-8
+ * directly. Returns false and leaves out unchanged if text is not well-formed
+ * UTF-8, as fromUTF8 would have replaced ill-formed sequences.
+ */
+bool Segmenter::desegment_utf8(StringPiece text, std::string& out) {
+    const uint8_t* s = (const uint8_t*) text.data();
+    const uint8_t* classes = rules->bmp_classes.get();
+    int32_t length = (int32_t) text.length();
+    size_t offset = out.size();
+    UChar32 c;
+
+    bool in_apos = false;
+    bool in_quote = false;
+    bool prepend_space = true;
+    int32_t prev_p0 = 0;
+    int32_t prev_p1 = 0;  // End of the previous word, 0 if there is none
+
+    int32_t p0, p1 = 0;
+    while (true) {
+        // Find the next \S+ run
+        for (p0 = p1; p0 < length; p0 = p1) {
+            if (s[p1] < 0x80) {
+                c = s[p1++];
+            } else {
+                U8_NEXT(s, p1, length, c);
+                if (c < 0) break;
+            };
+            if (!(rules->char_class(c) & SPACE)) break;
+        };
+        if (p0 == length) break;
+
+        p1 = p0;
+        while (p1 < length) {
+            // Skip over plain ASCII, which is never a space
+            p1 = find_space_candidate(text.data() + p1, text.data() + length)
+                - text.data();
+            if (p1 == length) break;
+
+            int32_t i = p1;
+            if (s[i] < 0x80) {
+                c = s[i++];
+            } else {
+                U8_NEXT(s, i, length, c);
+                if (c < 0) {
+                    out.resize(offset);
+                    return false;
+                };
+            };
+            if (rules->char_class(c) & SPACE) break;
+            p1 = i;
+        };
+
+        // Get word and the class of its character if it is a single one
+        const char* word = text.data() + p0;
+        int32_t word_length = p1 - p0;
+        uint8_t word_class = 0;
+        int32_t i = p0;
+        U8_NEXT(s, i, length, c);
+        if (i == p1) word_class = rules->char_class(c);
+
+        if (word_class & RIGHT_SHIFT) {
+            if (prepend_space) out.push_back(' ');
+            out.append(word, word_length);
+            prepend_space = false;
+
+        } else if (word_class & LEFT_SHIFT) {
+            out.append(word, word_length);
+            prepend_space = true;
+
+        } else if (word_class & BOTH_SHIFT) {
+            out.append(word, word_length);
+            prepend_space = false;
+
+        } else if (word_length == 3 && std::memcmp(word, "@-@", 3) == 0) {
+            out.push_back('-');
+            prepend_space = false;
+
+        } else if (word_length == 2 && std::memcmp(word, "@-", 2) == 0) {
+            out.push_back('-');
+            prepend_space = true;
+
+        } else if (word_length == 2 && std::memcmp(word, "-@", 2) == 0) {
+            if (prepend_space) out.push_back(' ');
+            out.push_back('-');
+            prepend_space = false;
+
+        } else if (word_length == 1 && word[0] == '\'') {
+            if (prev_p1 > 0 && s[prev_p1 - 1] == 's') {
+                out.push_back('\'');
+                prepend_space = true;
+            } else if (in_apos) {
+                out.push_back('\'');
+                prepend_space = true;
+                in_apos = false;
+            } else {
+                if (prepend_space) out.push_back(' ');
+                out.push_back('\'');
+                prepend_space = false;
+                in_apos = true;
+            };
+
+        } else if (word_length == 1 && word[0] == '\"') {
+            // desegment_inbuf looks at the last UTF-16 unit, which is a
+            // trail surrogate for supplementary characters
+            uint8_t prev_class = 0;
+            if (prev_p1 > 0) {
+                int32_t j = prev_p1;
+                U8_PREV(s, prev_p0, j, c);
+                if (c <= 0xFFFF) prev_class = classes[c];
+            };
+            if (prev_class & NUMERIC) {
+                out.push_back('\"');
+                prepend_space = true;
+            } else if (in_quote) {
+                out.push_back('\"');
+                prepend_space = true;
+                in_quote = false;
+            } else {
+                if (prepend_space) out.push_back(' ');
+                out.push_back('\"');
+                prepend_space = false;
+                in_quote = true;
+            }
+
+        } else {
+            if (prepend_space) out.push_back(' ');
+            out.append(word, word_length);
             prepend_space = true;
         };
 
-        prev_usegment = usegment;
+        prev_p0 = p0;
+        prev_p1 = p1;
+    };
+
+    trim_utf8(out, offset);
+    return true;
+};
+
+void Segmenter::trim_utf8(std::string& out, size_t offset) {
+    const uint8_t* o = (const uint8_t*) out.data() + offset;
+    int32_t end = (int32_t) (out.size() - offset);
+    UChar32 c;
+
+    while (end > 0) {
+        int32_t j = end;
+        U8_PREV(o, 0, j, c);
+        if (!(rules->char_class(c) & TRIMMED)) break;
+        end = j;
+    };
+    out.resize(offset + end);
+
+    int32_t begin = 0;
+    while (begin < end) {
+        int32_t j = begin;
+        U8_NEXT(o, j, end, c);
+        if (!(rules->char_class(c) & TRIMMED)) break;
+        begin = j;
+    };
+    if (begin > 0) out.erase(offset, begin);
+};
+
+void Segmenter::segment_spans(
+    StringPiece text,
+    std::vector<TokenSpan>& out
+) {
+    TOKENIZER_STATS_ADD(segment_lines, 1);
+    TOKENIZER_STATS_LINE(text, NO_OUTPUT);
+
+    out.clear();
+    if (can_segment_ascii(text)) {
+        TOKENIZER_STATS_ADD(ascii_lines, 1);
+        segment_ascii_spans(text, out);
+        TOKENIZER_STATS_END(ascii_ns, NO_OUTPUT);
+        return;
+    };
+
+    if (invalid_utf8 != REPLACE && !accept_utf8(text)) return;
+    decode_inbuf(text);
+    TOKENIZER_STATS_LAP(decode_ns);
+
+    spans = &out;
+    protect_and_segment_inbuf(0, inbuf.length());
+    spans = nullptr;
+    TOKENIZER_STATS_LAP(segment_ns);
+
+    utf16_to_utf8_spans(text, out);
+    TOKENIZER_STATS_END(encode_ns, NO_OUTPUT);
+};
+
+void Segmenter::normalize_and_segment_spans(
+    StringPiece text,
+    std::string& normalized,
+    std::vector<TokenSpan>& out
+) {
+    ++stats.normalize_lines;
+    TOKENIZER_STATS_ADD(segment_lines, 1);
+    normalized.clear();
+    out.clear();
+    TOKENIZER_STATS_LINE(text, normalized);
+
+    if (can_segment_ascii(text)) {
+        ++stats.normalize_quick_lines;
+        TOKENIZER_STATS_ADD(ascii_lines, 1);
+        normalized.append(text.data(), text.length());
+        segment_ascii_spans(normalized, out);
+        TOKENIZER_STATS_END(ascii_ns, normalized);
+        return;
+    };
+
+    if (invalid_utf8 != REPLACE && !accept_utf8(text)) return;
+    decode_inbuf(text);
+    TOKENIZER_STATS_LAP(decode_ns);
+    outbuf.remove();
+    if (normalize_inbuf(0, inbuf.length())) {
+        ++stats.normalize_quick_lines;
+    } else {
+        inbuf.swap(outbuf);
+    };
+    TOKENIZER_STATS_LAP(normalize_ns);
+    inbuf.toUTF8String(normalized);
+    TOKENIZER_STATS_LAP(encode_ns);
+
+    spans = &out;
+    protect_and_segment_inbuf(0, inbuf.length());
+    spans = nullptr;
+    TOKENIZER_STATS_LAP(segment_ns);
+
+    utf16_to_utf8_spans(normalized, out);
+    TOKENIZER_STATS_END(encode_ns, normalized);
+};
+
+/**
+ * Look up the output of a line in the cache and append it to out.
+ */
+bool Segmenter::cache_find(Mode mode, StringPiece text, std::string& out) {
+    cache_key.assign(1, (char) mode);
+    cache_key.append(text.data(), text.length());
+    if (!cache->find(cache_key, out)) return false;
+    ++stats.cache_line_hits;
+    return true;
+};
+
+void Segmenter::cache_insert(
+    Mode mode,
+    StringPiece text,
+    const std::string& out,
+    size_t out_begin
+) {
+    ++stats.cache_line_misses;
+    cache_key.assign(1, (char) mode);
+    cache_key.append(text.data(), text.length());
+    cache_value.assign(out, out_begin, std::string::npos);
+    cache->insert(cache_key, cache_value);
+};
+
+/**
+ * Apply a single mode on text.
+ */
+void Segmenter::process(Mode mode, StringPiece text, std::string& out) {
+    switch (mode) {
+    case NORMALIZE:
+        normalize(text, out);
+        break;
+
+    case SEGMENT:
+        segment(text, out);
+        break;
+
+    case NORMALIZE_AND_SEGMENT:
+        normalize_and_segment(text, out);
+        break;
+
+    case DESEGMENT:
+        desegment(text, out);
+        break;
+    };
+};
+
+const UnicodeString& Segmenter::process_utf16(
+    Mode mode,
+    const UnicodeString& text
+) {
+    // Shares the buffer of text rather than copying it
+    inbuf.fastCopyFrom(text);
+    outbuf.remove();
+
+    switch (mode) {
+    case NORMALIZE:
+        ++stats.normalize_lines;
+        if (normalize_inbuf(0, inbuf.length())) {
+            ++stats.normalize_quick_lines;
+            return inbuf;
+        };
+        return outbuf;
+
+    case SEGMENT:
+        TOKENIZER_STATS_ADD(segment_lines, 1);
+        protect_and_segment_inbuf(0, inbuf.length());
+        break;
+
+    case NORMALIZE_AND_SEGMENT:
+        ++stats.normalize_lines;
+        TOKENIZER_STATS_ADD(segment_lines, 1);
+        if (normalize_inbuf(0, inbuf.length())) {
+            ++stats.normalize_quick_lines;
+        } else {
+            inbuf.swap(outbuf);
+            outbuf.remove();
+        };
+        protect_and_segment_inbuf(0, inbuf.length());
+        break;
+
+    case DESEGMENT:
+        TOKENIZER_STATS_ADD(desegment_lines, 1);
+        desegment_inbuf(0, inbuf.length());
+        break;
+    };
+
+    outbuf.trim();
+    return outbuf;
+};
+
+/**
+ * Apply a single mode on texts using a pool of cloned segmenters.
+ * Each worker owns one clone and claims blocks of lines until none are left,
+ * so results are written in place and keep the input order.
+ * Long lines are split into pieces that workers claim one at a time before
+ * any block of lines, outputs of pieces are joined once all are done.
+ */
+void Segmenter::process_batch(
+    Mode mode,
+    const std::vector<StringPiece>& texts,
+    std::vector<std::string>& outs,
+    int num_threads
+) {
+    if (num_threads <= 0)
+        throw std::runtime_error("num_threads must be a positive value");
+
+    // Nothing of this segmenter but its settings is used past this point,
+    // so single-text calls can run alongside
+    std::lock_guard<std::mutex> lock(batch_mutex);
+    size_t num_texts = texts.size();
+    outs.resize(num_texts);
+
+    std::vector<StringPiece> pieces;
+    std::vector<size_t> split_lines;  // Index of the line of each piece
+    std::vector<bool> is_split(num_texts, false);
+    if (num_threads > 1) {
+        std::vector<StringPiece> line_pieces;
+        for (size_t i=0; i<num_texts; ++i) {
+            if (!split_long_line(mode, texts[i], line_pieces)) continue;
+            pieces.insert(pieces.end(), line_pieces.begin(), line_pieces.end());
+            split_lines.resize(pieces.size(), i);
+            is_split[i] = true;
+        };
+    };
+    std::vector<std::string> piece_outs(pieces.size());
+
+    // Not worth waking up the pool, the first worker runs on this thread
+    if (num_threads == 1 || (num_texts <= BATCH_BLOCKSIZE && pieces.empty())) {
+        if (workers.empty()) workers.push_back(clone());
+        Segmenter* worker = workers[0];
+        worker->invalid_utf8 = invalid_utf8;
+        worker->long_line_bytes = long_line_bytes;
+        std::exception_ptr error;
+        try {
+            for (size_t i=0; i<num_texts; ++i) {
+                outs[i].clear();
+                worker->process(mode, texts[i], outs[i]);
+            };
+        } catch (...) {
+            error = std::current_exception();
+        };
+        batch_stats.merge(worker->stats);
+        worker->reset_stats();
+        if (error) std::rethrow_exception(error);
+        return;
+    };
+
+    if (workers.size() != (size_t)num_threads || pool == nullptr) {
+        delete pool;
+        for (Segmenter* worker: workers) delete worker;
+        workers.clear();
+
+        pool = new ThreadPool(num_threads);
+        for (int i=0; i<num_threads; ++i) workers.push_back(clone());
+    };
+    for (Segmenter* worker: workers) {
+        worker->invalid_utf8 = invalid_utf8;
+        worker->long_line_bytes = long_line_bytes;
+    };
+
+    std::atomic<size_t> next_piece(0);
+    std::atomic<size_t> next_block(0);
+    std::vector<std::future<void>> results;
+    for (Segmenter* worker: workers) {
+        results.push_back(pool->enqueue([&, worker]() {
+            size_t k;
+            while ((k = next_piece.fetch_add(1)) < pieces.size()) {
+                worker->process_piece(mode, pieces[k], piece_outs[k]);
+            };
+
+            size_t begin;
+            while ((begin = next_block.fetch_add(BATCH_BLOCKSIZE)) < num_texts) {
+                size_t end = std::min(begin + BATCH_BLOCKSIZE, num_texts);
+                for (size_t i=begin; i<end; ++i) {
+                    if (is_split[i]) continue;
+                    outs[i].clear();
+                    worker->process(mode, texts[i], outs[i]);
+                };
+            };
+        }));
+    };
+
+    // Tasks reference local state so all of them have to finish
+    // before any exception is rethrown
+    for (std::future<void>& result: results) result.wait();
+    for (Segmenter* worker: workers) {
+        batch_stats.merge(worker->stats);
+        worker->reset_stats();
+    };
+    for (std::future<void>& result: results) result.get();
+
+    for (size_t k=0; k<pieces.size(); ++k) {
+        size_t i = split_lines[k];
+        if (k == 0 || split_lines[k - 1] != i) outs[i].clear();
+        outs[i].append(piece_outs[k]);
+        if (k + 1 == pieces.size() || split_lines[k + 1] != i) {
+            finish_pieces(mode, outs[i], 0);
+        };
+    };
+};
+
+/**
+ * Desegmentation carries state across the line so it is never split.
+ * Ill-formed lines are left whole to be skipped or rejected as a whole.
+ */
+bool Segmenter::split_long_line(
+    Mode mode,
+    StringPiece text,
+    std::vector<StringPiece>& pieces
+) {
+    pieces.clear();
+    if (long_line_bytes == 0 || mode == DESEGMENT
+        || (size_t) text.length() <= long_line_bytes
+    ) {
+        return false;
+    };
+    if (invalid_utf8 != REPLACE && !is_valid_utf8(text.data(), text.length())) {
+        return false;
+    };
+
+    split_text(mode, text, long_line_bytes, pieces);
+    if (pieces.size() == 1) pieces.clear();
+    return !pieces.empty();
+};
+
+void Segmenter::process_piece(Mode mode, StringPiece piece, std::string& out) {
+    if (mode == NORMALIZE) {
+        normalize(piece, out);
+    } else {
+        segment_untrimmed(mode == NORMALIZE_AND_SEGMENT, piece, out);
+    };
+};
+
+/**
+ * Check if text[:pos] can be processed apart from the text after it.
+ * Like segment_chunks_inbuf this is the case after a space that is followed
+ * by a character which starts a word break segment, and which also has to
+ * start a normalization segment. complete is false if that character does
+ * not fully fit in text.
+ */
+bool Segmenter::is_split_point(StringPiece text, size_t pos, bool& complete) {
+    complete = true;
+    if (pos == 0 || text.data()[pos - 1] != ' ') return false;
+
+    const uint8_t* s = (const uint8_t*) text.data() + pos;
+    int32_t length = (int32_t) std::min(text.length() - pos, (size_t) 8);
+    int32_t i = 0;
+    UChar32 c;
+    U8_NEXT(s, i, length, c);
+    if (c < 0) {
+        // Ill-formed sequences become U+FFFD unless more bytes could follow
+        complete = i < length;
+        return complete;
+    };
+
+    const Normalizer2* normalizers[] = {
+        rules->nfc_normalizer, rules->nfkc_normalizer};
+    UnicodeString decomposition;
+    UChar32 first_char = c;
+    for (const Normalizer2* normalizer: normalizers) {
+        if (!normalizer->hasBoundaryBefore(c)) return false;
+
+        // Normalized text has to start a word break segment as well,
+        // eg. U+0E33 decomposes into a nonspacing mark under NFKC
+        if (normalizer->getDecomposition(c, decomposition)) {
+            first_char = decomposition.char32At(0);
+        };
+        if ((rules->char_class(first_char) & SPACE)
+            || rules->word_extend_chars.contains(first_char)
+        ) return false;
+    };
+    return true;
+};
+
+/**
+ * Split text into pieces of at least piece_bytes, the last one can be
+ * shorter. Protected sequences are never split.
+ */
+void Segmenter::split_text(
+    Mode mode,
+    StringPiece text,
+    size_t piece_bytes,
+    std::vector<StringPiece>& pieces
+) {
+    const char* data = text.data();
+    size_t length = text.length();
+    size_t begin = 0;
+    size_t pos = 0;
+    bool in_protected = false;
+    bool complete;
+
+    while (length - begin > piece_bytes) {
+        size_t target = begin + piece_bytes;
+        for (; pos < length; ++pos) {
+            if (pos >= target
+                && !in_protected
+                && is_split_point(text, pos, complete)
+            ) break;
+
+            // Normalization alone does not protect sequences
+            if (data[pos] == '\x1F' && mode != NORMALIZE) {
+                in_protected = !in_protected;
+            };
+        };
+        if (pos == length) break;
+
+        pieces.push_back(StringPiece(data + begin, pos - begin));
+        begin = pos;
+    };
+    pieces.push_back(StringPiece(data + begin, length - begin));
+};
+
+/**
+ * Same as segment or normalize_and_segment without trimming the output.
+ */
+void Segmenter::segment_untrimmed(
+    bool normalize,
+    StringPiece text,
+    std::string& out
+) {
+    if (can_segment_ascii(text)) {
+        segment_ascii(text, out, false);
+        return;
+    };
+
+    if (invalid_utf8 != REPLACE && !accept_utf8(text)) return;
+    decode_inbuf(text);
+    outbuf.remove();
+    if (normalize && !normalize_inbuf(0, inbuf.length())) {
+        inbuf.swap(outbuf);
+        outbuf.remove();
+    };
+    protect_and_segment_inbuf(0, inbuf.length());
+    outbuf.toUTF8String(out);
+};
+
+SegmenterStream::SegmenterStream(
+    Segmenter& segmenter,
+    const bool normalize,
+    const bool segment
+)
+    : segmenter(segmenter)
+    , scan_pos(0)
+    , split_pos(0)
+    , in_protected(false)
+    , started(false)
+{
+    if (!normalize && !segment)
+        throw std::runtime_error("Stream has to normalize or segment");
+
+    if (!segment) {
+        mode = Segmenter::NORMALIZE;
+    } else if (!normalize) {
+        mode = Segmenter::SEGMENT;
+    } else {
+        mode = Segmenter::NORMALIZE_AND_SEGMENT;
+    };
+};
+
+/**
+ * Process pending[:length] and write the output.
+ * Output of the whole document is trimmed, so trimmable characters at the
+ * start are dropped and those at the end are held back until more follows.
+ */
+void SegmenterStream::process(size_t length, std::string& out) {
+    StringPiece text(pending.data(), length);
+    if (mode == Segmenter::NORMALIZE) {
+        segmenter.normalize(text, out);
+        return;
+    };
+
+    output.clear();
+    segmenter.segment_untrimmed(
+        mode == Segmenter::NORMALIZE_AND_SEGMENT, text, output);
+
+    const SegmenterRules& rules = *segmenter.rules;
+    const uint8_t* o = (const uint8_t*) output.data();
+    int32_t begin = 0;
+    int32_t end = (int32_t) output.size();
+    UChar32 c;
+
+    if (!started) {
+        while (begin < end) {
+            int32_t j = begin;
+            U8_NEXT(o, j, end, c);
+            if (!(rules.char_class(c) & TRIMMED)) break;
+            begin = j;
+        };
+    };
+
+    int32_t last = end;
+    while (last > begin) {
+        int32_t j = last;
+        U8_PREV(o, begin, j, c);
+        if (!(rules.char_class(c) & TRIMMED)) break;
+        last = j;
     };
+
+    if (last > begin) {
+        out.append(trailing);
+        out.append(output, begin, last - begin);
+        trailing.clear();
+        started = true;
+    };
+    trailing.append(output, last, end - last);
+};
+
+void SegmenterStream::feed(StringPiece chunk, std::string& out) {
+    pending.append(chunk.data(), chunk.length());
+
+    bool complete = true;
+    for (; scan_pos < pending.size(); ++scan_pos) {
+        if (!in_protected
+            && segmenter.is_split_point(pending, scan_pos, complete)
+        ) {
+            split_pos = scan_pos;
+        };
+        if (!complete) break;
+
+        // Normalization alone does not protect sequences
+        if (pending[scan_pos] == '\x1F' && mode != Segmenter::NORMALIZE) {
+            in_protected = !in_protected;
+        };
+    };
+
+    if (split_pos > 0) {
+        process(split_pos, out);
+        pending.erase(0, split_pos);
+        scan_pos -= split_pos;
+        split_pos = 0;
+    };
+};
+
+void SegmenterStream::flush(std::string& out) {
+    process(pending.size(), out);
+
+    pending.clear();
+    scan_pos = 0;
+    split_pos = 0;
+    in_protected = false;
+
+    trailing.clear();
+    started = false;
 };
 
 #ifdef TOKENIZER_NAMESPACE
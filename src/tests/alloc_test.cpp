@@ -0,0 +1,129 @@
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <unicode/uclean.h>
+
+#include "fasttokenizer/segmenter.h"
+#include "fasttokenizer/vocabulary.h"
+#include "test_util.h"
+
+#ifdef TOKENIZER_NAMESPACE
+using namespace TOKENIZER_NAMESPACE;
+#endif
+
+/**
+ * Once buffers have grown to the lines seen, processing a line must not
+ * allocate. Allocations through operator new and ICU's heap are counted.
+ */
+static size_t allocations = 0;
+
+static void* counted_malloc(size_t size) {
+    ++allocations;
+    // malloc(0) may return nullptr, which new must not
+    return malloc(size > 0 ? size : 1);
+}
+
+void* operator new(size_t size) {
+    void* p = counted_malloc(size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return counted_malloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return counted_malloc(size);
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+static void* U_CALLCONV icu_alloc(const void*, size_t size) {
+    return counted_malloc(size);
+}
+
+static void* U_CALLCONV icu_realloc(const void*, void* p, size_t size) {
+    ++allocations;
+    return realloc(p, size);
+}
+
+static void U_CALLCONV icu_free(const void*, void* p) {
+    free(p);
+}
+
+static const std::vector<std::string> LINES = {
+    "Hello World! It's 2.5-3 miles away, isn't it?",
+    "\"Quoted\" (parenthesized) [bracketed] {braced} text...",
+    "\xEF\xBC\xA6\xEF\xBD\x95\xEF\xBD\x8C\xEF\xBD\x8C width and "
+        "\xEF\xAC\x81 ligatures",
+    "e\xCC\x81 combining a\xCC\x81\xCC\xA7 marks \xE0\xB8\x81\xE0\xB8\xB3",
+    "\xE4\xBB\x96\xE7\x9A\x84\xE3\x80\x8A\xE5\xA4\xA9\xE7\xA9\xBA"
+        "\xE3\x80\x8B\xE3\x80\x82",
+    "\xF0\x9F\x98\x80 emoji \xF0\x9D\x9F\x8E and \xD9\xA1\xD9\xA2 digits",
+    "\x1FH.E.L.L.O\x1F protected and state-of-the-art dashes",
+    "Hello World ! It 's 2.5 @-@ 3 miles away , isn 't it ?",
+    "\" Quoted \" ( parenthesized ) \xE3\x80\x8A \xE5\xA4\xA9 \xE3\x80\x8B",
+    "tab\tsep\xE3\x80\x80ideographic\xC2\xA0nbsp  ",
+    "bad \xFF byte and a truncated \xE4\xB8",
+};
+
+int main() {
+    UErrorCode status = U_ZERO_ERROR;
+    u_setMemoryFunctions(nullptr, icu_alloc, icu_realloc, icu_free, &status);
+    CHECK(U_SUCCESS(status));
+
+    Segmenter segmenter;
+    Vocabulary vocab({"<unk>", "Hello", "World", "!", "@-@", "-"});
+    std::string out;
+    std::string normalized;
+    std::vector<TokenSpan> spans;
+    std::vector<int32_t> ids;
+    // Counting is hooked in, as setting up did allocate
+    CHECK(allocations > 0);
+
+    // Outputs are cleared, keeping their capacity, before each line
+    for (int pass=0; pass<3; ++pass) {
+        size_t before = allocations;
+        for (const std::string& line: LINES) {
+            out.clear();
+            segmenter.normalize_and_segment(line, out);
+            out.clear();
+            segmenter.desegment(line, out);
+            out.clear();
+            segmenter.normalize(line, out);
+            out.clear();
+            segmenter.segment(line, out);
+            spans.clear();
+            ids.clear();
+            segmenter.normalize_and_segment_spans(line, normalized, spans);
+            vocab.find_spans(normalized, spans, ids);
+        };
+        // The first passes grow buffers
+        if (pass == 2) CHECK_EQ(allocations - before, (size_t) 0);
+    };
+
+    // Buffers traded between calls have to fit in any order
+    for (auto line = LINES.rbegin(); line != LINES.rend(); ++line) {
+        size_t before = allocations;
+        out.clear();
+        segmenter.normalize_and_segment(*line, out);
+        CHECK_EQ_FOR(*line, allocations - before, (size_t) 0);
+
+        before = allocations;
+        out.clear();
+        segmenter.desegment(*line, out);
+        CHECK_EQ_FOR(*line, allocations - before, (size_t) 0);
+    };
+
+    return test_result();
+}
@@ -0,0 +1,113 @@
+#include <string>
+#include <vector>
+
+#include <unicode/unistr.h>
+
+#include "fasttokenizer/segmenter.h"
+#include "test_util.h"
+
+#ifdef TOKENIZER_NAMESPACE
+using namespace TOKENIZER_NAMESPACE;
+#endif
+
+/**
+ * Segmentation of ASCII text at the byte level has to give the output of
+ * the UTF-16 path that it bypasses. The word break classes it uses are
+ * probed from the linked ICU, so this pins them down against the ICU
+ * BreakIterator itself on every short string and on random lines.
+ */
+static std::string segment_utf16(Segmenter& segmenter, const std::string& text) {
+    icu::UnicodeString input = icu::UnicodeString::fromUTF8(text);
+    std::string out;
+    segmenter.process_utf16(Segmenter::SEGMENT, input).toUTF8String(out);
+    return out;
+}
+
+static std::vector<std::string> tokens(
+    const std::string& text,
+    const std::vector<TokenSpan>& spans
+) {
+    std::vector<std::string> out;
+    for (const TokenSpan& span: spans) {
+        std::string token = text.substr(span.begin, span.end - span.begin);
+        if (span.flags & TokenSpan::AT_PREFIX) token.insert(0, "@");
+        if (span.flags & TokenSpan::AT_SUFFIX) token.push_back('@');
+        out.push_back(token);
+    };
+    return out;
+}
+
+// Spans of the UTF-16 path, which a non-ASCII token after a space makes
+// segment_spans take, cut back to those within text
+static std::vector<std::string> spans_utf16(
+    Segmenter& segmenter,
+    const std::string& text
+) {
+    std::string extended = text + " \xE4\xB8\xAD";
+    std::vector<TokenSpan> spans;
+    segmenter.segment_spans(extended, spans);
+    while (!spans.empty() && spans.back().end > text.size()) spans.pop_back();
+    return tokens(text, spans);
+}
+
+static void check_ascii(Segmenter& segmenter, const std::string& text) {
+    std::string expected = segment_utf16(segmenter, text);
+    std::string out;
+    segmenter.segment(text, out);
+    CHECK_EQ_FOR(text, out, expected);
+    out.clear();
+    segmenter.normalize_and_segment(text, out);
+    CHECK_EQ_FOR(text, out, expected);
+
+    std::vector<TokenSpan> spans;
+    segmenter.segment_spans(text, spans);
+    CHECK_EQ_FOR(text, tokens(text, spans), spans_utf16(segmenter, text));
+}
+
+int main() {
+    Segmenter segmenter;
+    Segmenter dash_segmenter(true);
+    Segmenter protecting_segmenter(true, 0, {"#\\w+", "(\\d)\\1"},
+        ProtectedPatterns::URLS | ProtectedPatterns::EMAILS);
+    std::vector<Segmenter*> segmenters = {
+        &segmenter, &dash_segmenter, &protecting_segmenter};
+
+    // Every string of up to three ASCII characters, patterns are left to
+    // the random lines
+    for (Segmenter* s: {&segmenter, &dash_segmenter}) {
+        std::string text;
+        check_ascii(*s, text);
+        for (int a=0; a<128; ++a) {
+            text.assign(1, (char) a);
+            check_ascii(*s, text);
+            for (int b=0; b<128; ++b) {
+                text.resize(2);
+                text[1] = (char) b;
+                check_ascii(*s, text);
+                for (int c=0; c<128; ++c) {
+                    text.resize(3);
+                    text[2] = (char) c;
+                    check_ascii(*s, text);
+                };
+            };
+        };
+    };
+
+    // Random lines, with protected sequences both enclosed in separators
+    // and matched
+    TextGenerator generator(
+        {
+            "a", "Word", "it's", "don't", "3", "3.14", "1,000", "x_y", "-",
+            "--", "@", "@-@", "a-b", "e.g.", "U.S.", ":", "'", "\"", ".",
+            ",", "?!", "(", ")", "$5", "%", "#tag", "11", "www.a.io",
+            "http://a.io/b?c=1", "x@a.io", "\x1F", "\x1F" "a b\x1F",
+            "\x1F-x-\x1F", "\t", "\r", "\n", "\x0B", "\x1C", "\x7F",
+        },
+        {"", "", " ", " ", "  ", "-", "."});
+    for (int i=0; i<20000; ++i) {
+        std::string text = generator.next(12);
+        for (Segmenter* s: segmenters) check_ascii(*s, text);
+    };
+
+    return test_result();
+}
@@ -0,0 +1,94 @@
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "buffer_lines.h"
+#include "test_util.h"
+
+/**
+ * Lines read from and outputs packed into the Arrow and numpy layouts of
+ * process_buffers, which process_arrow wraps.
+ */
+static std::vector<std::string> strings(
+    const std::vector<icu::StringPiece>& lines
+) {
+    std::vector<std::string> out;
+    for (const icu::StringPiece& line: lines) {
+        out.push_back(std::string(line.data(), line.length()));
+    };
+    return out;
+}
+
+template <typename Offset>
+static void check_offset_lines() {
+    const std::string data = "onetwothree";
+    std::vector<icu::StringPiece> lines;
+
+    // A whole array, with an empty line standing for a null one
+    std::vector<Offset> offsets = {0, 3, 3, 6, 11};
+    offset_lines(
+        data.data(), data.size(), offsets.data(), offsets.size(), lines);
+    CHECK_EQ(strings(lines),
+        std::vector<std::string>({"one", "", "two", "three"}));
+
+    // A sliced array, whose offsets do not start at 0
+    lines.clear();
+    offset_lines(data.data(), data.size(), offsets.data() + 2, 3, lines);
+    CHECK_EQ(strings(lines), std::vector<std::string>({"two", "three"}));
+
+    // An empty array
+    lines.clear();
+    offset_lines(data.data(), data.size(), offsets.data(), 1, lines);
+    CHECK(lines.empty());
+
+    std::vector<std::vector<Offset>> invalid = {
+        {0, 3, 2}, {0, 12}, {-1, 3}, {4, 3, 11},
+    };
+    for (const std::vector<Offset>& bad: invalid) {
+        lines.clear();
+        bool thrown = false;
+        try {
+            offset_lines(
+                data.data(), data.size(), bad.data(), bad.size(), lines);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        };
+        CHECK(thrown);
+    };
+}
+
+int main() {
+    check_offset_lines<int32_t>();
+    check_offset_lines<int64_t>();
+
+    // Items of a numpy S4 array, NULs pad short items but not full ones
+    std::vector<icu::StringPiece> lines;
+    const char items[] = "ab\0\0abcd\0\0\0\0a\0b\0";
+    fixed_width_lines(items, 4, 4, lines);
+    CHECK_EQ(strings(lines),
+        std::vector<std::string>({"ab", "abcd", "", std::string("a\0b", 3)}));
+
+    std::vector<std::string> outs = {"a bc", "", "d", "e  f "};
+    std::vector<uint8_t> data;
+    std::vector<int64_t> token_offsets;
+    std::vector<int64_t> line_offsets;
+
+    pack_outputs(outs, false, data, token_offsets, line_offsets);
+    CHECK_EQ(std::string(data.begin(), data.end()), std::string("a bcde  f "));
+    CHECK_EQ(line_offsets, std::vector<int64_t>({0, 4, 4, 5, 10}));
+    CHECK_EQ(token_offsets, std::vector<int64_t>({0}));
+
+    // Outputs are replaced, not appended to
+    pack_outputs(outs, true, data, token_offsets, line_offsets);
+    CHECK_EQ(std::string(data.begin(), data.end()), std::string("abcdef"));
+    CHECK_EQ(token_offsets, std::vector<int64_t>({0, 1, 3, 4, 5, 6}));
+    CHECK_EQ(line_offsets, std::vector<int64_t>({0, 2, 2, 3, 5}));
+
+    pack_outputs({}, true, data, token_offsets, line_offsets);
+    CHECK(data.empty());
+    CHECK_EQ(token_offsets, std::vector<int64_t>({0}));
+    CHECK_EQ(line_offsets, std::vector<int64_t>({0}));
+
+    return test_result();
+}
@@ -0,0 +1,149 @@
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "compression.h"
+#include "test_util.h"
+
+/**
+ * Blocks compressed by compress_block and concatenated have to decompress
+ * to the original data for any size of the reads from the source and from
+ * the decompressor, also when one input block expands to more than a read
+ * can take and when a read ends exactly at the end of a member or frame.
+ */
+class StringInput : public InputStream {
+    private:
+        std::string data;
+        size_t pos;
+        size_t step;  // Most bytes handed out per read
+
+    public:
+        StringInput(const std::string& data, size_t step)
+            : data(data), pos(0), step(step) {};
+
+        size_t read(char* buf, size_t size) {
+            size_t n = std::min(std::min(size, step), data.size() - pos);
+            std::memcpy(buf, data.data() + pos, n);
+            pos += n;
+            return n;
+        };
+};
+
+static std::unique_ptr<InputStream> decompressor(
+    Compression compression,
+    const std::string& compressed,
+    size_t step
+) {
+    std::unique_ptr<InputStream> source(new StringInput(compressed, step));
+    if (compression == GZIP) {
+        return std::unique_ptr<InputStream>(new GzipInput(std::move(source)));
+    };
+#ifdef HAVE_ZSTD
+    return std::unique_ptr<InputStream>(new ZstdInput(std::move(source)));
+#else
+    throw std::runtime_error("Built without zstd support.");
+#endif
+}
+
+static std::string decompress(
+    Compression compression,
+    const std::string& compressed,
+    size_t step,
+    size_t read_size
+) {
+    std::unique_ptr<InputStream> input = decompressor(
+        compression, compressed, step);
+    std::string out;
+    std::vector<char> buf(read_size);
+    while (size_t n = input->read(buf.data(), read_size)) out.append(buf.data(), n);
+    // The end of input stays the end
+    CHECK_EQ(input->read(buf.data(), read_size), (size_t) 0);
+    return out;
+}
+
+static std::string compress(
+    Compression compression,
+    const std::vector<std::string>& blocks
+) {
+    std::string compressed;
+    for (const std::string& block: blocks) {
+        compress_block(compression, block.data(), block.size(), compressed);
+    };
+    return compressed;
+}
+
+static void check_round_trip(
+    Compression compression,
+    const std::vector<std::string>& blocks,
+    const std::vector<size_t>& read_sizes
+) {
+    std::string data;
+    for (const std::string& block: blocks) data.append(block);
+    std::string compressed = compress(compression, blocks);
+
+    for (size_t step: {(size_t) 1, (size_t) 7, COMPRESSION_BUFFER_SIZE}) {
+        for (size_t read_size: read_sizes) {
+            std::string label = std::to_string(compressed.size())
+                + " bytes read " + std::to_string(step) + " and "
+                + std::to_string(read_size) + " at a time";
+            std::string out = decompress(compression, compressed, step, read_size);
+            CHECK_EQ_FOR(label, out.size(), data.size());
+            CHECK_EQ_FOR(label, out == data, true);
+        };
+    };
+}
+
+static void check_truncated(
+    Compression compression,
+    const std::string& compressed
+) {
+    bool thrown = false;
+    try {
+        decompress(compression, compressed, COMPRESSION_BUFFER_SIZE, 4096);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    };
+    CHECK_EQ_FOR(compressed, thrown, true);
+}
+
+static void check_compression(Compression compression) {
+    // Expands far beyond the buffers of the decompressor
+    std::string repeated;
+    while (repeated.size() < (3 << 20)) repeated.append("abc abc abd\n");
+    std::string text;
+    TextGenerator generator(
+        {"a", "the", "word", "\xC3\xA9t\xC3\xA9", "\xE4\xB8\xAD", "42"},
+        {" ", " ", "\n", ", "});
+    while (text.size() < COMPRESSION_BUFFER_SIZE * 2) text.append(generator.next(8));
+
+    check_round_trip(compression, {}, {1, 4096});
+    check_round_trip(compression, {""}, {1, 4096});
+    check_round_trip(compression, {"a", "", "bc"}, {1, 2, 3, 4096});
+    check_round_trip(compression, {repeated},
+        {4096, COMPRESSION_BUFFER_SIZE, 4 * COMPRESSION_BUFFER_SIZE});
+    check_round_trip(compression, {text, repeated, text},
+        {4093, COMPRESSION_BUFFER_SIZE});
+
+    // Reads that end exactly where members and frames end
+    check_round_trip(compression, {std::string(4096, 'x')}, {4096, 1024});
+    check_round_trip(compression,
+        {std::string(4096, 'x'), text.substr(0, 4096), std::string(4096, 'y')},
+        {4096, 2048});
+    check_round_trip(compression,
+        {repeated.substr(0, COMPRESSION_BUFFER_SIZE)},
+        {COMPRESSION_BUFFER_SIZE, COMPRESSION_BUFFER_SIZE / 4});
+
+    std::string compressed = compress(compression, {text, repeated});
+    check_truncated(compression, compressed.substr(0, compressed.size() - 1));
+    check_truncated(compression, compressed.substr(0, compressed.size() / 2));
+    check_truncated(compression, compressed.substr(0, 3));
+}
+
+int main() {
+    check_compression(GZIP);
+#ifdef HAVE_ZSTD
+    check_compression(ZSTD);
+#endif
+    return test_result();
+}
@@ -0,0 +1,81 @@
+#include <string>
+#include <vector>
+
+#include <unicode/unistr.h>
+
+#include "fasttokenizer/segmenter.h"
+#include "test_util.h"
+
+#ifdef TOKENIZER_NAMESPACE
+using namespace TOKENIZER_NAMESPACE;
+#endif
+
+/**
+ * Desegmentation of UTF-8 text has to give the output of the UTF-16 path
+ * that it replaces, which is still used for UTF-16 input.
+ */
+static std::string desegment_utf16(Segmenter& segmenter, const std::string& text) {
+    icu::UnicodeString input = icu::UnicodeString::fromUTF8(text);
+    std::string out;
+    segmenter.process_utf16(Segmenter::DESEGMENT, input).toUTF8String(out);
+    return out;
+}
+
+static void check_desegment(Segmenter& segmenter, const std::string& text) {
+    std::string out;
+    segmenter.desegment(text, out);
+    CHECK_EQ_FOR(text, out, desegment_utf16(segmenter, text));
+}
+
+int main() {
+    Segmenter segmenter;
+
+    // Known outputs
+    std::string out;
+    segmenter.desegment("Hello World !", out);
+    CHECK_EQ(out, std::string("Hello World!"));
+    out.clear();
+    segmenter.desegment("It's 2.5 @-@ 3 miles away .", out);
+    CHECK_EQ(out, std::string("It's 2.5-3 miles away."));
+    out.clear();
+    segmenter.desegment("a @- b -@ c", out);
+    CHECK_EQ(out, std::string("a- b -c"));
+
+    std::vector<std::string> cases = {
+        "",
+        " ",
+        "a @-@ b @- c -@ d @-@",
+        "@-@ @- -@ @@-@@ -",
+        "\x1FH.E.L.L.O\x1F world \x1F@-@\x1F",
+        "\" quoted \" and ' single ' and James ' book",
+        "1 \" 2 \" ( 3 ) [ x ] { y }",
+        "\xE4\xBB\x96\xE7\x9A\x84 \xE3\x80\x8A \xE5\xA4\xA9\xE7\xA9\xBA \xE3\x80\x8B \xE3\x80\x82",
+        "e\xCC\x81 \xCC\x81 a\xCC\x81\xCC\xA7 , \xE0\xB8\x81\xE0\xB8\xB3",
+        "\xF0\x9F\x98\x80 \" \xF0\x9D\x9F\x8E \" \xF0\x9F\x98\x80",
+        "\xD9\xA1\xD9\xA2 \" x",
+        "tab\tsep\xE3\x80\x80ideographic\xC2\xA0nbsp\xE2\x80\x83" "em",
+        "\xC3 truncated",
+        "bad \xFF byte",
+        "surrogate \xED\xA0\x80 here",
+        "overlong \xC0\xAF and \xE0\x80\xAF",
+        "above \xF4\x90\x80\x80 max",
+        "ends in a truncated \xE4\xB8",
+    };
+    for (const std::string& text: cases) check_desegment(segmenter, text);
+
+    TextGenerator generator(
+        {
+            "word", "s", "2.5", "'", "\"", "(", ")", ",", ".", "!", "?",
+            "@-@", "@-", "-@", "-", "@", "\x1Fprotected span\x1F", "\x1F",
+            "\xE4\xBB\x96\xE7\x9A\x84", "\xE3\x80\x8A", "\xE3\x80\x8B",
+            "\xE3\x80\x82", "\xEF\xBC\x8C", "e\xCC\x81", "\xCC\x81",
+            "\xE0\xB8\x81\xE0\xB8\xB3", "\xD9\xA1", "\xF0\x9F\x98\x80",
+            "\xE2\x80\x9C", "\xE2\x80\x9D", "\xC2\xBF", "\xC3", "\xFF",
+            "\xED\xA0\x80", "\xC0\xAF", "\xF4\x90\x80\x80", "\xE4\xB8",
+        },
+        {" ", " ", " ", "  ", "", "\t", "\xE3\x80\x80", "\xC2\xA0",
+         "\xE2\x80\x83", "\n"});
+    for (int i=0; i<20000; ++i) check_desegment(segmenter, generator.next(16));
+
+    return test_result();
+}
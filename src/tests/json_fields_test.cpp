@@ -0,0 +1,229 @@
+#include <random>
+#include <string>
+#include <vector>
+
+#include "json_fields.h"
+#include "test_util.h"
+
+/**
+ * String fields found in JSON records, unescaped and escaped again, as
+ * --json rewrites them. Everything but the values rewritten has to be
+ * copied byte for byte.
+ */
+static std::vector<std::string> find_fields(const std::string& record) {
+    std::vector<JsonField> fields;
+    std::vector<std::string> found;
+    if (!find_json_fields(record.data(), record.size(), fields)) return found;
+    for (const JsonField& field: fields) {
+        found.push_back(std::string(field.key, field.key_size));
+        found.push_back(record.substr(
+            field.value_begin, field.value_end - field.value_begin));
+    };
+    return found;
+}
+
+static bool is_object(const std::string& record) {
+    std::vector<JsonField> fields;
+    return find_json_fields(record.data(), record.size(), fields);
+}
+
+static std::string unescape(const std::string& text) {
+    std::string out;
+    if (!json_unescape(text.data(), text.size(), out)) return "<invalid>";
+    return out;
+}
+
+static std::string escape(const std::string& text) {
+    std::string out;
+    json_escape(text.data(), text.size(), out);
+    return out;
+}
+
+// Each string value unescaped and escaped again, the rest copied
+static std::string rewrite(const std::string& record) {
+    std::vector<JsonField> fields;
+    if (!find_json_fields(record.data(), record.size(), fields)) return record;
+    std::string out;
+    size_t copied = 0;
+    for (const JsonField& field: fields) {
+        out.append(record, copied, field.value_begin - copied);
+        out.append(escape(unescape(record.substr(
+            field.value_begin, field.value_end - field.value_begin))));
+        copied = field.value_end;
+    };
+    out.append(record, copied, std::string::npos);
+    return out;
+}
+
+static void check_find() {
+    CHECK_EQ(find_fields("{\"text\": \"a b\", \"id\": \"7\"}"),
+        std::vector<std::string>({"text", "a b", "id", "7"}));
+    CHECK_EQ(find_fields(" \t{ \"text\"\n:\r\"x\" } \n"),
+        std::vector<std::string>({"text", "x"}));
+    CHECK(is_object("{}"));
+    CHECK(is_object(" { } "));
+
+    // Values of other types are skipped, also when they hold the key
+    // name, strings that look like structure or escaped quotes
+    CHECK_EQ(find_fields(
+        "{\"n\": -1.5e3, \"b\": true, \"f\": false, \"z\": null,"
+        " \"a\": [\"text\", {\"text\": \"x\"}, [[]]],"
+        " \"o\": {\"text\": \"y\", \"k\": [\"text\", \"}]\"]},"
+        " \"text\": \"a\"}"),
+        std::vector<std::string>({"text", "a"}));
+    CHECK_EQ(find_fields("{\"text\": \"say \\\"hi\\\" \\\\\", \"k\": \"\\\\\"}"),
+        std::vector<std::string>({"text", "say \\\"hi\\\" \\\\", "k", "\\\\"}));
+
+    // Duplicate keys are all found, keys stay escaped
+    CHECK_EQ(find_fields("{\"text\": \"a\", \"text\": \"b\", \"te\\u0078t\": \"c\"}"),
+        std::vector<std::string>(
+            {"text", "a", "text", "b", "te\\u0078t", "c"}));
+
+    // Anything but a single well-formed object
+    const std::vector<std::string> malformed = {
+        "", " ", "[]", "[{\"text\": \"a\"}]", "\"text\"", "1", "null", "{",
+        "}", "{\"a\"}", "{\"a\":}", "{\"a\": \"b\",}", "{,}",
+        "{\"a\": \"b\"} x", "{\"a\": \"b\"}{}", "{\"a\": \"b\" \"c\": \"d\"}",
+        "{\"a\": \"unterminated}", "{\"a\": \"b\\\"}", "{\"a\": [1, 2",
+        "{\"a\": {\"b\": \"c\"}", "{a: \"b\"}", "{\"a\" \"b\"}",
+    };
+    for (const std::string& record: malformed) {
+        CHECK_EQ_FOR(record, is_object(record), false);
+    };
+}
+
+static void check_unescape() {
+    CHECK_EQ(unescape("plain \xC3\xA9"), std::string("plain \xC3\xA9"));
+    CHECK_EQ(unescape("\\\"\\\\\\/\\b\\f\\n\\r\\t"),
+        std::string("\"\\/\b\f\n\r\t"));
+    CHECK_EQ(unescape("\\u0041\\u00e9\\u00C9\\u4e2d"),
+        std::string("A\xC3\xA9\xC3\x89\xE4\xB8\xAD"));
+    CHECK_EQ(unescape("a\\u0000b"), std::string("a\0b", 3));
+
+    // Surrogate pairs, lone and reversed surrogates
+    CHECK_EQ(unescape("\\uD83D\\uDE00"), std::string("\xF0\x9F\x98\x80"));
+    CHECK_EQ(unescape("\\udbff\\udfff"), std::string("\xF4\x8F\xBF\xBF"));
+    CHECK_EQ(unescape("\\uD83D"), std::string("\xEF\xBF\xBD"));
+    CHECK_EQ(unescape("\\uD83Dx"), std::string("\xEF\xBF\xBDx"));
+    CHECK_EQ(unescape("\\uDE00"), std::string("\xEF\xBF\xBD"));
+    CHECK_EQ(unescape("\\uDE00\\uD83D"),
+        std::string("\xEF\xBF\xBD\xEF\xBF\xBD"));
+    CHECK_EQ(unescape("\\uD83D\\uD83D\\uDE00"),
+        std::string("\xEF\xBF\xBD\xF0\x9F\x98\x80"));
+    CHECK_EQ(unescape("\\uD83D\\n"), std::string("\xEF\xBF\xBD\n"));
+
+    const std::vector<std::string> invalid = {
+        "\\", "a\\", "\\x", "\\U0041", "\\u", "\\u12", "\\u12G4",
+        "\\uD83D\\u12",
+    };
+    for (const std::string& text: invalid) {
+        CHECK_EQ_FOR(text, unescape(text), std::string("<invalid>"));
+    };
+}
+
+static void check_escape() {
+    CHECK_EQ(escape("a \"b\" \\ \xC3\xA9 \x7F"),
+        std::string("a \\\"b\\\" \\\\ \xC3\xA9 \x7F"));
+    CHECK_EQ(escape("\b\f\n\r\t"), std::string("\\b\\f\\n\\r\\t"));
+    CHECK_EQ(escape(std::string("\0\x01\x1F", 3)),
+        std::string("\\u0000\\u0001\\u001f"));
+
+    // Escaping then unescaping gives back any bytes
+    for (int c=0; c<256; ++c) {
+        std::string text = "a" + std::string(1, (char) c) + "b";
+        CHECK_EQ_FOR(text, unescape(escape(text)), text);
+    };
+}
+
+// Random records of nested values, string values hold escapes of all kinds
+static std::string random_value(std::mt19937& random, int depth) {
+    static const std::vector<std::string> strings = {
+        "\"\"", "\"text\"", "\"a b\"", "\"\\\"q\\\"\"", "\"\\\\\"",
+        "\"\\n\\t\"", "\"\\u00e9\"", "\"\\uD83D\\uDE00\"", "\"\\uD83D\"",
+        "\"\\u0000\"", "\"\\/\"", "\"\xC3\xA9 \xE4\xB8\xAD\"", "\"}]\"",
+        "\"\\u001F\"",
+    };
+    static const std::vector<std::string> scalars = {
+        "0", "-1.5e3", "true", "false", "null",
+    };
+    static const std::vector<std::string> keys = {
+        "\"text\"", "\"id\"", "\"te\\u0078t\"", "\"\"",
+    };
+    static const std::vector<std::string> spaces = {"", " ", "\n", " \t "};
+    auto pick = [&](const std::vector<std::string>& from) {
+        return from[random() % from.size()];
+    };
+
+    int kind = depth > 2 ? random() % 2 : random() % 4;
+    if (kind == 0) return pick(strings);
+    if (kind == 1) return pick(scalars);
+
+    std::string out = kind == 2 ? "[" : "{";
+    int length = random() % 4;
+    for (int i=0; i<length; ++i) {
+        if (i > 0) out.append(",");
+        out.append(pick(spaces));
+        if (kind == 3) out.append(pick(keys) + pick(spaces) + ":" + pick(spaces));
+        out.append(random_value(random, depth + 1));
+        out.append(pick(spaces));
+    };
+    return out + (kind == 2 ? "]" : "}");
+}
+
+static void check_rewrite() {
+    std::mt19937 random(1);
+    for (int i=0; i<20000; ++i) {
+        std::string record = random_value(random, 0);
+        std::string rewritten = rewrite(record);
+
+        // Records are well-formed, only other values are not objects
+        CHECK_EQ_FOR(record, is_object(record), record[0] == '{');
+        if (!is_object(record)) {
+            CHECK_EQ_FOR(record, rewritten, record);
+            continue;
+        };
+
+        // Bytes around the values are kept and the values read back the
+        // same, values escaped as json_escape does are kept as well
+        std::vector<JsonField> fields;
+        std::vector<JsonField> rewritten_fields;
+        find_json_fields(record.data(), record.size(), fields);
+        CHECK_EQ_FOR(record, find_json_fields(
+            rewritten.data(), rewritten.size(), rewritten_fields), true);
+        CHECK_EQ_FOR(record, rewritten_fields.size(), fields.size());
+        if (rewritten_fields.size() != fields.size()) continue;
+
+        size_t copied = 0;
+        size_t rewritten_copied = 0;
+        bool canonical = true;
+        for (size_t k=0; k<fields.size(); ++k) {
+            std::string between = record.substr(
+                copied, fields[k].value_begin - copied);
+            std::string rewritten_between = rewritten.substr(rewritten_copied,
+                rewritten_fields[k].value_begin - rewritten_copied);
+            CHECK_EQ_FOR(record, rewritten_between, between);
+
+            std::string value = record.substr(fields[k].value_begin,
+                fields[k].value_end - fields[k].value_begin);
+            std::string rewritten_value = rewritten.substr(
+                rewritten_fields[k].value_begin,
+                rewritten_fields[k].value_end - rewritten_fields[k].value_begin);
+            CHECK_EQ_FOR(record, unescape(rewritten_value), unescape(value));
+            if (escape(unescape(value)) != value) canonical = false;
+
+            copied = fields[k].value_end;
+            rewritten_copied = rewritten_fields[k].value_end;
+        };
+        CHECK_EQ_FOR(record,
+            rewritten.substr(rewritten_copied), record.substr(copied));
+        if (canonical) CHECK_EQ_FOR(record, rewritten, record);
+    };
+}
+
+int main() {
+    check_find();
+    check_unescape();
+    check_escape();
+    check_rewrite();
+    return test_result();
+}
@@ -0,0 +1,109 @@
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fasttokenizer/segmenter.h"
+#include "test_util.h"
+
+#ifdef TOKENIZER_NAMESPACE
+using namespace TOKENIZER_NAMESPACE;
+#endif
+
+/**
+ * Lines split into pieces have to give the output of processing them whole,
+ * both through split_long_line, process_piece and finish_pieces and through
+ * batches. Tiny long_line_bytes make nearly every space a candidate split
+ * point, so split points are checked next to every kind of character.
+ */
+static const std::vector<Segmenter::Mode> MODES = {
+    Segmenter::NORMALIZE, Segmenter::SEGMENT,
+    Segmenter::NORMALIZE_AND_SEGMENT,
+};
+
+// Whether text was split, its joined output is checked either way
+static bool check_pieces(
+    Segmenter& whole,
+    Segmenter& split,
+    Segmenter::Mode mode,
+    const std::string& text
+) {
+    std::string expected;
+    whole.process(mode, text, expected);
+
+    std::vector<icu::StringPiece> pieces;
+    if (!split.split_long_line(mode, text, pieces)) {
+        CHECK_EQ_FOR(text, pieces.size(), (size_t) 0);
+        return false;
+    };
+
+    // Output is appended after what out holds already
+    std::string out = "kept ";
+    size_t offset = out.size();
+    std::string joined;
+    for (const icu::StringPiece& piece: pieces) {
+        joined.append(piece.data(), piece.length());
+        split.process_piece(mode, piece, out);
+    };
+    split.finish_pieces(mode, out, offset);
+    CHECK_EQ_FOR(text, joined, text);
+    CHECK_EQ_FOR(text, out, "kept " + expected);
+    return true;
+}
+
+int main() {
+    std::vector<std::unique_ptr<Segmenter>> segmenters;
+    segmenters.emplace_back(new Segmenter());
+    segmenters.emplace_back(new Segmenter(true));
+    segmenters.emplace_back(new Segmenter(true, 0, {"#\\w+", "(\\d)\\1"},
+        ProtectedPatterns::URLS | ProtectedPatterns::EMAILS));
+
+    TextGenerator generator(
+        {
+            // Latin, combining marks and compatibility characters
+            "a", "Word", "it's", "3.14", "1,000", "e\xCC\x81", "\xC3\xA9",
+            "\xCC\x81", "\xEF\xAC\x81", "\xE2\x84\xAB", "\xEF\xBC\xA1",
+            // Thai, whose U+0E33 decomposes into a nonspacing mark under
+            // NFKC, Chinese, Japanese, Hangul and jamo
+            "\xE0\xB8\x81\xE0\xB8\xB3", "\xE0\xB8\xB3", "\xE4\xB8\xAD\xE6\x96\x87",
+            "\xE3\x81\x8B\xE3\x82\x99", "\xED\x95\x9C", "\xE1\x84\x92",
+            "\xE1\x85\xA1", "\xF0\x9F\x98\x80",
+            // Dashes, punctuation and spacing
+            "-", "@-@", "a-b", "--", ".", ",", "\"", "(", ")", "\xE2\x80\x94",
+            "\xC2\xA0", "\xE3\x80\x80", "\t",
+            // Protected sequences, enclosed ones holding spaces, and
+            // ill-formed bytes
+            "\x1F", "\x1F" "a b\x1F", "\x1F" "c - d\x1F", "#tag", "11",
+            "http://a.io/b", "www.a.io", "x@a.io", "\xFF", "\xC3",
+        },
+        {" ", " ", " ", "  ", "", "-"});
+
+    std::vector<std::string> texts;
+    for (int i=0; i<3000; ++i) texts.push_back(generator.next(40));
+    std::vector<icu::StringPiece> lines(texts.begin(), texts.end());
+
+    for (std::unique_ptr<Segmenter>& whole: segmenters) {
+        whole->set_long_line_bytes(0);
+        for (size_t long_line_bytes: {1, 2, 7, 32}) {
+            std::unique_ptr<Segmenter> split(whole->clone());
+            split->set_long_line_bytes(long_line_bytes);
+            for (Segmenter::Mode mode: MODES) {
+                size_t num_split = 0;
+                for (const std::string& text: texts) {
+                    if (check_pieces(*whole, *split, mode, text)) ++num_split;
+                };
+                CHECK(num_split > texts.size() / 2);
+
+                // Batches split lines when they run on several threads
+                std::vector<std::string> expected;
+                whole->process_batch(mode, lines, expected, 1);
+                std::vector<std::string> outs;
+                split->process_batch(mode, lines, outs, 4);
+                for (size_t i=0; i<texts.size(); ++i) {
+                    CHECK_EQ_FOR(texts[i], outs[i], expected[i]);
+                };
+            };
+        };
+    };
+
+    return test_result();
+}
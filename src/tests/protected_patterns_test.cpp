@@ -0,0 +1,171 @@
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unicode/unistr.h>
+
+#include "fasttokenizer/protected_patterns.h"
+#include "test_util.h"
+
+#ifdef TOKENIZER_NAMESPACE
+using namespace TOKENIZER_NAMESPACE;
+#endif
+
+/**
+ * Protected sequences found in UTF-8 and in UTF-16 text have to be the same
+ * and the ones a single alternation of the patterns would find.
+ */
+static std::vector<std::string> find_utf8(
+    ProtectedMatcher& matcher,
+    const std::string& text
+) {
+    std::vector<std::string> found;
+    matcher.reset(text.data(), text.size());
+    size_t begin, end;
+    while (matcher.next(begin, end)) {
+        found.push_back(text.substr(begin, end - begin));
+    };
+    return found;
+}
+
+static std::vector<std::string> find_utf16(
+    ProtectedMatcher& matcher,
+    const std::string& text
+) {
+    icu::UnicodeString utf16 = icu::UnicodeString::fromUTF8(text);
+    std::vector<std::string> found;
+    matcher.reset(utf16.getBuffer(), utf16.length());
+    size_t begin, end;
+    while (matcher.next(begin, end)) {
+        found.push_back("");
+        utf16.tempSubStringBetween(begin, end).toUTF8String(found.back());
+    };
+    return found;
+}
+
+static void check_matches(
+    ProtectedMatcher& matcher,
+    const std::string& text,
+    const std::vector<std::string>& expected
+) {
+    CHECK_EQ_FOR(text, find_utf8(matcher, text), expected);
+    CHECK_EQ_FOR(text, find_utf16(matcher, text), expected);
+}
+
+static std::unique_ptr<ProtectedMatcher> make_matcher(
+    const std::vector<std::string>& patterns,
+    int builtins=ProtectedPatterns::NONE
+) {
+    return std::unique_ptr<ProtectedMatcher>(new ProtectedMatcher(
+        std::make_shared<ProtectedPatterns>(patterns, builtins)));
+}
+
+static void check_patterns() {
+    // Backreferences keep referring to their own groups after others
+    std::unique_ptr<ProtectedMatcher> matcher = make_matcher(
+        {"\\d+", "([\"'])\\w+\\1"});
+    check_matches(*matcher, "say \"hi\" and 'yo\" 42",
+        {"\"hi\"", "42"});
+    matcher = make_matcher({"(\\d)x", "([\"'])\\w+\\1", "(a)(b)\\2\\1"});
+    check_matches(*matcher, "'yo' 1x abba \"no'",
+        {"'yo'", "1x", "abba"});
+    matcher = make_matcher({"x+", "(?<q>[\"'])\\w+\\k<q>"});
+    check_matches(*matcher, "xx 'a' \"b'", {"xx", "'a'"});
+
+    // The first pattern that matches at the leftmost position wins, also
+    // across alternations
+    matcher = make_matcher({"ab", "abc"});
+    check_matches(*matcher, "abc", {"ab"});
+    matcher = make_matcher({"ab", "(x)\\1|abc"});
+    check_matches(*matcher, "abc xx", {"ab", "xx"});
+    matcher = make_matcher({"(x)\\1|abc", "ab"});
+    check_matches(*matcher, "abc ab", {"abc", "ab"});
+    matcher = make_matcher({"(x)\\1", "b+"});
+    check_matches(*matcher, "a xxbb b", {"xx", "bb", "b"});
+
+    // Matches never overlap and empty ones are skipped
+    matcher = make_matcher({"a*", "(b)\\1", "bbb"});
+    check_matches(*matcher, "bbb aa", {"bb", "aa"});
+
+    bool thrown = false;
+    try {
+        make_matcher({"(a)\\2"});
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    };
+    CHECK(thrown);
+}
+
+static void check_builtins() {
+    std::unique_ptr<ProtectedMatcher> matcher = make_matcher(
+        {}, ProtectedPatterns::URLS | ProtectedPatterns::EMAILS);
+
+    // Trailing punctuation ends a sentence rather than the URL
+    check_matches(*matcher, "see http://example.com/a.",
+        {"http://example.com/a"});
+    check_matches(*matcher, "http://a.io/b?!, 'https://a.io/c';",
+        {"http://a.io/b", "https://a.io/c"});
+    check_matches(*matcher, "http://a.io/?q=1&r=2#x",
+        {"http://a.io/?q=1&r=2#x"});
+
+    // Closing parentheses are kept only when the URL opened them
+    check_matches(*matcher,
+        "(see https://en.wikipedia.org/wiki/Foo_(bar)).",
+        {"https://en.wikipedia.org/wiki/Foo_(bar)"});
+    check_matches(*matcher, "(www.example.com)", {"www.example.com"});
+    check_matches(*matcher, "(http://a.io/(b)))", {"http://a.io/(b)"});
+
+    // www. at the start of the text, in any case, but not within a name
+    check_matches(*matcher, "www.example.com is", {"www.example.com"});
+    check_matches(*matcher, "WwW.Example.com", {"WwW.Example.com"});
+    check_matches(*matcher, "awww.example.com www. www.", {});
+
+    // Schemes start with a letter, addresses are ASCII
+    check_matches(*matcher, "1svn+ssh://host/x", {"svn+ssh://host/x"});
+    check_matches(*matcher, "x:// ://a.b http://",  {});
+    check_matches(*matcher,
+        "\xE8\xA7\x81http://example.com/\xE8\xB7\xAF",
+        {"http://example.com/"});
+
+    // Emails need a domain of two labels, ASCII local parts and no leading
+    // dots
+    check_matches(*matcher, "mail john.doe@example.co.uk, now",
+        {"john.doe@example.co.uk"});
+    check_matches(*matcher, "a@b.cd.", {"a@b.cd"});
+    check_matches(*matcher, "user@localhost @example.com a@b", {});
+    check_matches(*matcher, ".x@a.io caf\xC3\xA9@a.io", {"x@a.io"});
+    check_matches(*matcher, "mailto:x@a.io", {"x@a.io"});
+
+    // Only the kinds asked for are found
+    matcher = make_matcher({}, ProtectedPatterns::URLS);
+    check_matches(*matcher, "x@a.io www.a.io", {"www.a.io"});
+    matcher = make_matcher({}, ProtectedPatterns::EMAILS);
+    check_matches(*matcher, "x@a.io www.a.io", {"x@a.io"});
+
+    // Built-ins win ties with patterns
+    matcher = make_matcher({"www\\.\\w+"}, ProtectedPatterns::URLS);
+    check_matches(*matcher, "www.a.io", {"www.a.io"});
+}
+
+int main() {
+    check_patterns();
+    check_builtins();
+
+    // Random text, where only the two paths are compared
+    std::unique_ptr<ProtectedMatcher> matcher = make_matcher(
+        {"(\\d)\\1", "#\\w+"},
+        ProtectedPatterns::URLS | ProtectedPatterns::EMAILS);
+    TextGenerator generator(
+        {
+            "a", "W", "www", ".", ":", "/", "//", "@", "(", ")", "-", "+",
+            "http", "example", "io", "11", "#tag", "!", ",", "'",
+            "\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80",
+        },
+        {"", "", "", " "});
+    for (int i=0; i<20000; ++i) {
+        std::string text = generator.next(24);
+        CHECK_EQ_FOR(text, find_utf8(*matcher, text), find_utf16(*matcher, text));
+    };
+
+    return test_result();
+}
@@ -0,0 +1,108 @@
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "fasttokenizer/segmenter.h"
+#include "test_util.h"
+
+#ifdef TOKENIZER_NAMESPACE
+using namespace TOKENIZER_NAMESPACE;
+#endif
+
+/**
+ * Cached outputs of lines and of the space delimited chunks of
+ * segment_chunks_inbuf have to be the outputs computed without a cache.
+ * Caches smaller than the corpus keep evicting, with one entry per shard up
+ * to 64 shards, and batches share them between clones on several threads.
+ */
+static const std::vector<Segmenter::Mode> MODES = {
+    Segmenter::NORMALIZE, Segmenter::SEGMENT,
+    Segmenter::NORMALIZE_AND_SEGMENT, Segmenter::DESEGMENT,
+};
+
+static std::vector<std::string> process_all(
+    Segmenter& segmenter,
+    Segmenter::Mode mode,
+    const std::vector<std::string>& texts
+) {
+    std::vector<std::string> outs(texts.size());
+    for (size_t i=0; i<texts.size(); ++i) {
+        segmenter.process(mode, texts[i], outs[i]);
+    };
+    return outs;
+}
+
+static std::unique_ptr<Segmenter> make_segmenter(
+    size_t variant,
+    size_t cache_size
+) {
+    if (variant == 0) {
+        return std::unique_ptr<Segmenter>(new Segmenter(false, cache_size));
+    };
+    return std::unique_ptr<Segmenter>(new Segmenter(
+        true, cache_size, {"#\\w+", "(\\d)\\1"},
+        ProtectedPatterns::URLS | ProtectedPatterns::EMAILS));
+}
+
+int main() {
+    // Chunks long enough to be cached, next to spaces, protected sequences
+    // and characters that attach to the spaces before them
+    TextGenerator chunk_generator(
+        {
+            "a", "Word", "it's", "3.14", "e\xCC\x81", "\xC3\xA9", "-",
+            "\xE4\xB8\xAD\xE6\x96\x87", "\xE0\xB8\x81\xE0\xB8\xB3",
+            "\xEF\xAC\x81", "\xF0\x9F\x98\x80", "@-@", ".", "\"", "#tag",
+            "11", "www.a.io", "x@a.io", "\x1F" "a b\x1F", "\x1F",
+        },
+        {"", "", "-", "'"});
+    std::vector<std::string> chunks;
+    for (int i=0; i<60; ++i) chunks.push_back(chunk_generator.next(8));
+    TextGenerator line_generator(
+        chunks, {" ", " ", "  ", " \xCC\x81", "\xE3\x80\x80", "\t"}, 2);
+
+    // Repeated lines, and lines sharing chunks
+    std::vector<std::string> distinct;
+    for (int i=0; i<300; ++i) distinct.push_back(line_generator.next(10));
+    std::vector<std::string> texts;
+    std::mt19937 random(3);
+    for (int i=0; i<4000; ++i) {
+        if (random() % 4 == 0) {
+            texts.push_back(line_generator.next(10));
+        } else {
+            texts.push_back(distinct[random() % distinct.size()]);
+        };
+    };
+    std::vector<icu::StringPiece> lines(texts.begin(), texts.end());
+
+    for (size_t variant=0; variant<2; ++variant) {
+        std::unique_ptr<Segmenter> uncached = make_segmenter(variant, 0);
+        for (size_t cache_size: {1, 7, 64, 100, 1000, 100000}) {
+            std::unique_ptr<Segmenter> cached = make_segmenter(
+                variant, cache_size);
+            for (Segmenter::Mode mode: MODES) {
+                std::vector<std::string> expected = process_all(
+                    *uncached, mode, texts);
+                std::vector<std::string> outs = process_all(
+                    *cached, mode, texts);
+                for (size_t i=0; i<texts.size(); ++i) {
+                    CHECK_EQ_FOR(texts[i], outs[i], expected[i]);
+                };
+
+                outs.clear();
+                cached->process_batch(mode, lines, outs, 4);
+                for (size_t i=0; i<texts.size(); ++i) {
+                    CHECK_EQ_FOR(texts[i], outs[i], expected[i]);
+                };
+            };
+
+            SegmenterStats stats = cached->get_stats();
+            CHECK(stats.cache_line_hits > 0);
+            CHECK(stats.cache_line_misses > 0);
+            CHECK(stats.cache_chunk_hits > 0);
+            CHECK(stats.cache_chunk_misses > 0);
+        };
+    };
+
+    return test_result();
+}
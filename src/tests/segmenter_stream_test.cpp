@@ -0,0 +1,109 @@
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "fasttokenizer/segmenter.h"
+#include "test_util.h"
+
+#ifdef TOKENIZER_NAMESPACE
+using namespace TOKENIZER_NAMESPACE;
+#endif
+
+/**
+ * A document fed to SegmenterStream in chunks has to give the output of the
+ * one-shot functions on the whole document, wherever the chunks end,
+ * including within UTF-8 sequences and between the separators of protected
+ * sequences.
+ */
+struct StreamMode {
+    bool normalize;
+    bool segment;
+    Segmenter::Mode mode;
+};
+
+static const std::vector<StreamMode> MODES = {
+    {true, false, Segmenter::NORMALIZE},
+    {false, true, Segmenter::SEGMENT},
+    {true, true, Segmenter::NORMALIZE_AND_SEGMENT},
+};
+
+// Output of document fed in chunks ending at the given offsets
+static std::string stream(
+    SegmenterStream& segmenter_stream,
+    const std::string& document,
+    const std::vector<size_t>& ends
+) {
+    std::string out;
+    size_t begin = 0;
+    for (size_t end: ends) {
+        segmenter_stream.feed(
+            icu::StringPiece(document.data() + begin, end - begin), out);
+        begin = end;
+    };
+    segmenter_stream.feed(
+        icu::StringPiece(document.data() + begin, document.size() - begin),
+        out);
+    segmenter_stream.flush(out);
+    return out;
+}
+
+// Chunk ends at every byte, at random offsets, and right after each byte
+// that is not ASCII or is a separator
+static std::vector<std::vector<size_t>> chunkings(
+    const std::string& document,
+    std::mt19937& random
+) {
+    std::vector<std::vector<size_t>> out(4);
+    for (size_t i=0; i<=document.size(); ++i) {
+        out[0].push_back(i);
+        if (random() % 7 == 0) out[1].push_back(i);
+        if (random() % 2 == 0) out[2].push_back(i);
+        if (i > 0 && (document[i - 1] & 0x80 || document[i - 1] == '\x1F')) {
+            out[3].push_back(i);
+        };
+    };
+    return out;
+}
+
+int main() {
+    std::vector<std::unique_ptr<Segmenter>> segmenters;
+    segmenters.emplace_back(new Segmenter());
+    segmenters.emplace_back(new Segmenter(true));
+    segmenters.emplace_back(new Segmenter(true, 0, {"#\\w+", "(\\d)\\1"},
+        ProtectedPatterns::URLS | ProtectedPatterns::EMAILS));
+
+    TextGenerator generator(
+        {
+            "a", "Word", "it's", "3.14", "e\xCC\x81", "\xC3\xA9", "\xCC\x81",
+            "\xEF\xAC\x81", "\xE2\x84\xAB", "\xE0\xB8\x81\xE0\xB8\xB3",
+            "\xE0\xB8\xB3", "\xE4\xB8\xAD\xE6\x96\x87", "\xED\x95\x9C",
+            "\xE1\x84\x92", "\xE1\x85\xA1", "\xF0\x9F\x98\x80", "-", "@-@",
+            "a-b", ".", ",", "\"", "\xE2\x80\x94", "\xC2\xA0", "\xE3\x80\x80",
+            "\t", "\n", "\x1F", "\x1F" "a b\x1F", "\x1F" "c - \xC3\xA9\x1F",
+            "#tag", "11", "http://a.io/b", "x@a.io", "\xFF", "\xC3",
+        },
+        {" ", " ", " ", "  ", "", "-"});
+    std::mt19937 random(1);
+
+    for (std::unique_ptr<Segmenter>& segmenter: segmenters) {
+        for (const StreamMode& mode: MODES) {
+            // Streams are reused for each document
+            SegmenterStream segmenter_stream(
+                *segmenter, mode.normalize, mode.segment);
+            for (int i=0; i<400; ++i) {
+                std::string document = generator.next(60);
+                std::string expected;
+                segmenter->process(mode.mode, document, expected);
+                for (const std::vector<size_t>& ends:
+                    chunkings(document, random)
+                ) {
+                    CHECK_EQ_FOR(document,
+                        stream(segmenter_stream, document, ends), expected);
+                };
+            };
+        };
+    };
+
+    return test_result();
+}
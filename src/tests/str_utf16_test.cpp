@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unicode/unistr.h>
+
+#include "fasttokenizer/segmenter.h"
+#include "str_utf16.h"
+#include "test_util.h"
+
+#ifdef TOKENIZER_NAMESPACE
+using namespace TOKENIZER_NAMESPACE;
+#endif
+
+/**
+ * Python str are processed as UTF-16 widened from their PEP 393 storage,
+ * which has to give the outputs of processing them as UTF-8.
+ */
+static const Segmenter::Mode MODES[] = {
+    Segmenter::NORMALIZE,
+    Segmenter::SEGMENT,
+    Segmenter::NORMALIZE_AND_SEGMENT,
+    Segmenter::DESEGMENT,
+};
+
+static std::vector<uint32_t> code_points(const std::string& text) {
+    icu::UnicodeString utf16 = icu::UnicodeString::fromUTF8(text);
+    std::vector<uint32_t> chars;
+    for (int32_t i=0; i<utf16.length(); i=utf16.moveIndex32(i, 1)) {
+        chars.push_back(utf16.char32At(i));
+    };
+    return chars;
+}
+
+// Store text like a str of the narrowest kind that holds it, and wider
+static void check_kinds(Segmenter& segmenter, const std::string& text) {
+    std::vector<uint32_t> ucs4 = code_points(text);
+    uint32_t max_char = 0;
+    for (uint32_t c: ucs4) max_char = std::max(max_char, c);
+    std::vector<uint8_t> ucs1(ucs4.begin(), ucs4.end());
+    std::vector<char16_t> ucs2(ucs4.begin(), ucs4.end());
+
+    std::vector<std::pair<int, const void*>> kinds = {{4, ucs4.data()}};
+    if (max_char < 0x10000) kinds.push_back({2, ucs2.data()});
+    if (max_char < 0x100) kinds.push_back({1, ucs1.data()});
+
+    for (Segmenter::Mode mode: MODES) {
+        std::string expected;
+        segmenter.process(mode, text, expected);
+        for (const std::pair<int, const void*>& kind: kinds) {
+            icu::UnicodeString utf16;
+            str_to_utf16(kind.second, ucs4.size(), kind.first, utf16);
+            std::string out;
+            utf16.toUTF8String(out);
+            CHECK_EQ_FOR(text, out, text);
+
+            out.clear();
+            segmenter.process_utf16(mode, utf16).toUTF8String(out);
+            CHECK_EQ_FOR(text, out, expected);
+        };
+    };
+}
+
+static bool throws_length_error(size_t length, int kind) {
+    icu::UnicodeString utf16;
+    try {
+        // Nothing is read before the length is checked
+        str_to_utf16(nullptr, length, kind, utf16);
+    } catch (const std::length_error&) {
+        return true;
+    };
+    return false;
+}
+
+int main() {
+    Segmenter segmenter;
+
+    std::vector<std::string> cases = {
+        "",
+        "caf\xC3\xA9 na\xC3\xAFve , \xC2\xBFqu\xC3\xA9 ? \xC2\xA0 \xC3\x9F",
+        "\xC2\xAB quoted \xC2\xBB 1\xC2\xBD @-@ \xC3\xBF",
+        "\xE4\xBB\x96\xE7\x9A\x84 \xE3\x80\x8A "
+        "\xE5\xA4\xA9\xE7\xA9\xBA \xE3\x80\x8B",
+        "e\xCC\x81 \xCC\x81 a\xCC\x81\xCC\xA7 , \xE0\xB8\x81\xE0\xB8\xB3",
+        "\xF0\x9F\x98\x80 \" \xF0\x9D\x9F\x8E \" \xF0\x9F\x98\x80x",
+        "\x1FH.E.L.L.O\x1F \xEF\xBC\x88 \xEF\xBC\x89 \xE2\x80\x83" "em",
+    };
+    for (const std::string& text: cases) check_kinds(segmenter, text);
+
+    TextGenerator generator(
+        {
+            "word", "2.5", "'", "\"", "(", ")", ",", ".", "@-@", "-",
+            "\xC3\xA9t\xC3\xA9", "\xC2\xBF", "\xC2\xAB", "\xC3\x9F",
+            "\xE4\xBB\x96\xE7\x9A\x84", "\xE3\x80\x82", "\xEF\xBC\x8C",
+            "e\xCC\x81", "\xD9\xA1\xD9\xA2", "\xF0\x9F\x98\x80",
+            "\xF0\x9D\x9F\x8E", "\xE2\x80\x9C", "\x1Fspan\x1F",
+        },
+        {" ", " ", "  ", "", "\t", "\xC2\xA0", "\xE3\x80\x80"});
+    for (int i=0; i<5000; ++i) check_kinds(segmenter, generator.next(12));
+
+    // Lone surrogates of UCS2 and UCS4 str are kept for surrogatepass
+    const char16_t ucs2[] = {'a', ' ', 0xD800, ' ', 'b', 0xDC00};
+    const uint32_t ucs4[] = {'a', ' ', 0xD800, ' ', 'b', 0xDC00};
+    icu::UnicodeString expected(ucs2, 6);
+    icu::UnicodeString utf16;
+    str_to_utf16(ucs2, 6, 2, utf16);
+    CHECK(utf16 == expected);
+    CHECK(utf16.getBuffer() == ucs2);
+    str_to_utf16(ucs4, 6, 4, utf16);
+    CHECK(utf16 == expected);
+    for (Segmenter::Mode mode: MODES) {
+        const icu::UnicodeString& out = segmenter.process_utf16(mode, utf16);
+        CHECK(out.indexOf((char16_t) 0xD800) >= 0);
+        CHECK(out.indexOf((char16_t) 0xDC00) >= 0);
+    };
+
+    CHECK(throws_length_error((size_t) INT32_MAX + 1, 1));
+    CHECK(throws_length_error((size_t) INT32_MAX + 1, 2));
+    CHECK(throws_length_error((size_t) INT32_MAX / 2 + 1, 4));
+
+    return test_result();
+}
@@ -0,0 +1,115 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Checks report failures and carry on, main returns test_result()
+static int test_failures = 0;
+
+inline std::string printable(const std::string& s) {
+    std::string out = "\"";
+    for (unsigned char c: s) {
+        if (c >= 0x20 && c < 0x7F && c != '\\' && c != '"') {
+            out.push_back(c);
+        } else {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\x%02X", c);
+            out.append(escaped);
+        };
+    };
+    return out + "\"";
+}
+
+template <typename T>
+inline std::string printable(const T& value) {
+    return std::to_string(value);
+}
+
+template <typename T>
+inline std::string printable(const std::vector<T>& values) {
+    std::string out = "{";
+    for (size_t i=0; i<values.size(); ++i) {
+        if (i > 0) out.append(", ");
+        out.append(printable(values[i]));
+    };
+    return out + "}";
+}
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            ++test_failures; \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " \
+                << #condition << std::endl; \
+        }; \
+    } while (0)
+
+#define CHECK_EQ(actual, expected) do { \
+        auto&& actual_value = (actual); \
+        auto&& expected_value = (expected); \
+        if (!(actual_value == expected_value)) { \
+            ++test_failures; \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " \
+                << #actual << " == " << #expected << "\n  actual:   " \
+                << printable(actual_value) << "\n  expected: " \
+                << printable(expected_value) << std::endl; \
+        }; \
+    } while (0)
+
+// Like CHECK_EQ with the input that gave the values
+#define CHECK_EQ_FOR(input, actual, expected) do { \
+        int failures = test_failures; \
+        CHECK_EQ(actual, expected); \
+        if (test_failures > failures) { \
+            std::cerr << "  input:    " << printable(input) << std::endl; \
+        }; \
+    } while (0)
+
+inline int test_result() {
+    if (test_failures > 0) {
+        std::cerr << test_failures << " checks failed" << std::endl;
+        return 1;
+    };
+    return 0;
+}
+
+/**
+ * Random text made of fragments joined by separators, the same for each run.
+ */
+class TextGenerator {
+    private:
+        std::mt19937 random;
+        std::vector<std::string> fragments;
+        std::vector<std::string> separators;
+
+        const std::string& pick(const std::vector<std::string>& from) {
+            return from[random() % from.size()];
+        };
+
+    public:
+        TextGenerator(
+            const std::vector<std::string>& fragments,
+            const std::vector<std::string>& separators,
+            uint32_t seed=1
+        )
+            : random(seed)
+            , fragments(fragments)
+            , separators(separators)
+        {};
+
+        std::string next(size_t max_fragments) {
+            std::string text;
+            size_t num_fragments = random() % (max_fragments + 1);
+            for (size_t i=0; i<num_fragments; ++i) {
+                if (i > 0 || random() % 4 == 0) text.append(pick(separators));
+                text.append(pick(fragments));
+            };
+            if (random() % 4 == 0) text.append(pick(separators));
+            return text;
+        };
+};
+
+#endif
@@ -0,0 +1,182 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unicode/utf8.h>
+
+#include "fasttokenizer/text_scan.h"
+#include "test_util.h"
+
+#ifdef TOKENIZER_NAMESPACE
+using namespace TOKENIZER_NAMESPACE;
+#endif
+
+/**
+ * The text scans in use have to agree with plain byte loops and ICU on
+ * every input. ctest runs this once for each value of FASTTOKENIZER_SIMD,
+ * so each instruction set the CPU has is checked against the same results
+ * as the scalar versions.
+ */
+static bool reference_is_ascii(const std::string& text) {
+    for (unsigned char c: text) {
+        if (c >= 0x80) return false;
+    };
+    return true;
+}
+
+static size_t reference_valid_prefix(const std::string& text) {
+    const uint8_t* s = (const uint8_t*) text.data();
+    int32_t length = (int32_t) text.size();
+    int32_t i = 0;
+    while (i < length) {
+        int32_t begin = i;
+        UChar32 c;
+        U8_NEXT(s, i, length, c);
+        if (c < 0) return begin;
+    };
+    return length;
+}
+
+static size_t reference_space_candidate(const std::string& text) {
+    for (size_t i=0; i<text.size(); ++i) {
+        unsigned char c = text[i];
+        if (c < 0x21 || c >= 0x80) return i;
+    };
+    return text.size();
+}
+
+static size_t reference_link_candidate(const std::string& text) {
+    for (size_t i=0; i<text.size(); ++i) {
+        std::string rest = text.substr(i, 4);
+        for (char& c: rest) {
+            if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        };
+        if (rest[0] == '@' || rest.compare(0, 3, "://") == 0
+            || rest == "www."
+        ) {
+            return i;
+        };
+    };
+    return text.size();
+}
+
+static void check_scans(const std::string& text) {
+    const char* data = text.data();
+    const char* end = data + text.size();
+    CHECK_EQ_FOR(text, is_ascii(data, text.size()), reference_is_ascii(text));
+    CHECK_EQ_FOR(text,
+        utf8_valid_prefix(data, text.size()), reference_valid_prefix(text));
+    CHECK_EQ_FOR(text,
+        (size_t) (find_space_candidate(data, end) - data),
+        reference_space_candidate(text));
+    CHECK_EQ_FOR(text,
+        (size_t) (find_link_candidate(data, end) - data),
+        reference_link_candidate(text));
+}
+
+// Instruction set FASTTOKENIZER_SIMD should have picked on this CPU
+static std::string expected_isa() {
+    const char* limit = std::getenv("FASTTOKENIZER_SIMD");
+    std::string isa = "scalar";
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (limit != nullptr && std::strcmp(limit, "scalar") == 0) return isa;
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse4.2")) return isa;
+    isa = "sse4.2";
+    if (limit != nullptr && std::strcmp(limit, "sse4.2") == 0) return isa;
+    if (__builtin_cpu_supports("avx2")) isa = "avx2";
+#endif
+    return isa;
+}
+
+// Well-formed text of exactly length bytes, mostly not ASCII
+static std::string mixed_text(size_t length) {
+    std::string text;
+    while (text.size() + 3 <= length) text.append("\xE4\xB8\xAD");
+    if (text.size() + 2 <= length) text.append("\xC3\xA9");
+    if (text.size() < length) text.push_back('x');
+    return text;
+}
+
+int main() {
+    CHECK_EQ(std::string(text_scan_isa()), expected_isa());
+    std::cerr << "isa: " << text_scan_isa() << std::endl;
+
+    const std::vector<std::string> good = {
+        "\xC2\x80", "\xDF\xBF", "\xE0\xA0\x80", "\xE4\xB8\xAD",
+        "\xED\x9F\xBF", "\xEE\x80\x80", "\xEF\xBF\xBF", "\xF0\x90\x80\x80",
+        "\xF0\x9F\x98\x80", "\xF4\x8F\xBF\xBF",
+    };
+    const std::vector<std::string> bad = {
+        // Stray continuations and bytes that never occur
+        "\x80", "\xBF", "\xC0\xAF", "\xC1\xBF", "\xF5\x80\x80\x80",
+        "\xF8\x88\x80\x80\x80", "\xFF",
+        // Overlong forms
+        "\xE0\x80\xAF", "\xE0\x9F\xBF", "\xF0\x80\x80\xAF", "\xF0\x8F\xBF\xBF",
+        // Surrogates
+        "\xED\xA0\x80", "\xED\xBF\xBF", "\xED\xA0\x80\xED\xB0\x80",
+        // Above U+10FFFF
+        "\xF4\x90\x80\x80", "\xF7\xBF\xBF\xBF",
+        // Leads followed by too few continuations
+        "\xC2x", "\xE4\xB8x", "\xF0\x9F\x98x", "\xE4\xC3\xA9",
+    };
+
+    // Sequences at every offset around the 16 and 32 byte blocks, after
+    // ASCII and after other sequences, followed by nothing, ASCII or more
+    // sequences, and well-formed ones cut off at every byte
+    std::vector<std::string> sequences(good);
+    sequences.insert(sequences.end(), bad.begin(), bad.end());
+    const std::vector<std::string> tails = {
+        "", "x", std::string(40, 'x'), mixed_text(40),
+    };
+    for (size_t offset=0; offset<=72; ++offset) {
+        const std::vector<std::string> heads = {
+            std::string(offset, 'x'), mixed_text(offset),
+        };
+        for (const std::string& head: heads) {
+            for (const std::string& sequence: sequences) {
+                for (const std::string& tail: tails) {
+                    check_scans(head + sequence + tail);
+                };
+            };
+            for (const std::string& sequence: good) {
+                for (size_t cut=1; cut<sequence.size(); ++cut) {
+                    check_scans(head + sequence.substr(0, cut));
+                    check_scans(head + sequence.substr(0, cut) + "x");
+                };
+            };
+        };
+    };
+
+    // Candidates and near misses at every offset, including cut off ones
+    const std::vector<std::string> marks = {
+        " ", "\t", "\n", std::string(1, '\0'), "\x1F", "\x7F", "!", "\xC3\xA9",
+        "@", "://", "www.", "WwW.", ":/", ":/x/", "ww.", "wwx.", "www",
+        "wwww.", "::/", "wWw.x",
+    };
+    for (size_t length=0; length<=72; ++length) {
+        for (size_t offset=0; offset<=length; ++offset) {
+            for (const std::string& mark: marks) {
+                std::string text(length, 'x');
+                text.replace(offset, mark.size(), mark);
+                text.resize(length);
+                check_scans(text);
+            };
+        };
+    };
+
+    TextGenerator generator(
+        {
+            "x", "w", "W", ".", ":", "/", "@", "www.", "://", " ", "\t",
+            "\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80", "\xC2", "\xE4\xB8",
+            "\xF0\x9F\x98", "\x80", "\xED\xA0\x80", "\xC0\xAF",
+            "\xF4\x90\x80\x80", "\xFF", std::string(16, 'x'),
+            mixed_text(15),
+        },
+        {"", "", "", " ", "x"});
+    for (int i=0; i<50000; ++i) check_scans(generator.next(24));
+
+    return test_result();
+}
@@ -0,0 +1,583 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "fasttokenizer/text_scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TEXT_SCAN_X86
+#include <immintrin.h>
+#endif
+
+#ifdef TOKENIZER_NAMESPACE
+namespace TOKENIZER_NAMESPACE {
+#endif
+
+static const uint64_t HIGH_BITS = 0x8080808080808080ULL;
+
+/**
+ * Scalar versions, also used on the tails of the vectorized ones.
+ */
+static bool is_ascii_scalar(const char* data, size_t size) {
+    size_t i = 0;
+    uint64_t acc = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        acc |= word;
+    };
+    for (; i < size; ++i) acc |= (uint8_t)data[i];
+    return (acc & HIGH_BITS) == 0;
+};
+
+/**
+ * Length of the well-formed sequence at s[i], 0 if there is none.
+ * Follows table 3-7 of the Unicode standard.
+ */
+static inline size_t utf8_sequence_length(
+    const uint8_t* s,
+    size_t i,
+    size_t size
+) {
+    uint8_t c = s[i];
+    if (c < 0x80) return 1;
+
+    size_t length;
+    uint8_t low = 0x80;
+    uint8_t high = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+        length = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        length = 3;
+        if (c == 0xE0) low = 0xA0;
+        if (c == 0xED) high = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        length = 4;
+        if (c == 0xF0) low = 0x90;
+        if (c == 0xF4) high = 0x8F;
+    } else {
+        return 0;
+    };
+
+    if (size - i < length) return 0;
+    if (s[i + 1] < low || s[i + 1] > high) return 0;
+    for (size_t k=2; k<length; ++k) {
+        if ((s[i + k] & 0xC0) != 0x80) return 0;
+    };
+    return length;
+};
+
+static size_t utf8_valid_prefix_scalar(const char* data, size_t size) {
+    const uint8_t* s = (const uint8_t*) data;
+    size_t i = 0;
+    while (i < size) {
+        // Skip over ASCII 8 bytes at a time
+        uint64_t word;
+        while (i + 8 <= size) {
+            std::memcpy(&word, s + i, 8);
+            if (word & HIGH_BITS) break;
+            i += 8;
+        };
+        if (i == size) break;
+
+        size_t length = utf8_sequence_length(s, i, size);
+        if (length == 0) return i;
+        i += length;
+    };
+    return size;
+};
+
+static const char* find_space_candidate_scalar(
+    const char* begin,
+    const char* end
+) {
+    for (const char* p = begin; p < end; ++p) {
+        if ((uint8_t)*p < 0x21 || (uint8_t)*p >= 0x80) return p;
+    };
+    return end;
+};
+
+static const char* find_link_candidate_scalar(
+    const char* begin,
+    const char* end
+) {
+    for (const char* p = begin; p < end; ++p) {
+        if (*p == '@') return p;
+        if (end - p < 3) continue;
+        if (p[0] == ':' && p[1] == '/' && p[2] == '/') return p;
+        if (end - p < 4) continue;
+        if ((p[0] | 0x20) == 'w' && (p[1] | 0x20) == 'w'
+            && (p[2] | 0x20) == 'w' && p[3] == '.') {
+            return p;
+        };
+    };
+    return end;
+};
+
+/**
+ * Continue validation at a block where a vectorized check found an error.
+ * Blocks before it are well-formed except for a sequence that may be cut
+ * off by the block start, so the scalar check starts from its lead byte.
+ */
+static size_t utf8_valid_prefix_from(
+    const char* data,
+    size_t size,
+    size_t block
+) {
+    size_t i = block < 3 ? 0 : block - 3;
+    while (i < block && ((uint8_t)data[i] & 0xC0) == 0x80) ++i;
+    return i + utf8_valid_prefix_scalar(data + i, size - i);
+};
+
+#ifdef TEXT_SCAN_X86
+
+/**
+ * UTF-8 validation by lookup tables, after Keiser and Lemire, "Validating
+ * UTF-8 In Less Than One Instruction Per Byte" (2021).
+ *
+ * Each byte is checked together with the byte before it by looking up the
+ * high nibble of the previous byte, its low nibble and the high nibble of
+ * the byte, error bits set in all three lookups mark an ill-formed pair.
+ * Continuations of 3 and 4 byte sequences are checked against the bytes 2
+ * and 3 before them.
+ */
+static const uint8_t TOO_SHORT = 1 << 0;  // Lead or ASCII after a lead
+static const uint8_t TOO_LONG = 1 << 1;  // Continuation after ASCII
+static const uint8_t OVERLONG_3 = 1 << 2;
+static const uint8_t TOO_LARGE = 1 << 3;
+static const uint8_t SURROGATE = 1 << 4;
+static const uint8_t OVERLONG_2 = 1 << 5;
+static const uint8_t TOO_LARGE_1000 = 1 << 6;
+static const uint8_t OVERLONG_4 = 1 << 6;
+static const uint8_t TWO_CONTS = 1 << 7;  // Continuation after continuation
+static const uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+// Indexed by the high nibble of the previous byte
+alignas(16) static const uint8_t BYTE_1_HIGH[16] = {
+    // 0___ ASCII
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    // 10__ continuation
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    // 1100 and 1101 two byte lead
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    // 1110 three byte lead
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    // 1111 four byte lead
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+// Indexed by the low nibble of the previous byte
+alignas(16) static const uint8_t BYTE_1_LOW[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+// Indexed by the high nibble of the byte
+alignas(16) static const uint8_t BYTE_2_HIGH[16] = {
+    // 0___ ASCII
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    // 1000
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000
+        | OVERLONG_4,
+    // 1001
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    // 101_
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    // 11__ lead
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+/**
+ * SSE4.2 versions, 16 bytes at a time.
+ */
+__attribute__((target("sse4.2")))
+static bool is_ascii_sse42(const char* data, size_t size) {
+    size_t i = 0;
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+        acc = _mm_or_si128(
+            acc, _mm_loadu_si128((const __m128i*) (data + i)));
+    };
+    if (_mm_movemask_epi8(acc) != 0) return false;
+    return is_ascii_scalar(data + i, size - i);
+};
+
+__attribute__((target("sse4.2")))
+static inline __m128i utf8_errors_sse42(__m128i input, __m128i prev_input) {
+    const __m128i low_nibble = _mm_set1_epi8(0x0F);
+    __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+    __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+
+    __m128i byte_1_high = _mm_shuffle_epi8(
+        _mm_load_si128((const __m128i*) BYTE_1_HIGH),
+        _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble));
+    __m128i byte_1_low = _mm_shuffle_epi8(
+        _mm_load_si128((const __m128i*) BYTE_1_LOW),
+        _mm_and_si128(prev1, low_nibble));
+    __m128i byte_2_high = _mm_shuffle_epi8(
+        _mm_load_si128((const __m128i*) BYTE_2_HIGH),
+        _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble));
+    __m128i special_cases = _mm_and_si128(
+        _mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+    // Only bytes after 111_____ and 1111____ leads have the high bit set
+    __m128i is_third_byte = _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80));
+    __m128i is_fourth_byte = _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80));
+    __m128i must_be_continuation = _mm_and_si128(
+        _mm_or_si128(is_third_byte, is_fourth_byte),
+        _mm_set1_epi8((char) 0x80));
+    return _mm_xor_si128(must_be_continuation, special_cases);
+};
+
+__attribute__((target("sse4.2")))
+static size_t utf8_valid_prefix_sse42(const char* data, size_t size) {
+    __m128i prev_input = _mm_setzero_si128();
+    bool prev_ascii = true;
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i input = _mm_loadu_si128((const __m128i*) (data + i));
+        bool ascii = _mm_movemask_epi8(input) == 0;
+        if (!(ascii && prev_ascii)) {
+            __m128i errors = utf8_errors_sse42(input, prev_input);
+            if (!_mm_testz_si128(errors, errors)) {
+                return utf8_valid_prefix_from(data, size, i);
+            };
+        };
+        prev_input = input;
+        prev_ascii = ascii;
+    };
+
+    // Padding the tail with at least one NUL also catches a sequence that
+    // is cut off by the end of data
+    alignas(16) char tail[16] = {0};
+    std::memcpy(tail, data + i, size - i);
+    __m128i errors = utf8_errors_sse42(
+        _mm_load_si128((const __m128i*) tail), prev_input);
+    if (!_mm_testz_si128(errors, errors)) {
+        return utf8_valid_prefix_from(data, size, i);
+    };
+    return size;
+};
+
+__attribute__((target("sse4.2")))
+static const char* find_space_candidate_sse42(
+    const char* begin,
+    const char* end
+) {
+    // Signed bytes below 0x21 are the candidates, including non-ASCII ones
+    const __m128i limit = _mm_set1_epi8(0x21);
+    const char* p = begin;
+    for (; p + 16 <= end; p += 16) {
+        __m128i input = _mm_loadu_si128((const __m128i*) p);
+        int mask = _mm_movemask_epi8(_mm_cmplt_epi8(input, limit));
+        if (mask != 0) return p + __builtin_ctz(mask);
+    };
+    return find_space_candidate_scalar(p, end);
+};
+
+__attribute__((target("sse4.2")))
+static inline int link_candidates_sse42(const char* p) {
+    // Each byte is compared with the ones after it through shifted loads
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i w = _mm_set1_epi8('w');
+    const __m128i slash = _mm_set1_epi8('/');
+    __m128i b0 = _mm_loadu_si128((const __m128i*) p);
+    __m128i b1 = _mm_loadu_si128((const __m128i*) (p + 1));
+    __m128i b2 = _mm_loadu_si128((const __m128i*) (p + 2));
+    __m128i b3 = _mm_loadu_si128((const __m128i*) (p + 3));
+    __m128i scheme = _mm_and_si128(
+        _mm_cmpeq_epi8(b0, _mm_set1_epi8(':')),
+        _mm_and_si128(
+            _mm_cmpeq_epi8(b1, slash),
+            _mm_cmpeq_epi8(b2, slash)));
+    __m128i www = _mm_and_si128(
+        _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_or_si128(b0, lower), w),
+            _mm_cmpeq_epi8(_mm_or_si128(b1, lower), w)),
+        _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_or_si128(b2, lower), w),
+            _mm_cmpeq_epi8(b3, _mm_set1_epi8('.'))));
+    __m128i found = _mm_or_si128(
+        _mm_cmpeq_epi8(b0, _mm_set1_epi8('@')),
+        _mm_or_si128(scheme, www));
+    return _mm_movemask_epi8(found);
+};
+
+__attribute__((target("sse4.2")))
+static const char* find_link_candidate_sse42(
+    const char* begin,
+    const char* end
+) {
+    const char* p = begin;
+    for (; p + 19 <= end; p += 16) {
+        int mask = link_candidates_sse42(p);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    };
+
+    // Zeros after the last bytes match nothing
+    for (; p < end; p += 16) {
+        char tail[19] = {0};
+        std::memcpy(tail, p, std::min<size_t>(end - p, sizeof(tail)));
+        int mask = link_candidates_sse42(tail);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    };
+    return end;
+};
+
+/**
+ * AVX2 versions, 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static bool is_ascii_avx2(const char* data, size_t size) {
+    size_t i = 0;
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 32 <= size; i += 32) {
+        acc = _mm256_or_si256(
+            acc, _mm256_loadu_si256((const __m256i*) (data + i)));
+    };
+    if (_mm256_movemask_epi8(acc) != 0) return false;
+    return is_ascii_scalar(data + i, size - i);
+};
+
+__attribute__((target("avx2")))
+static inline __m256i lookup_avx2(const uint8_t* table, __m256i index) {
+    return _mm256_shuffle_epi8(
+        _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*) table)),
+        index);
+};
+
+__attribute__((target("avx2")))
+static inline __m256i utf8_errors_avx2(__m256i input, __m256i prev_input) {
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+
+    // Shifting across the 128 bit lanes goes through the upper lane of
+    // prev_input next to the lower lane of input
+    __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+    __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+    __m256i byte_1_high = lookup_avx2(
+        BYTE_1_HIGH, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+    __m256i byte_1_low = lookup_avx2(
+        BYTE_1_LOW, _mm256_and_si256(prev1, low_nibble));
+    __m256i byte_2_high = lookup_avx2(
+        BYTE_2_HIGH, _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+    __m256i special_cases = _mm256_and_si256(
+        _mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    __m256i is_third_byte = _mm256_subs_epu8(
+        prev2, _mm256_set1_epi8(0xE0 - 0x80));
+    __m256i is_fourth_byte = _mm256_subs_epu8(
+        prev3, _mm256_set1_epi8(0xF0 - 0x80));
+    __m256i must_be_continuation = _mm256_and_si256(
+        _mm256_or_si256(is_third_byte, is_fourth_byte),
+        _mm256_set1_epi8((char) 0x80));
+    return _mm256_xor_si256(must_be_continuation, special_cases);
+};
+
+__attribute__((target("avx2")))
+static size_t utf8_valid_prefix_avx2(const char* data, size_t size) {
+    __m256i prev_input = _mm256_setzero_si256();
+    bool prev_ascii = true;
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i input = _mm256_loadu_si256((const __m256i*) (data + i));
+        bool ascii = _mm256_movemask_epi8(input) == 0;
+        if (!(ascii && prev_ascii)) {
+            __m256i errors = utf8_errors_avx2(input, prev_input);
+            if (!_mm256_testz_si256(errors, errors)) {
+                return utf8_valid_prefix_from(data, size, i);
+            };
+        };
+        prev_input = input;
+        prev_ascii = ascii;
+    };
+
+    alignas(32) char tail[32] = {0};
+    std::memcpy(tail, data + i, size - i);
+    __m256i errors = utf8_errors_avx2(
+        _mm256_load_si256((const __m256i*) tail), prev_input);
+    if (!_mm256_testz_si256(errors, errors)) {
+        return utf8_valid_prefix_from(data, size, i);
+    };
+    return size;
+};
+
+__attribute__((target("avx2")))
+static const char* find_space_candidate_avx2(
+    const char* begin,
+    const char* end
+) {
+    const __m256i limit = _mm256_set1_epi8(0x21);
+    const char* p = begin;
+    for (; p + 32 <= end; p += 32) {
+        __m256i input = _mm256_loadu_si256((const __m256i*) p);
+        unsigned mask = _mm256_movemask_epi8(
+            _mm256_cmpgt_epi8(limit, input));
+        if (mask != 0) return p + __builtin_ctz(mask);
+    };
+    return find_space_candidate_sse42(p, end);
+};
+
+__attribute__((target("avx2")))
+static inline unsigned link_candidates_avx2(const char* p) {
+    const __m256i lower = _mm256_set1_epi8(0x20);
+    const __m256i w = _mm256_set1_epi8('w');
+    const __m256i slash = _mm256_set1_epi8('/');
+    __m256i b0 = _mm256_loadu_si256((const __m256i*) p);
+    __m256i b1 = _mm256_loadu_si256((const __m256i*) (p + 1));
+    __m256i b2 = _mm256_loadu_si256((const __m256i*) (p + 2));
+    __m256i b3 = _mm256_loadu_si256((const __m256i*) (p + 3));
+    __m256i scheme = _mm256_and_si256(
+        _mm256_cmpeq_epi8(b0, _mm256_set1_epi8(':')),
+        _mm256_and_si256(
+            _mm256_cmpeq_epi8(b1, slash),
+            _mm256_cmpeq_epi8(b2, slash)));
+    __m256i www = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_or_si256(b0, lower), w),
+            _mm256_cmpeq_epi8(_mm256_or_si256(b1, lower), w)),
+        _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_or_si256(b2, lower), w),
+            _mm256_cmpeq_epi8(b3, _mm256_set1_epi8('.'))));
+    __m256i found = _mm256_or_si256(
+        _mm256_cmpeq_epi8(b0, _mm256_set1_epi8('@')),
+        _mm256_or_si256(scheme, www));
+    return _mm256_movemask_epi8(found);
+};
+
+__attribute__((target("avx2")))
+static const char* find_link_candidate_avx2(
+    const char* begin,
+    const char* end
+) {
+    const char* p = begin;
+    for (; p + 35 <= end; p += 32) {
+        unsigned mask = link_candidates_avx2(p);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    };
+
+    // Handing the tail to the SSE version was slower on short lines
+    for (; p < end; p += 32) {
+        char tail[35] = {0};
+        std::memcpy(tail, p, std::min<size_t>(end - p, sizeof(tail)));
+        unsigned mask = link_candidates_avx2(tail);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    };
+    return end;
+};
+
+#endif
+
+/**
+ * Versions of the functions in use, picked once on first use.
+ */
+struct TextScanKernels {
+    const char* isa;
+    bool (*is_ascii)(const char*, size_t);
+    size_t (*utf8_valid_prefix)(const char*, size_t);
+    const char* (*find_space_candidate)(const char*, const char*);
+    const char* (*find_link_candidate)(const char*, const char*);
+
+    TextScanKernels();
+};
+
+TextScanKernels::TextScanKernels()
+    : isa("scalar")
+    , is_ascii(is_ascii_scalar)
+    , utf8_valid_prefix(utf8_valid_prefix_scalar)
+    , find_space_candidate(find_space_candidate_scalar)
+    , find_link_candidate(find_link_candidate_scalar)
+{
+#ifdef TEXT_SCAN_X86
+    const char* limit = std::getenv("FASTTOKENIZER_SIMD");
+    if (limit != nullptr && std::strcmp(limit, "scalar") == 0) return;
+
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse4.2")) return;
+    isa = "sse4.2";
+    is_ascii = is_ascii_sse42;
+    utf8_valid_prefix = utf8_valid_prefix_sse42;
+    find_space_candidate = find_space_candidate_sse42;
+    find_link_candidate = find_link_candidate_sse42;
+
+    if (limit != nullptr && std::strcmp(limit, "sse4.2") == 0) return;
+    if (!__builtin_cpu_supports("avx2")) return;
+    isa = "avx2";
+    is_ascii = is_ascii_avx2;
+    utf8_valid_prefix = utf8_valid_prefix_avx2;
+    find_space_candidate = find_space_candidate_avx2;
+    find_link_candidate = find_link_candidate_avx2;
+#endif
+};
+
+static const TextScanKernels& kernels() {
+    static const TextScanKernels kernels;
+    return kernels;
+};
+
+const char* text_scan_isa() {
+    return kernels().isa;
+};
+
+bool is_ascii(const char* data, size_t size) {
+    return kernels().is_ascii(data, size);
+};
+
+size_t utf8_valid_prefix(const char* data, size_t size) {
+    return kernels().utf8_valid_prefix(data, size);
+};
+
+const char* find_space_candidate(const char* begin, const char* end) {
+    return kernels().find_space_candidate(begin, end);
+};
+
+const char* find_link_candidate(const char* begin, const char* end) {
+    return kernels().find_link_candidate(begin, end);
+};
+
+/**
+ * Newlines are found with memchr, which C libraries already vectorize and
+ * which kept up with a movemask loop over 32 bytes even on short lines.
+ */
+size_t find_newlines(
+    const char* data,
+    size_t begin,
+    size_t end,
+    std::vector<size_t>& ends,
+    size_t max_ends
+) {
+    while (ends.size() < max_ends) {
+        const char* newline = (const char*) std::memchr(
+            data + begin, '\n', end - begin);
+        if (newline == nullptr) return end;
+        ends.push_back(newline - data);
+        begin = newline + 1 - data;
+    };
+    return begin;
+};
+
+#ifdef TOKENIZER_NAMESPACE
+};
+#endif
@@ -0,0 +1,307 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+enum Compression { UNCOMPRESSED, GZIP, ZSTD };
+
+static const size_t COMPRESSION_BUFFER_SIZE = 1 << 18;
+
+/**
+ * Compression implied by the extension of path.
+ */
+inline Compression compression_of_path(const std::string& path) {
+    auto ends_with = [&](const char* suffix) {
+        size_t length = std::strlen(suffix);
+        return path.size() >= length
+            && path.compare(path.size() - length, length, suffix) == 0;
+    };
+    if (ends_with(".gz")) return GZIP;
+    if (ends_with(".zst")) return ZSTD;
+    return UNCOMPRESSED;
+}
+
+/**
+ * Compression implied by the magic number at the start of data.
+ */
+inline Compression compression_of_data(const std::string& data) {
+    const char gzip_magic[] = {'\x1F', '\x8B'};
+    const char zstd_magic[] = {'\x28', '\xB5', '\x2F', '\xFD'};
+    if (data.compare(0, 2, gzip_magic, 2) == 0) return GZIP;
+    if (data.compare(0, 4, zstd_magic, 4) == 0) return ZSTD;
+    return UNCOMPRESSED;
+}
+
+inline void check_zstd_support() {
+#ifndef HAVE_ZSTD
+    throw std::runtime_error("Built without zstd support.");
+#endif
+}
+
+/**
+ * A source of bytes.
+ */
+class InputStream {
+    public:
+        virtual ~InputStream() {};
+
+        // Read up to size bytes into buf, returns 0 at the end of input
+        virtual size_t read(char* buf, size_t size) = 0;
+};
+
+/**
+ * Reads a file descriptor, the first bytes can be looked at beforehand.
+ */
+class FdInput : public InputStream {
+    private:
+        int fd;
+        std::string prefix;  // Bytes peeked but not read yet
+        size_t prefix_pos;
+
+        size_t read_fd(char* buf, size_t size) {
+            while (true) {
+                ssize_t n = ::read(fd, buf, size);
+                if (n >= 0) return n;
+                if (errno != EINTR) {
+                    throw std::runtime_error("Failed to read input.");
+                };
+            };
+        };
+
+    public:
+        FdInput(int fd) : fd(fd), prefix_pos(0) {};
+
+        // Up to size bytes at the start of input, less at the end of input
+        const std::string& peek(size_t size) {
+            char buf[16];
+            while (prefix.size() < size) {
+                size_t n = read_fd(
+                    buf, std::min(size - prefix.size(), sizeof(buf)));
+                if (n == 0) break;
+                prefix.append(buf, n);
+            };
+            return prefix;
+        };
+
+        size_t read(char* buf, size_t size) {
+            if (prefix_pos < prefix.size()) {
+                size_t n = std::min(size, prefix.size() - prefix_pos);
+                std::memcpy(buf, prefix.data() + prefix_pos, n);
+                prefix_pos += n;
+                return n;
+            };
+            return read_fd(buf, size);
+        };
+};
+
+/**
+ * Decompresses gzip data of another input, concatenated members included.
+ */
+class GzipInput : public InputStream {
+    private:
+        std::unique_ptr<InputStream> source;
+        std::unique_ptr<char[]> buffer;
+        z_stream stream;
+        bool in_member;
+        bool at_end;
+        bool pending;  // The last call filled the output, more may be held
+
+    public:
+        GzipInput(std::unique_ptr<InputStream> source)
+            : source(std::move(source))
+            , buffer(new char[COMPRESSION_BUFFER_SIZE])
+            , in_member(false)
+            , at_end(false)
+            , pending(false)
+        {
+            std::memset(&stream, 0, sizeof(stream));
+            // Window bits of 15 + 16 only accepts the gzip format
+            if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+                throw std::runtime_error("Failed to initialize gzip.");
+            };
+        };
+
+        ~GzipInput() { inflateEnd(&stream); };
+
+        size_t read(char* buf, size_t size) {
+            stream.next_out = (Bytef*) buf;
+            stream.avail_out = size;
+            while (stream.avail_out == size && !at_end) {
+                // Output held by zlib is drained before reading more input
+                if (stream.avail_in == 0 && !pending) {
+                    stream.avail_in = source->read(
+                        buffer.get(), COMPRESSION_BUFFER_SIZE);
+                    stream.next_in = (Bytef*) buffer.get();
+                    if (stream.avail_in == 0) {
+                        if (in_member) {
+                            throw std::runtime_error("Truncated gzip input.");
+                        };
+                        at_end = true;
+                        break;
+                    };
+                };
+
+                // Draining what is held does not start a member
+                if (stream.avail_in > 0) in_member = true;
+                int status = inflate(&stream, Z_NO_FLUSH);
+                pending = stream.avail_out == 0;
+                if (status == Z_STREAM_END) {
+                    // Another member may follow
+                    inflateReset(&stream);
+                    in_member = false;
+                } else if (status != Z_OK && status != Z_BUF_ERROR) {
+                    throw std::runtime_error("Failed to decompress input.");
+                };
+            };
+            return size - stream.avail_out;
+        };
+};
+
+#ifdef HAVE_ZSTD
+/**
+ * Decompresses zstd data of another input, concatenated frames included.
+ */
+class ZstdInput : public InputStream {
+    private:
+        std::unique_ptr<InputStream> source;
+        std::unique_ptr<char[]> buffer;
+        ZSTD_DStream* stream;
+        ZSTD_inBuffer in;
+        bool in_frame;
+        bool at_end;
+        bool pending;  // The last call filled the output, more may be held
+
+    public:
+        ZstdInput(std::unique_ptr<InputStream> source)
+            : source(std::move(source))
+            , buffer(new char[COMPRESSION_BUFFER_SIZE])
+            , stream(ZSTD_createDStream())
+            , in_frame(false)
+            , at_end(false)
+            , pending(false)
+        {
+            in.src = buffer.get();
+            in.size = 0;
+            in.pos = 0;
+            ZSTD_initDStream(stream);
+        };
+
+        ~ZstdInput() { ZSTD_freeDStream(stream); };
+
+        size_t read(char* buf, size_t size) {
+            ZSTD_outBuffer out = {buf, size, 0};
+            while (out.pos == 0 && !at_end) {
+                // Output held by zstd is drained before reading more input
+                if (in.pos == in.size && !pending) {
+                    in.size = source->read(
+                        buffer.get(), COMPRESSION_BUFFER_SIZE);
+                    in.pos = 0;
+                    if (in.size == 0) {
+                        if (in_frame) {
+                            throw std::runtime_error("Truncated zstd input.");
+                        };
+                        at_end = true;
+                        break;
+                    };
+                };
+
+                // Returns 0 once a frame is complete, a call that makes no
+                // progress only hints at the next frame
+                size_t in_pos = in.pos, out_pos = out.pos;
+                size_t status = ZSTD_decompressStream(stream, &out, &in);
+                if (ZSTD_isError(status)) {
+                    throw std::runtime_error("Failed to decompress input.");
+                };
+                if (in.pos != in_pos || out.pos != out_pos) {
+                    in_frame = status != 0;
+                };
+                pending = out.pos == out.size;
+            };
+            return out.pos;
+        };
+};
+#endif
+
+/**
+ * Wrap input in a decompressor chosen by its magic number.
+ */
+inline std::unique_ptr<InputStream> open_input(std::unique_ptr<FdInput> input) {
+    Compression compression = compression_of_data(input->peek(4));
+    if (compression == GZIP) {
+        return std::unique_ptr<InputStream>(new GzipInput(std::move(input)));
+    };
+    if (compression == ZSTD) {
+        check_zstd_support();
+#ifdef HAVE_ZSTD
+        return std::unique_ptr<InputStream>(new ZstdInput(std::move(input)));
+#endif
+    };
+    return std::unique_ptr<InputStream>(std::move(input));
+}
+
+/**
+ * Compress data as a complete gzip member or zstd frame appended to out.
+ * Members and frames can be concatenated, so blocks of a stream can be
+ * compressed independently.
+ */
+inline void compress_block(
+    Compression compression,
+    const char* data,
+    size_t size,
+    std::string& out
+) {
+    size_t offset = out.size();
+
+    if (compression == GZIP) {
+        z_stream stream;
+        std::memset(&stream, 0, sizeof(stream));
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+            15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK
+        ) {
+            throw std::runtime_error("Failed to initialize gzip.");
+        };
+
+        out.resize(offset + deflateBound(&stream, size));
+        stream.next_in = (Bytef*) data;
+        stream.avail_in = size;
+        stream.next_out = (Bytef*) &out[offset];
+        stream.avail_out = out.size() - offset;
+        int status = deflate(&stream, Z_FINISH);
+        out.resize(out.size() - stream.avail_out);
+        deflateEnd(&stream);
+        if (status != Z_STREAM_END) {
+            throw std::runtime_error("Failed to compress output.");
+        };
+        return;
+    };
+
+    if (compression == ZSTD) {
+        check_zstd_support();
+#ifdef HAVE_ZSTD
+        out.resize(offset + ZSTD_compressBound(size));
+        size_t length = ZSTD_compress(
+            &out[offset], out.size() - offset, data, size,
+            ZSTD_CLEVEL_DEFAULT);
+        if (ZSTD_isError(length)) {
+            throw std::runtime_error("Failed to compress output.");
+        };
+        out.resize(offset + length);
+#endif
+        return;
+    };
+
+    out.append(data, size);
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef DAEMON_PROTOCOL_H
+#define DAEMON_PROTOCOL_H
+
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Frames exchanged with a daemon over a Unix socket.
+ *
+ * A request is a header followed by lines, each terminated by a newline,
+ * and is answered by a response holding their outputs the same way. A
+ * client can send several requests without waiting, responses come back in
+ * request order. As both ends run on the same host, integers are in native
+ * byte order.
+ */
+struct FrameHeader {
+    uint32_t magic;  // FRAME_MAGIC
+    uint32_t code;  // Segmenter::Mode of a request, FrameStatus of a response
+    uint64_t lines;  // Number of lines in data
+    uint64_t data_size;  // Bytes of lines following the header
+    uint64_t error_size;  // Bytes of an error message following the data
+};
+
+static const uint32_t FRAME_MAGIC = 0x314B5446;  // "FTK1"
+
+// Limits the memory a single request can make the daemon claim, clients
+// split chunks into requests that fit
+static const uint64_t MAX_REQUEST_BYTES = 8 << 20;
+
+// Outputs can be several times larger than their lines, responses come from
+// a daemon of the same user and the limit only catches corrupt frames
+static const uint64_t MAX_RESPONSE_BYTES = 1ull << 32;
+
+enum FrameStatus {
+    // All lines were processed
+    FRAME_OK = 0,
+    // A line was rejected, data holds the outputs of the lines before it
+    // and the error message follows
+    FRAME_ERROR = 1,
+    // The connection is closed without answering requests, the error
+    // message says why
+    FRAME_REFUSED = 2,
+};
+
+/**
+ * Write all of iov to fd, retrying on partial writes. Returns false with
+ * errno set if a write fails.
+ */
+inline bool write_all(int fd, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        };
+
+        size_t remaining = written;
+        while (iovcnt > 0 && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        };
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + remaining;
+            iov->iov_len -= remaining;
+        };
+    };
+    return true;
+}
+
+/**
+ * Read size bytes from fd into buf, returns fewer only at the end of input.
+ */
+inline size_t read_all(int fd, char* buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t length = read(fd, buf + done, size - done);
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("Failed to read from socket.");
+        };
+        if (length == 0) break;
+        done += length;
+    };
+    return done;
+}
+
+/**
+ * Read the next frame, returns false if fd is closed before it starts.
+ * Throws std::runtime_error for truncated or malformed frames and for
+ * frames of more than max_bytes.
+ */
+inline bool read_frame(
+    int fd,
+    FrameHeader& header,
+    std::string& data,
+    std::string& error,
+    uint64_t max_bytes
+) {
+    size_t length = read_all(fd, (char*) &header, sizeof(header));
+    if (length == 0) return false;
+    if (length < sizeof(header) || header.magic != FRAME_MAGIC
+        || header.data_size > max_bytes
+        || header.error_size > max_bytes - header.data_size
+    ) {
+        throw std::runtime_error("Malformed frame.");
+    };
+
+    data.resize(header.data_size);
+    error.resize(header.error_size);
+    if (read_all(fd, &data[0], data.size()) < data.size()
+        || read_all(fd, &error[0], error.size()) < error.size()
+    ) {
+        throw std::runtime_error("Truncated frame.");
+    };
+    return true;
+}
+
+/**
+ * Write a frame of data followed by error. Returns false with errno set if
+ * a write fails.
+ */
+inline bool write_frame(
+    int fd,
+    uint32_t code,
+    uint64_t lines,
+    const char* data,
+    size_t data_size,
+    const std::string& error
+) {
+    FrameHeader header = {FRAME_MAGIC, code, lines, data_size, error.size()};
+    struct iovec iov[] = {
+        {(void*) &header, sizeof(header)},
+        {(void*) data, data_size},
+        {(void*) error.data(), error.size()},
+    };
+    return write_all(fd, iov, 3);
+}
+
+#endif
@@ -1,16 +1,42 @@
 #include <string>
 #include <chrono>
-#include <queue>
+#include <thread>
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <csignal>
+
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "CLI/App.hpp"
 #include "CLI/Formatter.hpp"
 #include "CLI/Config.hpp"
 #include "ThreadPool.h"
+#include "compression.h"
+#include "daemon_protocol.h"
+#include "json_fields.h"
+#include "reorder_buffer.h"
 
 #include "fasttokenizer/segmenter.h"
+#include "fasttokenizer/text_scan.h"
+#include "fasttokenizer/vocabulary.h"
 
 #ifdef TOKENIZER_NAMESPACE
 using namespace TOKENIZER_NAMESPACE;
@@ -19,124 +45,1366 @@ using namespace TOKENIZER_NAMESPACE;
 typedef std::vector<std::string> vecstr;
 
 unsigned int CHUNKSIZE = 10000;
+size_t READSIZE = 1 << 20;
 
 // CLI args
 typedef struct {
     std::string input = "-";
+    std::string output = "-";
+    std::string compress = "auto";
+    vecstr inputs;
+    std::string input_list;
+    std::string output_dir;
+    std::string tsv_fields;
+    vecstr json_fields;
+    std::string vocab;
+    std::string unk_token = "<unk>";
+    std::string invalid_utf8 = "replace";
+    vecstr protect;
+    std::string protect_builtin;
     bool protected_dash_split = false;
     bool desegment = false;
     bool norm_only = false;
     bool segm_only = false;
     int num_threads = 4;
     bool quiet = false;
+    bool stats = false;
+    size_t cache_size = 0;
+    size_t long_line_bytes = 1 << 20;
+    std::string serve;
+    std::string connect;
 } Args;
 
 Args args;
 unsigned int flag = -1;
 Segmenter* segmenter;
+Vocabulary* vocabulary = nullptr;
+
+// Output compression unless --compress is auto
+Compression output_compression = UNCOMPRESSED;
+
+// Mode of each flag
+const Segmenter::Mode FLAG_MODES[] = {
+    Segmenter::NORMALIZE_AND_SEGMENT,
+    Segmenter::NORMALIZE,
+    Segmenter::SEGMENT,
+    Segmenter::DESEGMENT,
+};
+
+// Mode of each TSV column, -1 for columns passed through as is
+std::vector<int> tsv_modes;
+
+// JSON fields to process and their modes
+std::vector<std::pair<std::string, Segmenter::Mode>> json_modes;
+
+// Records that are not JSON objects, passed through as is
+std::atomic<size_t> malformed_records(0);
+
+// Stats of all chunks, guarded by stats_mutex
+SegmenterStats total_stats;
+std::mutex stats_mutex;
+
+// Pool of the running pipelines, long lines are split over its workers
+ThreadPool* worker_pool = nullptr;
+
+// A chunk of input lines and their segmented outputs
+// Lines either point into data or into a memory mapped input file.
+// Outputs are newline terminated and concatenated into output, which is
+// compressed as a whole when output is compressed.
+typedef struct {
+    size_t seq;
+    Segmenter::Mode mode;
+    Compression compression;
+    std::string data;
+    std::vector<icu::StringPiece> lines;
+    std::string output;
+    std::string error;  // Set if a line was rejected, output ends before it
+    size_t error_line;  // Index of the rejected line
+} Chunk;
+
+/**
+ * Segmenter of the calling worker thread. Clones stay alive across chunks
+ * and requests, so their buffers and matchers are warm.
+ */
+Segmenter* worker_segmenter() {
+    thread_local std::unique_ptr<Segmenter> segmenter_copy(segmenter->clone());
+    return segmenter_copy.get();
+}
+
+void merge_stats(Segmenter* segmenter_copy) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    total_stats.merge(segmenter_copy->get_stats());
+    segmenter_copy->reset_stats();
+}
+
+/**
+ * Pieces of a long line, claimed one at a time by the worker processing
+ * the line and by idle workers helping it.
+ */
+struct LongLine {
+    Segmenter::Mode mode;
+    std::vector<icu::StringPiece> pieces;
+    std::vector<std::string> outputs;
+    std::atomic<size_t> next_piece;
+
+    std::mutex mutex;
+    std::condition_variable done_cond;
+    size_t num_done = 0;
+    std::exception_ptr error;
+
+    // Process pieces until there are none left to claim
+    void work(Segmenter* segmenter_copy) {
+        size_t k;
+        while ((k = next_piece.fetch_add(1)) < pieces.size()) {
+            std::exception_ptr piece_error;
+            try {
+                segmenter_copy->process_piece(mode, pieces[k], outputs[k]);
+            } catch (...) {
+                piece_error = std::current_exception();
+            };
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (piece_error && !error) error = piece_error;
+            if (++num_done == pieces.size()) done_cond.notify_all();
+        };
+    };
+};
+
+/**
+ * Process text with mode and append the result to output.
+ */
+void process_text(
+    Segmenter* segmenter_copy,
+    Segmenter::Mode mode,
+    icu::StringPiece text,
+    std::string& output
+) {
+    // Long lines are split over idle workers of the pool rather than
+    // holding up output behind a single worker. The calling worker takes
+    // pieces too and then only waits for pieces being processed, never
+    // for tasks queued behind it.
+    if (worker_pool != nullptr && args.num_threads > 1
+        && args.long_line_bytes > 0
+        && (size_t) text.length() > args.long_line_bytes
+    ) {
+        std::shared_ptr<LongLine> long_line(new LongLine());
+        if (segmenter_copy->split_long_line(mode, text, long_line->pieces)) {
+            size_t num_pieces = long_line->pieces.size();
+            long_line->mode = mode;
+            long_line->outputs.resize(num_pieces);
+            long_line->next_piece = 0;
+
+            // Helpers starting after all pieces are claimed do nothing
+            size_t num_helpers = std::min(
+                num_pieces, (size_t) args.num_threads) - 1;
+            for (size_t i=0; i<num_helpers; ++i) {
+                worker_pool->enqueue([long_line] {
+                    Segmenter* helper = worker_segmenter();
+                    long_line->work(helper);
+                    merge_stats(helper);
+                });
+            };
+            long_line->work(segmenter_copy);
+
+            std::unique_lock<std::mutex> lock(long_line->mutex);
+            long_line->done_cond.wait(lock, [&] {
+                return long_line->num_done == num_pieces;
+            });
+            if (long_line->error) std::rethrow_exception(long_line->error);
+
+            size_t offset = output.size();
+            for (const std::string& piece_output: long_line->outputs) {
+                output.append(piece_output);
+            };
+            segmenter_copy->finish_pieces(mode, output, offset);
+            return;
+        };
+    };
+
+    switch (mode) {
+    case Segmenter::DESEGMENT:
+        segmenter_copy->desegment(text, output);
+        break;
 
-vecstr* segment_lines(vecstr* lines) {
-    Segmenter* segmenter_copy = segmenter->clone();
-    int num_lines = lines->size();
+    case Segmenter::SEGMENT:
+        segmenter_copy->segment(text, output);
+        break;
+
+    case Segmenter::NORMALIZE:
+        segmenter_copy->normalize(text, output);
+        break;
+
+    default:
+        segmenter_copy->normalize_and_segment(text, output);
+        break;
+    }
+}
+
+/**
+ * Process the selected columns of a TSV record, other columns are copied.
+ */
+void process_tsv(
+    Segmenter* segmenter_copy,
+    icu::StringPiece record,
+    std::string& output
+) {
+    const char* p = record.data();
+    const char* end = p + record.length();
+    for (size_t column=0; ; ++column) {
+        const char* tab = (const char*) memchr(p, '\t', end - p);
+        const char* field_end = tab != nullptr ? tab : end;
+        icu::StringPiece field(p, field_end - p);
+
+        if (column < tsv_modes.size() && tsv_modes[column] >= 0) {
+            process_text(
+                segmenter_copy, (Segmenter::Mode) tsv_modes[column],
+                field, output);
+        } else {
+            output.append(field.data(), field.length());
+        };
+
+        if (tab == nullptr) break;
+        output.push_back('\t');
+        p = tab + 1;
+    };
+}
+
+// Reused buffers of a chunk for processing JSON records
+typedef struct {
+    std::vector<JsonField> fields;
+    std::string key;
+    std::string text;
+    std::string output;
+} JsonBuffers;
+
+/**
+ * Process the selected string fields of a JSONL record, the rest of the
+ * record is copied. Records that are not JSON objects are copied as is.
+ */
+void process_json(
+    Segmenter* segmenter_copy,
+    icu::StringPiece record,
+    std::string& output,
+    JsonBuffers& buffers
+) {
+    const char* data = record.data();
+    size_t size = record.length();
+    if (!find_json_fields(data, size, buffers.fields)) {
+        ++malformed_records;
+        output.append(data, size);
+        return;
+    };
+
+    size_t copied = 0;
+    for (const JsonField& field: buffers.fields) {
+        // Keys are compared unescaped only when they have escapes
+        const char* key = field.key;
+        size_t key_size = field.key_size;
+        if (memchr(key, '\\', key_size) != nullptr) {
+            buffers.key.clear();
+            if (!json_unescape(key, key_size, buffers.key)) continue;
+            key = buffers.key.data();
+            key_size = buffers.key.size();
+        };
+
+        auto selected = std::find_if(
+            json_modes.begin(), json_modes.end(),
+            [&](const std::pair<std::string, Segmenter::Mode>& json_mode) {
+                return json_mode.first.compare(0, std::string::npos,
+                    key, key_size) == 0;
+            });
+        if (selected == json_modes.end()) continue;
+
+        buffers.text.clear();
+        if (!json_unescape(data + field.value_begin,
+            field.value_end - field.value_begin, buffers.text)
+        ) {
+            continue;
+        };
+        buffers.output.clear();
+        process_text(
+            segmenter_copy, selected->second, buffers.text, buffers.output);
+
+        output.append(data + copied, field.value_begin - copied);
+        json_escape(buffers.output.data(), buffers.output.size(), output);
+        copied = field.value_end;
+    };
+    output.append(data + copied, size - copied);
+}
+
+// Reused buffers of a chunk for looking up token IDs
+typedef struct {
+    std::string normalized;
+    std::vector<TokenSpan> spans;
+    std::vector<int32_t> ids;
+} IdBuffers;
+
+/**
+ * Segment text and append the vocabulary IDs of its tokens to output as a
+ * record of int32 values, the number of tokens followed by their IDs.
+ * Tokens are looked up from their spans, no joined string is built.
+ */
+void process_ids(
+    Segmenter* segmenter_copy,
+    Segmenter::Mode mode,
+    icu::StringPiece text,
+    std::string& output,
+    IdBuffers& buffers
+) {
+    buffers.ids.clear();
+    if (mode == Segmenter::NORMALIZE_AND_SEGMENT) {
+        segmenter_copy->normalize_and_segment_spans(
+            text, buffers.normalized, buffers.spans);
+        vocabulary->find_spans(buffers.normalized, buffers.spans, buffers.ids);
+    } else {
+        segmenter_copy->segment_spans(text, buffers.spans);
+        vocabulary->find_spans(text, buffers.spans, buffers.ids);
+    };
+
+    int32_t num_ids = buffers.ids.size();
+    output.append((const char*) &num_ids, sizeof(num_ids));
+    output.append(
+        (const char*) buffers.ids.data(), num_ids * sizeof(int32_t));
+}
+
+Chunk* segment_lines(Chunk* chunk, Segmenter* segmenter_copy) {
+    int num_lines = chunk->lines.size();
+
+    // Segmentation rarely grows text by more than a quarter
+    size_t input_size = 0;
+    for (const icu::StringPiece& line: chunk->lines) {
+        input_size += line.length() + 1;
+    };
+    chunk->output.reserve(input_size + input_size / 4);
+
+    Segmenter::Mode mode = chunk->mode;
+    JsonBuffers json_buffers;
+    IdBuffers id_buffers;
 
-    std::string input_text;
-    std::string output_text;
     for (int i=0; i<num_lines; ++i) {
-        input_text = lines->at(i);
-        output_text.clear();
+        icu::StringPiece input_text = chunk->lines[i];
+        std::string& output_text = chunk->output;
+        size_t line_begin = output_text.size();
 
-        switch (flag) {
-        case 3:
-            segmenter_copy->desegment(input_text, output_text);
-            break;
+        // Ill-formed lines throw with --invalid-utf8 error, as does a line
+        // that fails otherwise, the output of the chunk then ends before it
+        try {
+            if (vocabulary != nullptr) {
+                process_ids(
+                    segmenter_copy, mode, input_text, output_text, id_buffers);
+                continue;
+            };
 
-        case 2:
-            segmenter_copy->segment(input_text, output_text);
+            if (!tsv_modes.empty()) {
+                process_tsv(segmenter_copy, input_text, output_text);
+            } else if (!json_modes.empty()) {
+                process_json(
+                    segmenter_copy, input_text, output_text, json_buffers);
+            } else {
+                process_text(segmenter_copy, mode, input_text, output_text);
+            };
+        } catch (const std::exception& e) {
+            output_text.resize(line_begin);
+            chunk->error = e.what();
+            chunk->error_line = i;
             break;
+        };
+        output_text.push_back('\n');
+    };
 
-        case 1:
-            segmenter_copy->normalize(input_text, output_text);
-            break;
+    merge_stats(segmenter_copy);
+
+    if (chunk->compression != UNCOMPRESSED && !chunk->output.empty()) {
+        std::string compressed;
+        compress_block(
+            chunk->compression,
+            chunk->output.data(),
+            chunk->output.size(),
+            compressed
+        );
+        chunk->output.swap(compressed);
+    };
+    return chunk;
+}
+
+/**
+ * Segment a chunk on a pool worker. Futures of pool tasks are dropped, so
+ * errors outside of lines, like a failed compression, are kept in the chunk
+ * with all of its output dropped. The chunk always reaches the writer.
+ */
+void segment_chunk(Chunk* chunk) {
+    try {
+        segment_lines(chunk, worker_segmenter());
+        return;
+    } catch (const std::exception& e) {
+        chunk->error = e.what();
+    } catch (...) {
+        chunk->error = "Unknown error.";
+    };
+    chunk->output.clear();
+    chunk->error_line = 0;
+}
+
+/**
+ * Takes chunks of input lines in order, submitted chunks are owned by it.
+ */
+class ChunkSink {
+    public:
+        virtual ~ChunkSink() {};
+        virtual void submit(Chunk* chunk) = 0;
+};
+
+/**
+ * Segments chunks on a thread pool and writes them out in input order.
+ *
+ * The calling thread reads and submits chunks, workers segment and compress
+ * them and a dedicated writer thread flushes finished chunks in order.
+ * Chunks are handed to the writer through a reorder buffer, so a slow chunk
+ * only holds back output while the reader keeps up to num_threads * 8 chunks
+ * in flight. Pipelines of several outputs can share one pool.
+ */
+class ChunkPipeline : public ChunkSink {
+    private:
+        ThreadPool& pool;
+        ReorderBuffer<Chunk> reorder_buffer;
+        int fd;
+        Compression compression;
+        std::thread writer;
+        std::exception_ptr writer_error;
+        std::atomic<bool> failed;  // A chunk has a rejected line
+        size_t num_chunks;
+        size_t num_lines;
+
+        static const size_t MAX_WRITE_CHUNKS = 64;
 
-        default:
-            segmenter_copy->normalize_and_segment(input_text, output_text);
+        void write_chunks() {
+            std::vector<Chunk*> chunks;
+            std::vector<struct iovec> iov;
+            chunks.reserve(MAX_WRITE_CHUNKS);
+            iov.reserve(MAX_WRITE_CHUNKS);
+
+            while (reorder_buffer.take(chunks, MAX_WRITE_CHUNKS)) {
+                // Output stops at the first rejected line
+                iov.clear();
+                const Chunk* failed_chunk = nullptr;
+                for (Chunk* chunk: chunks) {
+                    if (!chunk->output.empty()) {
+                        iov.push_back({
+                            (void*) chunk->output.data(),
+                            chunk->output.size()
+                        });
+                    };
+                    if (!chunk->error.empty()) {
+                        failed_chunk = chunk;
+                        break;
+                    };
+                };
+
+                // Keep draining after a failed write so the reader is never
+                // left waiting, the error is raised in finish
+                if (!writer_error) {
+                    try {
+                        if (!write_all(fd, iov.data(), iov.size())) {
+                            throw std::runtime_error("Failed to write output.");
+                        };
+                        if (failed_chunk != nullptr) {
+                            throw std::runtime_error("Line " + std::to_string(
+                                failed_chunk->seq * CHUNKSIZE
+                                + failed_chunk->error_line + 1)
+                                + ": " + failed_chunk->error);
+                        };
+                    } catch (...) {
+                        writer_error = std::current_exception();
+                    };
+                };
+
+                size_t chunk_lines = 0;
+                for (Chunk* chunk: chunks) {
+                    chunk_lines += chunk->lines.size();
+                    delete chunk;
+                };
+                num_lines += chunk_lines;
+                reorder_buffer.release();
+
+                size_t written_lines = total_lines.fetch_add(chunk_lines)
+                    + chunk_lines;
+                if (!args.quiet && !writer_error) {
+                    std::lock_guard<std::mutex> lock(progress_mutex);
+                    std::cerr << "\r" << written_lines;
+                };
+            };
+        };
+
+    public:
+        // Lines written by all pipelines
+        static std::atomic<size_t> total_lines;
+        static std::mutex progress_mutex;
+
+        ChunkPipeline(
+            ThreadPool& pool,
+            int num_threads,
+            int fd,
+            Compression compression
+        )
+            : pool(pool)
+            , reorder_buffer(num_threads * 8)
+            , fd(fd)
+            , compression(compression)
+            , failed(false)
+            , num_chunks(0)
+            , num_lines(0)
+        {
+            writer = std::thread(&ChunkPipeline::write_chunks, this);
+        };
+
+        // Workers and the writer refer to a pipeline until it is finished,
+        // so one left behind by an error is drained first
+        ~ChunkPipeline() {
+            if (writer.joinable()) {
+                reorder_buffer.close(num_chunks);
+                writer.join();
+            };
+        };
+
+        // Chunks submitted after a line was rejected are dropped
+        void submit(Chunk* chunk) {
+            if (failed) {
+                delete chunk;
+                return;
+            };
+            chunk->seq = num_chunks++;
+            chunk->mode = FLAG_MODES[flag];
+            chunk->compression = compression;
+            reorder_buffer.reserve(chunk->seq);
+            pool.enqueue([this, chunk] {
+                segment_chunk(chunk);
+                if (!chunk->error.empty()) failed = true;
+                reorder_buffer.put(chunk->seq, chunk);
+            });
+        };
+
+        // Wait for all chunks to be written, returns the number of lines
+        size_t finish() {
+            reorder_buffer.close(num_chunks);
+            writer.join();
+            if (writer_error) std::rethrow_exception(writer_error);
+            return num_lines;
+        };
+};
+
+std::atomic<size_t> ChunkPipeline::total_lines(0);
+std::mutex ChunkPipeline::progress_mutex;
+
+/**
+ * Read input in blocks and split it into chunks of lines.
+ * Each chunk owns the lines it holds, the incomplete line at the end of a
+ * block is moved on to the next chunk.
+ */
+void submit_lines(
+    ChunkSink& pipeline,
+    Chunk* chunk,
+    std::vector<size_t>& line_ends
+) {
+    size_t begin = 0;
+    chunk->lines.reserve(line_ends.size());
+    for (size_t end: line_ends) {
+        chunk->lines.push_back(
+            icu::StringPiece(chunk->data.data() + begin, end - begin));
+        begin = end + 1;
+    };
+    line_ends.clear();
+    pipeline.submit(chunk);
+}
+
+void run_stream(InputStream& input, ChunkSink& pipeline) {
+    Chunk* chunk = new Chunk();
+    std::vector<size_t> line_ends;
+    size_t line_begin = 0;  // Start of the incomplete line in chunk->data
+
+    while (true) {
+        size_t size = chunk->data.size();
+        chunk->data.resize(size + READSIZE);
+        size_t length = input.read(&chunk->data[size], READSIZE);
+        chunk->data.resize(size + length);
+
+        // Last line might not end with a newline
+        if (length == 0) {
+            if (line_begin < size) line_ends.push_back(size);
             break;
-        }
+        };
+
+        while (true) {
+            find_newlines(
+                chunk->data.data(), line_begin, chunk->data.size(),
+                line_ends, CHUNKSIZE);
+            if (!line_ends.empty()) line_begin = line_ends.back() + 1;
+            if (line_ends.size() < CHUNKSIZE) break;
 
-        lines->at(i) = output_text;
+            Chunk* next_chunk = new Chunk();
+            next_chunk->data.assign(chunk->data, line_begin, std::string::npos);
+            chunk->data.resize(line_begin);
+            submit_lines(pipeline, chunk, line_ends);
+
+            chunk = next_chunk;
+            line_begin = 0;
+        };
+    };
+
+    if (!line_ends.empty()) {
+        submit_lines(pipeline, chunk, line_ends);
+    } else {
+        delete chunk;
     };
-    delete segmenter_copy;
-    return lines;
 }
 
-size_t run(FILE* input_stream) {
-    size_t num_lines = 0;
+void run_mapped(const char* data, size_t size, ChunkSink& pipeline) {
+    std::vector<size_t> line_ends;
+    line_ends.reserve(CHUNKSIZE);
+    size_t begin = 0;
+    while (begin < size) {
+        Chunk* chunk = new Chunk();
+        chunk->lines.reserve(CHUNKSIZE);
+
+        // Last line might not end with a newline
+        size_t end = find_newlines(data, begin, size, line_ends, CHUNKSIZE);
+        if (end == size && (line_ends.empty() || line_ends.back() + 1 < size)) {
+            line_ends.push_back(size);
+        };
+
+        for (size_t line_end: line_ends) {
+            chunk->lines.push_back(
+                icu::StringPiece(data + begin, line_end - begin));
+            begin = line_end + 1;
+        };
+        line_ends.clear();
+
+        pipeline.submit(chunk);
+    };
+}
+
+/**
+ * Memory mapped input, chunks point into it until their pipeline finishes.
+ */
+struct Mapping {
+    void* data = nullptr;
+    size_t size = 0;
+
+    ~Mapping() { if (data != nullptr) munmap(data, size); };
+};
+
+/**
+ * Uncompressed regular files are memory mapped and lines are segmented
+ * without being copied. Anything else is read as a stream and decompressed
+ * if it starts with a gzip or zstd magic number.
+ * All lines of fd are submitted to pipeline and fd is closed.
+ */
+void run_file(int fd, ChunkSink& pipeline, Mapping& mapping) {
+    std::unique_ptr<FdInput> input(new FdInput(fd));
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)
+        || file_stat.st_size == 0
+        || compression_of_data(input->peek(4)) != UNCOMPRESSED
+    ) {
+        run_stream(*open_input(std::move(input)), pipeline);
+        close(fd);
+        return;
+    };
+
+    size_t size = file_stat.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Failed to map input file.");
+    };
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    mapping.data = data;
+    mapping.size = size;
+    run_mapped((const char*) data, size, pipeline);
+}
+
+size_t run_single() {
+    int input_fd = STDIN_FILENO;
+    if (args.input != "-") {
+        input_fd = open(args.input.c_str(), O_RDONLY);
+        if (input_fd < 0) throw std::runtime_error("Input file not founds.");
+    };
+
+    int output_fd = STDOUT_FILENO;
+    if (args.output != "-") {
+        output_fd = open(
+            args.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output_fd < 0) {
+            throw std::runtime_error("Failed to open output file.");
+        };
+    };
+
+    Compression compression = output_compression;
+    if (args.compress == "auto") compression = compression_of_path(args.output);
 
     ThreadPool pool(args.num_threads);
-    std::queue<std::future<vecstr*>> result_queue;
-    unsigned int result_queue_size = 0;
-    unsigned int max_chunks = args.num_threads * 8;
-
-    vecstr* input_buffer = new vecstr();
-    input_buffer->reserve(CHUNKSIZE);
-    unsigned int input_buffer_size = 0;
-
-    vecstr* obuffer;
-
-    char* line;
-    size_t length;
-    while ((line = fgetln(input_stream, &length)) != nullptr) {
-        line[length - 1] = 0;
-        input_buffer->push_back(std::string(line));
-        ++input_buffer_size;
-
-        if (input_buffer_size >= CHUNKSIZE) {
-            result_queue.push(pool.enqueue(segment_lines, input_buffer));
-            ++result_queue_size;
-
-            if (result_queue_size >= max_chunks) {
-                obuffer = result_queue.front().get();
-                result_queue.pop();
-                --result_queue_size;
-
-                for (std::string segmented_line: *obuffer) {
-                    std::cout << segmented_line << "\n";
-                    ++num_lines;
-                };
-                if (!args.quiet) std::cerr << "\r" << num_lines;
+    worker_pool = &pool;
+    ChunkPipeline pipeline(pool, args.num_threads, output_fd, compression);
+    Mapping mapping;
+    run_file(input_fd, pipeline, mapping);
+    size_t num_lines = pipeline.finish();
 
-                delete obuffer;
-            }
+    if (output_fd != STDOUT_FILENO && close(output_fd) != 0) {
+        throw std::runtime_error("Failed to write output.");
+    };
+    return num_lines;
+}
 
-            input_buffer = new vecstr();
-            input_buffer->reserve(CHUNKSIZE);
-            input_buffer_size = 0;
+/**
+ * Paths matching each pattern, patterns without matches are kept as is.
+ */
+vecstr expand_globs(const vecstr& patterns) {
+    vecstr paths;
+    for (const std::string& pattern: patterns) {
+        glob_t matches;
+        if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+            for (size_t i=0; i<matches.gl_pathc; ++i) {
+                paths.push_back(matches.gl_pathv[i]);
+            };
+        } else {
+            paths.push_back(pattern);
         };
+        globfree(&matches);
     };
+    return paths;
+}
+
+static std::string file_name(const std::string& path) {
+    return path.substr(path.find_last_of('/') + 1);
+}
+
+/**
+ * An input file being processed into a file in the output directory.
+ * Output is written to a temporary file that replaces the final one once
+ * all of it is written.
+ */
+struct Shard {
+    std::string input;
+    std::string output;
+    std::string temp_output;
+    int fd;
+    Mapping mapping;
+    std::unique_ptr<ChunkPipeline> pipeline;
+};
+
+const char* MANIFEST_NAME = "fasttokenizer.manifest";
 
-    if (input_buffer_size > 0) {
-        result_queue.push(pool.enqueue(segment_lines, input_buffer));
+/**
+ * Process many inputs into files of the same name in args.output_dir.
+ *
+ * All chunks of all files go through one shared pool. Workers take the next
+ * chunk of any file as they free up, so the tail of one file overlaps the
+ * head of the next and small files keep every worker busy. Up to num_threads
+ * files are in flight at a time.
+ *
+ * Completed inputs are appended to a manifest in the output directory and
+ * skipped when the same job is run again.
+ */
+size_t run_shards() {
+    vecstr inputs = expand_globs(args.inputs);
+    if (!args.input_list.empty()) {
+        std::ifstream list(args.input_list);
+        if (!list) throw std::runtime_error("Input list not founds.");
+        std::string path;
+        while (std::getline(list, path)) {
+            if (!path.empty()) inputs.push_back(path);
+        };
     };
 
-    while (!result_queue.empty()) {
-        obuffer = result_queue.front().get();
-        result_queue.pop();
+    if (mkdir(args.output_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        throw std::runtime_error("Failed to create output directory.");
+    };
 
-        for (std::string segmented_line: *obuffer) {
-            std::cout << segmented_line << "\n";
-            ++num_lines;
+    // Outputs are named after inputs so names have to be unique
+    std::set<std::string> names = {MANIFEST_NAME};
+    for (const std::string& input: inputs) {
+        if (!names.insert(file_name(input)).second) {
+            throw std::runtime_error(
+                "Inputs have the same file name: " + file_name(input));
         };
-        if (!args.quiet) std::cerr << "\r" << num_lines;
+    };
 
-        delete obuffer;
+    std::string manifest_path = args.output_dir + "/" + MANIFEST_NAME;
+    std::set<std::string> completed;
+    {
+        std::ifstream manifest(manifest_path);
+        std::string line;
+        while (std::getline(manifest, line)) {
+            completed.insert(line.substr(0, line.find('\t')));
+        };
     };
-    std::cout << std::flush;
-    if (!args.quiet) std::cerr << "\r" << num_lines << " Done!" << std::endl;
+    FILE* manifest = fopen(manifest_path.c_str(), "a");
+    if (manifest == nullptr) {
+        throw std::runtime_error("Failed to open manifest.");
+    };
+
+    ThreadPool pool(args.num_threads);
+    worker_pool = &pool;
+    std::deque<std::unique_ptr<Shard>> shards;
+    size_t num_lines = 0;
+    size_t num_skipped = 0;
+
+    // Output only replaces the final file once written in full, and the
+    // input is only recorded once its output is in place
+    auto finish_shard = [&]() {
+        Shard& shard = *shards.front();
+        size_t shard_lines;
+        try {
+            shard_lines = shard.pipeline->finish();
+        } catch (const std::runtime_error& e) {
+            throw std::runtime_error(shard.input + ": " + e.what());
+        };
+        if (fsync(shard.fd) != 0 || close(shard.fd) != 0
+            || rename(shard.temp_output.c_str(), shard.output.c_str()) != 0
+        ) {
+            throw std::runtime_error("Failed to write " + shard.output);
+        };
+
+        fprintf(manifest, "%s\t%zu\n", shard.input.c_str(), shard_lines);
+        if (fflush(manifest) != 0 || fsync(fileno(manifest)) != 0) {
+            throw std::runtime_error("Failed to write manifest.");
+        };
+        num_lines += shard_lines;
+        shards.pop_front();
+    };
+
+    for (const std::string& input: inputs) {
+        if (completed.count(input) > 0) {
+            ++num_skipped;
+            continue;
+        };
 
+        int input_fd = open(input.c_str(), O_RDONLY);
+        if (input_fd < 0) {
+            throw std::runtime_error("Input file not founds: " + input);
+        };
+
+        std::unique_ptr<Shard> shard(new Shard());
+        shard->input = input;
+        shard->output = args.output_dir + "/" + file_name(input);
+        shard->temp_output = shard->output + ".tmp";
+        shard->fd = open(
+            shard->temp_output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (shard->fd < 0) {
+            throw std::runtime_error("Failed to open " + shard->temp_output);
+        };
+
+        // Outputs keep the compression of their inputs unless told otherwise
+        Compression compression = output_compression;
+        if (args.compress == "auto") {
+            compression = compression_of_path(shard->output);
+        };
+        shard->pipeline.reset(new ChunkPipeline(
+            pool, args.num_threads, shard->fd, compression));
+        run_file(input_fd, *shard->pipeline, shard->mapping);
+
+        shards.push_back(std::move(shard));
+        if (shards.size() > (size_t) args.num_threads) finish_shard();
+    };
+    while (!shards.empty()) finish_shard();
+    fclose(manifest);
+
+    if (!args.quiet && num_skipped > 0) {
+        std::cerr << "\rSkipped " << num_skipped
+            << " inputs listed in " << manifest_path << std::endl;
+    };
     return num_lines;
 }
 
-int main(int argc, char** argv) {
+// Connections served at once, more are refused so that clients cannot make
+// the daemon start threads and buffer requests without bound
+static const int MAX_CONNECTIONS = 64;
+std::atomic<int> num_connections(0);
+
+/**
+ * Answer the requests of a client until it closes its end of the socket.
+ *
+ * Requests are segmented on the shared pool, several requests of one
+ * connection in parallel, and a writer thread sends the responses back in
+ * request order. Up to num_threads * 2 requests of a connection are in
+ * flight, a client sending more waits on the socket.
+ */
+void serve_connection(ThreadPool& pool, int fd) {
+    ReorderBuffer<Chunk> reorder_buffer(args.num_threads * 2);
+
+    // A client that went away is drained without writing, so workers and
+    // the reader are never left waiting
+    std::thread writer([&] {
+        std::vector<Chunk*> chunks;
+        bool connected = true;
+        while (reorder_buffer.take(chunks, 1)) {
+            Chunk* chunk = chunks[0];
+            if (connected) {
+                size_t num_lines = chunk->error.empty()
+                    ? chunk->lines.size() : chunk->error_line;
+                connected = write_frame(
+                    fd, chunk->error.empty() ? FRAME_OK : FRAME_ERROR,
+                    num_lines, chunk->output.data(), chunk->output.size(),
+                    chunk->error);
+            };
+            delete chunk;
+            reorder_buffer.release();
+        };
+    });
+
+    size_t num_requests = 0;
+    std::vector<size_t> line_ends;
+    std::string error;
+    try {
+        while (true) {
+            std::unique_ptr<Chunk> chunk(new Chunk());
+            FrameHeader header;
+            if (!read_frame(
+                fd, header, chunk->data, error, MAX_REQUEST_BYTES)
+            ) {
+                break;
+            };
+
+            // Lines are newline terminated and all of them are counted
+            const std::string& data = chunk->data;
+            line_ends.clear();
+            size_t end = find_newlines(
+                data.data(), 0, data.size(), line_ends, header.lines);
+            if (header.code > Segmenter::DESEGMENT
+                || line_ends.size() != header.lines || end != data.size()
+                || (!data.empty() && data.back() != '\n')
+            ) {
+                throw std::runtime_error("Malformed request.");
+            };
+
+            size_t begin = 0;
+            chunk->lines.reserve(line_ends.size());
+            for (size_t line_end: line_ends) {
+                chunk->lines.push_back(
+                    icu::StringPiece(data.data() + begin, line_end - begin));
+                begin = line_end + 1;
+            };
+            chunk->seq = num_requests++;
+            chunk->mode = (Segmenter::Mode) header.code;
+            chunk->compression = UNCOMPRESSED;
+
+            Chunk* request = chunk.release();
+            reorder_buffer.reserve(request->seq);
+            pool.enqueue([&reorder_buffer, request] {
+                segment_chunk(request);
+                reorder_buffer.put(request->seq, request);
+            });
+        };
+    } catch (const std::exception& e) {
+        // Requests read so far are still answered
+        if (!args.quiet) std::cerr << "Connection: " << e.what() << std::endl;
+    };
+
+    reorder_buffer.close(num_requests);
+    writer.join();
+    close(fd);
+    --num_connections;
+}
+
+// Socket path removed when the daemon is stopped
+const char* socket_path = nullptr;
+
+extern "C" void stop_daemon(int) {
+    unlink(socket_path);
+    _exit(0);
+}
+
+static sockaddr_un socket_address(const std::string& path) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path is too long: " + path);
+    };
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+/**
+ * Connect to the daemon listening on path, returns -1 if there is none.
+ */
+static int connect_daemon(const std::string& path) {
+    sockaddr_un address = socket_address(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw std::runtime_error("Failed to create socket.");
+    if (connect(fd, (sockaddr*) &address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    };
+    return fd;
+}
+
+/**
+ * Serve clients on the Unix socket at args.serve until stopped by SIGINT or
+ * SIGTERM. The segmenter is built once and each worker keeps its clone, so
+ * short jobs run by the client skip process start and setup. Connections
+ * are served concurrently and share one pool of num_threads workers.
+ */
+void run_server() {
+    sockaddr_un address = socket_address(args.serve);
+
+    // A socket left behind by a daemon that is gone is replaced
+    int other_fd = connect_daemon(args.serve);
+    if (other_fd >= 0) {
+        close(other_fd);
+        throw std::runtime_error(
+            "A daemon is already listening on " + args.serve);
+    };
+    struct stat path_stat;
+    if (lstat(args.serve.c_str(), &path_stat) == 0
+        && S_ISSOCK(path_stat.st_mode)
+    ) {
+        unlink(args.serve.c_str());
+    };
+
+    // Only the user running the daemon can connect, the socket is created
+    // with these permissions so that nobody else can connect in between
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) throw std::runtime_error("Failed to create socket.");
+    mode_t old_mask = umask(0077);
+    int bound = bind(listen_fd, (sockaddr*) &address, sizeof(address));
+    umask(old_mask);
+    if (bound != 0) {
+        throw std::runtime_error("Failed to bind socket: " + args.serve);
+    };
+
+    socket_path = args.serve.c_str();
+    signal(SIGINT, stop_daemon);
+    signal(SIGTERM, stop_daemon);
+    if (listen(listen_fd, SOMAXCONN) != 0) {
+        unlink(socket_path);
+        throw std::runtime_error("Failed to listen on socket: " + args.serve);
+    };
+    if (!args.quiet) std::cerr << "Listening on " << args.serve << std::endl;
+
+    // Pool and connections live until the process is stopped
+    ThreadPool* pool = new ThreadPool(args.num_threads);
+    worker_pool = pool;
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            unlink(socket_path);
+            throw std::runtime_error("Failed to accept connection.");
+        };
+        if (num_connections >= MAX_CONNECTIONS) {
+            write_frame(fd, FRAME_REFUSED, 0, nullptr, 0,
+                "Daemon is serving too many connections.");
+            close(fd);
+            continue;
+        };
+        ++num_connections;
+        std::thread(serve_connection, std::ref(*pool), fd).detach();
+    };
+}
+
+/**
+ * Sends chunks to a daemon over one connection and writes out its responses.
+ *
+ * Requests are sent as soon as chunks are read, without waiting for earlier
+ * responses, and a receiver thread writes responses as they arrive, which is
+ * in request order. Output compression is done by the receiver.
+ */
+class DaemonPipeline : public ChunkSink {
+    private:
+        int socket_fd;
+        int fd;
+        Compression compression;
+        std::thread receiver;
+        std::exception_ptr receiver_error;
+        std::exception_ptr sender_error;
+        std::atomic<bool> failed;  // A line was rejected or a write failed
+        size_t num_requests;
+        size_t num_responses;
+        size_t num_lines;
+        size_t num_sent_lines;
+
+        void receive_responses() {
+            FrameHeader header;
+            std::string data;
+            std::string error;
+            std::string compressed;
+            while (true) {
+                // A broken connection also stops the sender
+                try {
+                    if (!read_frame(
+                        socket_fd, header, data, error, MAX_RESPONSE_BYTES)
+                    ) {
+                        break;
+                    };
+                    if (header.code == FRAME_REFUSED) {
+                        throw std::runtime_error(error);
+                    };
+                } catch (...) {
+                    if (!receiver_error) {
+                        receiver_error = std::current_exception();
+                    };
+                    failed = true;
+                    shutdown(socket_fd, SHUT_RDWR);
+                    break;
+                };
+                ++num_responses;
+
+                // Output stops at the first rejected line, later responses
+                // are drained until the daemon closes the connection
+                if (receiver_error) continue;
+                try {
+                    const std::string* output = &data;
+                    if (compression != UNCOMPRESSED && !data.empty()) {
+                        compressed.clear();
+                        compress_block(
+                            compression, data.data(), data.size(),
+                            compressed);
+                        output = &compressed;
+                    };
+                    struct iovec iov = {
+                        (void*) output->data(), output->size()};
+                    if (!write_all(fd, &iov, 1)) {
+                        throw std::runtime_error("Failed to write output.");
+                    };
+                    num_lines += header.lines;
+                    if (header.code != FRAME_OK) {
+                        throw std::runtime_error("Line "
+                            + std::to_string(num_lines + 1) + ": " + error);
+                    };
+                } catch (...) {
+                    receiver_error = std::current_exception();
+                    failed = true;
+                    continue;
+                };
+
+                size_t written_lines = ChunkPipeline::total_lines.fetch_add(
+                    header.lines) + header.lines;
+                if (!args.quiet) std::cerr << "\r" << written_lines;
+            };
+        };
+
+    public:
+        DaemonPipeline(int socket_fd, int fd, Compression compression)
+            : socket_fd(socket_fd)
+            , fd(fd)
+            , compression(compression)
+            , failed(false)
+            , num_requests(0)
+            , num_responses(0)
+            , num_lines(0)
+            , num_sent_lines(0)
+        {
+            receiver = std::thread(&DaemonPipeline::receive_responses, this);
+        };
+
+        // A pipeline left behind by an error stops its receiver
+        ~DaemonPipeline() {
+            if (receiver.joinable()) {
+                shutdown(socket_fd, SHUT_RDWR);
+                receiver.join();
+                close(socket_fd);
+            };
+        };
+
+        // Chunks submitted after a line was rejected are dropped. A chunk
+        // is sent as several requests when its lines are more than the
+        // daemon accepts in one
+        void submit(Chunk* chunk) {
+            std::unique_ptr<Chunk> owned(chunk);
+            const std::vector<icu::StringPiece>& lines = chunk->lines;
+            size_t first = 0;
+            while (!failed && first < lines.size()) {
+                size_t last = first;
+                size_t size = 0;
+                while (last < lines.size()
+                    && size + lines[last].length() + 1 <= MAX_REQUEST_BYTES
+                ) {
+                    size += lines[last].length() + 1;
+                    ++last;
+                };
+                if (last == first) {
+                    sender_error = std::make_exception_ptr(std::runtime_error(
+                        "Line " + std::to_string(num_sent_lines + first + 1)
+                        + " is too long for the daemon, process it without"
+                        " --connect."));
+                    failed = true;
+                    return;
+                };
+
+                // Lines are contiguous and newline separated both in mapped
+                // input and in chunk data, only the last newline can be
+                // missing
+                FrameHeader header = {
+                    FRAME_MAGIC, (uint32_t) FLAG_MODES[flag], last - first,
+                    size, 0};
+                struct iovec iov[] = {
+                    {(void*) &header, sizeof(header)},
+                    {(void*) lines[first].data(), size - 1},
+                    {(void*) "\n", 1},
+                };
+                if (!write_all(socket_fd, iov, 3)) {
+                    sender_error = std::make_exception_ptr(std::runtime_error(
+                        "Failed to send request to daemon."));
+                    failed = true;
+                    return;
+                };
+                ++num_requests;
+                first = last;
+            };
+            num_sent_lines += lines.size();
+        };
+
+        // Wait for all responses to be written, returns the number of lines
+        size_t finish() {
+            shutdown(socket_fd, SHUT_WR);
+            receiver.join();
+            close(socket_fd);
+            if (receiver_error) std::rethrow_exception(receiver_error);
+            if (sender_error) std::rethrow_exception(sender_error);
+            if (num_responses < num_requests) {
+                throw std::runtime_error("Daemon closed the connection.");
+            };
+            return num_lines;
+        };
+};
+
+/**
+ * Process args.input into args.output on the daemon listening on
+ * args.connect, as run_single does in process.
+ */
+size_t run_client() {
+    int socket_fd = connect_daemon(args.connect);
+    if (socket_fd < 0) {
+        throw std::runtime_error("No daemon listening on " + args.connect);
+    };
+
+    int input_fd = STDIN_FILENO;
+    if (args.input != "-") {
+        input_fd = open(args.input.c_str(), O_RDONLY);
+        if (input_fd < 0) throw std::runtime_error("Input file not founds.");
+    };
+
+    int output_fd = STDOUT_FILENO;
+    if (args.output != "-") {
+        output_fd = open(
+            args.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output_fd < 0) {
+            throw std::runtime_error("Failed to open output file.");
+        };
+    };
+
+    Compression compression = output_compression;
+    if (args.compress == "auto") compression = compression_of_path(args.output);
+
+    DaemonPipeline pipeline(socket_fd, output_fd, compression);
+    Mapping mapping;
+    run_file(input_fd, pipeline, mapping);
+    size_t num_lines = pipeline.finish();
+
+    if (output_fd != STDOUT_FILENO && close(output_fd) != 0) {
+        throw std::runtime_error("Failed to write output.");
+    };
+    return num_lines;
+}
+
+static float hit_rate(size_t hits, size_t misses) {
+    return hits > 0 ? 100.0f * hits / (hits + misses) : 0.0f;
+}
+
+void print_cache_hit_rates() {
+    std::cerr << "Cache hit rate: "
+        << hit_rate(total_stats.cache_line_hits, total_stats.cache_line_misses)
+        << "% of lines, "
+        << hit_rate(
+            total_stats.cache_chunk_hits, total_stats.cache_chunk_misses)
+        << "% of chunks" << std::endl;
+}
+
+/**
+ * Print segmenter stats as a single line JSON object to stderr.
+ */
+void print_stats(size_t num_lines, long long millis_elapsed) {
+    std::cerr << "{\"num_lines\": " << num_lines
+        << ", \"num_threads\": " << args.num_threads
+        << ", \"time_ms\": " << millis_elapsed;
+    total_stats.for_each([](const char* name, uint64_t value) {
+        std::cerr << ", \"" << name << "\": " << value;
+    });
+    std::cerr << "}" << std::endl;
+}
+
+/**
+ * Split a trailing ":mode" off a field spec, returns the mode of the flags
+ * when there is none.
+ */
+Segmenter::Mode parse_field_mode(std::string& spec) {
+    // Names in the order of Segmenter::Mode
+    static const char* MODE_NAMES[] = {
+        "normalize", "segment", "normalize_and_segment", "desegment"};
+
+    size_t colon = spec.rfind(':');
+    if (colon != std::string::npos) {
+        for (int i=0; i<4; ++i) {
+            if (spec.compare(colon + 1, std::string::npos, MODE_NAMES[i])) {
+                continue;
+            };
+            spec.resize(colon);
+            return (Segmenter::Mode) i;
+        };
+    };
+    return FLAG_MODES[flag];
+}
+
+/**
+ * Parse comma separated 1-based TSV columns, each with an optional mode.
+ */
+void parse_tsv_fields(const std::string& specs) {
+    std::stringstream stream(specs);
+    std::string spec;
+    while (std::getline(stream, spec, ',')) {
+        Segmenter::Mode mode = parse_field_mode(spec);
+        if (spec.empty()
+            || spec.find_first_not_of("0123456789") != std::string::npos
+            || std::stoul(spec) == 0
+        ) {
+            throw std::runtime_error("Invalid TSV field: " + spec);
+        };
+
+        size_t column = std::stoul(spec) - 1;
+        if (tsv_modes.size() <= column) tsv_modes.resize(column + 1, -1);
+        tsv_modes[column] = mode;
+    };
+}
+
+void parse_json_fields(const vecstr& specs) {
+    for (std::string spec: specs) {
+        Segmenter::Mode mode = parse_field_mode(spec);
+        json_modes.emplace_back(spec, mode);
+    };
+}
+
+/**
+ * Parse comma separated names of built-in protected patterns.
+ */
+int parse_protect_builtin(const std::string& specs) {
+    std::stringstream stream(specs);
+    std::string spec;
+    int builtins = ProtectedPatterns::NONE;
+    while (std::getline(stream, spec, ',')) {
+        if (spec == "url") {
+            builtins |= ProtectedPatterns::URLS;
+        } else if (spec == "email") {
+            builtins |= ProtectedPatterns::EMAILS;
+        } else {
+            throw std::runtime_error("Invalid built-in pattern: " + spec);
+        };
+    };
+    return builtins;
+}
+
+int run(int argc, char** argv) {
     std::ios_base::sync_with_stdio(false);
     std::cin.tie(nullptr);
 
@@ -144,7 +1412,56 @@ int main(int argc, char** argv) {
     CLI::App app{"Fast Tokenizer CLI"};
     app.add_option(
         "-i,--input", args.input,
-        "Input stream, defaults to stdin.");
+        "Input stream, defaults to stdin. gzip and zstd input is detected.");
+    app.add_option(
+        "-o,--output", args.output,
+        "Output stream, defaults to stdout.");
+    app.add_option(
+        "--inputs", args.inputs,
+        "Input files or glob patterns, processed into output_dir.");
+    app.add_option(
+        "--input-list", args.input_list,
+        "File listing input files, one per line.");
+    app.add_option(
+        "--output-dir", args.output_dir,
+        "Directory for outputs of inputs, completed inputs are recorded in "
+        "a manifest there and skipped when run again.");
+    app.add_option(
+        "--tsv-fields", args.tsv_fields,
+        "Comma separated TSV columns to process, counted from 1, other "
+        "columns are copied. Each can have its own mode, e.g. "
+        "1,2:desegment. Modes are normalize, segment, normalize_and_segment "
+        "and desegment, the default is set by the other flags.");
+    app.add_option(
+        "--json-field", args.json_fields,
+        "String fields of JSONL records to process, the rest of each record "
+        "is copied. Each can have its own mode, as in --tsv-fields.");
+    app.add_option(
+        "--vocab", args.vocab,
+        "Vocabulary file with a token per line. When set, output is binary "
+        "int32 records in native byte order, each the number of tokens of a "
+        "line followed by their IDs.");
+    app.add_option(
+        "--unk-token", args.unk_token,
+        "Token whose ID is given to tokens missing from the vocabulary.");
+    app.add_option(
+        "--compress", args.compress,
+        "Output compression, auto picks it by the output file extension.")
+        ->check(CLI::IsMember({"auto", "none", "gzip", "zstd"}));
+    app.add_option(
+        "--invalid-utf8", args.invalid_utf8,
+        "Handling of lines that are not well-formed UTF-8: replace ill-formed "
+        "sequences with U+FFFD, skip the line and write an empty one, or "
+        "stop with an error.")
+        ->check(CLI::IsMember({"replace", "skip", "error"}));
+    app.add_option(
+        "--protect", args.protect,
+        "ICU regular expression whose matches are kept as single tokens, "
+        "can be repeated. Matches should not hold spaces.");
+    app.add_option(
+        "--protect-builtin", args.protect_builtin,
+        "Comma separated built-in patterns to keep as single tokens, url "
+        "and email.");
     app.add_flag(
         "-p,--protected-dash-split", args.protected_dash_split,
         "Perform protected dash split.");
@@ -163,6 +1480,23 @@ int main(int argc, char** argv) {
     app.add_flag(
         "-q,--quiet", args.quiet,
         "Run in quiet mode.");
+    app.add_option(
+        "--cache-size", args.cache_size,
+        "Number of lines and of chunks to cache, 0 to disable.");
+    app.add_option(
+        "--long-line-bytes", args.long_line_bytes,
+        "Split lines longer than this over all threads, 0 to disable.");
+    app.add_flag(
+        "--stats", args.stats,
+        "Print segmenter stats as JSON to stderr.");
+    app.add_option(
+        "--serve", args.serve,
+        "Run as a daemon answering clients on this Unix socket, with the "
+        "segmenter options given here, until stopped.");
+    app.add_option(
+        "--connect", args.connect,
+        "Process input on the daemon listening on this Unix socket instead "
+        "of in process. Segmenter options are those of the daemon.");
 
     CLI11_PARSE(app, argc, argv);
 
@@ -172,33 +1506,100 @@ int main(int argc, char** argv) {
     if (args.norm_only && args.segm_only)
         throw std::runtime_error("Cannot have both norm_only and segm_only");
 
+    if (args.compress == "gzip") output_compression = GZIP;
+    if (args.compress == "zstd") output_compression = ZSTD;
+    if (output_compression == ZSTD) check_zstd_support();
+
+    bool has_inputs = !args.inputs.empty() || !args.input_list.empty();
+    if (has_inputs && args.output_dir.empty())
+        throw std::runtime_error("Multiple inputs require an output_dir");
+    if (!has_inputs && !args.output_dir.empty())
+        throw std::runtime_error("output_dir requires inputs");
+
     if (args.norm_only) flag = 1;
     else if (args.segm_only) flag = 2;
     else if (args.desegment) flag = 3;
     else flag = 0;
 
+    if (!args.tsv_fields.empty() && !args.json_fields.empty())
+        throw std::runtime_error("Cannot have both tsv_fields and json_field");
+    if (!args.vocab.empty() && (flag == 1 || flag == 3))
+        throw std::runtime_error("vocab requires segmentation");
+    if (!args.vocab.empty() && (!args.tsv_fields.empty()
+        || !args.json_fields.empty()))
+        throw std::runtime_error("Cannot have both vocab and fields");
+    parse_tsv_fields(args.tsv_fields);
+    parse_json_fields(args.json_fields);
+
+    bool daemon = !args.serve.empty() || !args.connect.empty();
+    if (!args.serve.empty() && !args.connect.empty())
+        throw std::runtime_error("Cannot have both serve and connect");
+    if (daemon && (!args.vocab.empty() || !args.tsv_fields.empty()
+        || !args.json_fields.empty()))
+        throw std::runtime_error("serve and connect only process plain lines");
+    if (daemon && has_inputs)
+        throw std::runtime_error("serve and connect take a single input");
+
+    // Peers going away show up as failed writes
+    if (daemon) signal(SIGPIPE, SIG_IGN);
+
     if (!args.quiet) {
         std::cerr << "input: " << args.input << std::endl;
+        std::cerr << "output: " << args.output << std::endl;
+        std::cerr << "inputs: " << args.inputs.size() << std::endl;
+        std::cerr << "output_dir: " << args.output_dir << std::endl;
+        std::cerr << "compress: " << args.compress << std::endl;
+        std::cerr << "tsv_fields: " << args.tsv_fields << std::endl;
+        std::cerr << "json_fields: " << args.json_fields.size() << std::endl;
+        std::cerr << "vocab: " << args.vocab << std::endl;
+        std::cerr << "invalid_utf8: " << args.invalid_utf8 << std::endl;
+        std::cerr << "protect: " << args.protect.size() << std::endl;
+        std::cerr << "protect_builtin: " << args.protect_builtin << std::endl;
         std::cerr << "protected_dash_split: "
             << args.protected_dash_split << std::endl;
         std::cerr << "norm_only: " << args.norm_only << std::endl;
         std::cerr << "segm_only: " << args.segm_only << std::endl;
         std::cerr << "desegment: " << args.desegment << std::endl;
         std::cerr << "num_threads: " << args.num_threads << std::endl;
+        std::cerr << "cache_size: " << args.cache_size << std::endl;
+        std::cerr << "long_line_bytes: " << args.long_line_bytes << std::endl;
+        std::cerr << "serve: " << args.serve << std::endl;
+        std::cerr << "connect: " << args.connect << std::endl;
         std::cerr << std::endl;
     };
 
-    FILE* input_stream;
-    if (args.input == "-") input_stream = stdin;
-    else input_stream = fopen(args.input.c_str(), "r");
-    if (input_stream == nullptr)
-        throw std::runtime_error("Input file not founds.");
-
-    segmenter = new Segmenter(args.protected_dash_split);
+    // Clients leave segmentation to the daemon
+    if (args.connect.empty()) {
+        segmenter = new Segmenter(
+            args.protected_dash_split, args.cache_size, args.protect,
+            parse_protect_builtin(args.protect_builtin));
+        segmenter->set_long_line_bytes(args.long_line_bytes);
+        if (args.invalid_utf8 == "skip") {
+            segmenter->set_invalid_utf8(Segmenter::SKIP);
+        } else if (args.invalid_utf8 == "error") {
+            segmenter->set_invalid_utf8(Segmenter::THROW);
+        };
+    };
+    if (!args.vocab.empty()) {
+        vocabulary = new Vocabulary(args.vocab, args.unk_token);
+    };
+    if (!args.serve.empty()) run_server();
 
     // Run
     auto begin = std::chrono::steady_clock::now();
-    size_t num_lines = run(input_stream);
+    size_t num_lines;
+    if (!args.connect.empty()) num_lines = run_client();
+    else if (args.output_dir.empty()) num_lines = run_single();
+    else num_lines = run_shards();
+    if (!args.quiet) std::cerr << "\r" << num_lines << " Done!" << std::endl;
+    if (malformed_records > 0) {
+        std::cerr << "Copied " << malformed_records
+            << " records that are not JSON objects as is" << std::endl;
+    };
+    if (total_stats.invalid_lines > 0) {
+        std::cerr << "Skipped " << total_stats.invalid_lines
+            << " texts that are not well-formed UTF-8" << std::endl;
+    };
 
     // Print out some statistics
     auto end = std::chrono::steady_clock::now();
@@ -212,8 +1613,26 @@ int main(int argc, char** argv) {
         std::cerr << "Num lines: " << num_lines << std::endl;
         std::cerr << "Rate: " << num_lines / sec_elapsed
             << " lines/s" << std::endl;
+        if (args.cache_size > 0) print_cache_hit_rates();
     };
+    if (args.stats) print_stats(num_lines, millis_elapsed);
 
+    delete vocabulary;
     delete segmenter;
     return 0;
 }
+
+/**
+ * Invalid arguments, failed reads and writes and rejected lines stop the
+ * run with an error message and a non-zero exit status.
+ */
+int main(int argc, char** argv) {
+    try {
+        return run(argc, argv);
+    } catch (const std::exception& e) {
+        // End the progress line first
+        if (!args.quiet) std::cerr << std::endl;
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    };
+}
@@ -0,0 +1,236 @@
+#ifndef JSON_FIELDS_H
+#define JSON_FIELDS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * A string value of a JSON object, offsets are relative to the record.
+ * The key is left escaped as it appears in the record.
+ */
+struct JsonField {
+    const char* key;
+    size_t key_size;
+    size_t value_begin;  // Past the opening quote
+    size_t value_end;  // At the closing quote
+};
+
+static inline const char* skip_json_space(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        ++p;
+    };
+    return p;
+}
+
+// p is past the opening quote, returns the closing quote or nullptr
+static inline const char* find_json_string_end(const char* p, const char* end) {
+    while (p < end) {
+        const char* quote = (const char*) std::memchr(p, '"', end - p);
+        if (quote == nullptr) return nullptr;
+
+        // The quote is escaped by an odd number of backslashes before it
+        size_t num_backslashes = 0;
+        while (quote - num_backslashes > p
+            && quote[-1 - (ptrdiff_t) num_backslashes] == '\\'
+        ) {
+            ++num_backslashes;
+        };
+        if (num_backslashes % 2 == 0) return quote;
+        p = quote + 1;
+    };
+    return nullptr;
+}
+
+// Skip any JSON value starting at p, returns nullptr if it is ill-formed
+static inline const char* skip_json_value(const char* p, const char* end) {
+    if (p >= end) return nullptr;
+    if (*p == '"') {
+        const char* quote = find_json_string_end(p + 1, end);
+        return quote != nullptr ? quote + 1 : nullptr;
+    };
+
+    if (*p == '{' || *p == '[') {
+        size_t depth = 0;
+        for (; p < end; ++p) {
+            if (*p == '"') {
+                p = find_json_string_end(p + 1, end);
+                if (p == nullptr) return nullptr;
+            } else if (*p == '{' || *p == '[') {
+                ++depth;
+            } else if (*p == '}' || *p == ']') {
+                if (--depth == 0) return p + 1;
+            };
+        };
+        return nullptr;
+    };
+
+    // Numbers, true, false and null
+    const char* begin = p;
+    while (p < end && std::strchr(",}] \t\r\n", *p) == nullptr) ++p;
+    return p > begin ? p : nullptr;
+}
+
+/**
+ * Find the string values at the top level of the JSON object in data.
+ * Values of other types and nested objects are skipped over.
+ * Returns false if data is not a well-formed object.
+ */
+inline bool find_json_fields(
+    const char* data,
+    size_t size,
+    std::vector<JsonField>& fields
+) {
+    fields.clear();
+    const char* end = data + size;
+    const char* p = skip_json_space(data, end);
+    if (p == end || *p != '{') return false;
+    p = skip_json_space(p + 1, end);
+    if (p < end && *p == '}') return skip_json_space(p + 1, end) == end;
+
+    while (true) {
+        if (p == end || *p != '"') return false;
+        const char* key = p + 1;
+        const char* key_end = find_json_string_end(key, end);
+        if (key_end == nullptr) return false;
+
+        p = skip_json_space(key_end + 1, end);
+        if (p == end || *p != ':') return false;
+        p = skip_json_space(p + 1, end);
+
+        const char* value = p;
+        p = skip_json_value(p, end);
+        if (p == nullptr) return false;
+        if (*value == '"') {
+            fields.push_back({
+                key, (size_t) (key_end - key),
+                (size_t) (value + 1 - data), (size_t) (p - 1 - data)
+            });
+        };
+
+        p = skip_json_space(p, end);
+        if (p == end) return false;
+        if (*p == '}') return skip_json_space(p + 1, end) == end;
+        if (*p != ',') return false;
+        p = skip_json_space(p + 1, end);
+    };
+}
+
+static inline void append_utf8(uint32_t c, std::string& out) {
+    if (c < 0x80) {
+        out.push_back(c);
+    } else if (c < 0x800) {
+        out.push_back(0xC0 | (c >> 6));
+        out.push_back(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        out.push_back(0xE0 | (c >> 12));
+        out.push_back(0x80 | ((c >> 6) & 0x3F));
+        out.push_back(0x80 | (c & 0x3F));
+    } else {
+        out.push_back(0xF0 | (c >> 18));
+        out.push_back(0x80 | ((c >> 12) & 0x3F));
+        out.push_back(0x80 | ((c >> 6) & 0x3F));
+        out.push_back(0x80 | (c & 0x3F));
+    };
+}
+
+static inline bool parse_hex4(const char* p, const char* end, uint32_t& value) {
+    if (end - p < 4) return false;
+    value = 0;
+    for (int i=0; i<4; ++i) {
+        char c = p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else return false;
+    };
+    return true;
+}
+
+/**
+ * Append the unescaped contents of a JSON string to out.
+ * Unpaired surrogates become U+FFFD. Returns false on invalid escapes.
+ */
+inline bool json_unescape(const char* data, size_t size, std::string& out) {
+    const char* end = data + size;
+    const char* p = data;
+    while (p < end) {
+        const char* backslash = (const char*) std::memchr(p, '\\', end - p);
+        if (backslash == nullptr) {
+            out.append(p, end - p);
+            return true;
+        };
+        out.append(p, backslash - p);
+        p = backslash + 1;
+        if (p == end) return false;
+
+        switch (*p++) {
+        case '"': out.push_back('"'); break;
+        case '\\': out.push_back('\\'); break;
+        case '/': out.push_back('/'); break;
+        case 'b': out.push_back('\b'); break;
+        case 'f': out.push_back('\f'); break;
+        case 'n': out.push_back('\n'); break;
+        case 'r': out.push_back('\r'); break;
+        case 't': out.push_back('\t'); break;
+        case 'u': {
+            uint32_t c;
+            if (!parse_hex4(p, end, c)) return false;
+            p += 4;
+
+            uint32_t low;
+            if (c >= 0xD800 && c < 0xDC00 && end - p >= 6 && p[0] == '\\'
+                && p[1] == 'u' && parse_hex4(p + 2, end, low)
+                && low >= 0xDC00 && low < 0xE000
+            ) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                p += 6;
+            } else if (c >= 0xD800 && c < 0xE000) {
+                c = 0xFFFD;
+            };
+            append_utf8(c, out);
+            break;
+        }
+        default:
+            return false;
+        }
+    };
+    return true;
+}
+
+/**
+ * Append text escaped as the contents of a JSON string to out.
+ * Only quotes, backslashes and control characters are escaped.
+ */
+inline void json_escape(const char* data, size_t size, std::string& out) {
+    static const char hex[] = "0123456789abcdef";
+    const char* end = data + size;
+    const char* run = data;
+    for (const char* p = data; p < end; ++p) {
+        unsigned char c = *p;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        out.append(run, p - run);
+        run = p + 1;
+        out.push_back('\\');
+        switch (c) {
+        case '"': out.push_back('"'); break;
+        case '\\': out.push_back('\\'); break;
+        case '\b': out.push_back('b'); break;
+        case '\f': out.push_back('f'); break;
+        case '\n': out.push_back('n'); break;
+        case '\r': out.push_back('r'); break;
+        case '\t': out.push_back('t'); break;
+        default:
+            out.append("u00");
+            out.push_back(hex[c >> 4]);
+            out.push_back(hex[c & 0xF]);
+        }
+    };
+    out.append(run, end - run);
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef REORDER_BUFFER_H
+#define REORDER_BUFFER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * Hands items finished out of order over to a single consumer in sequence
+ * order.
+ *
+ * Producers publish items into atomic slots indexed by sequence number.
+ * The mutex is only taken to sleep when there is nothing to do, so the
+ * handoff itself never blocks. At most capacity sequence numbers can be in
+ * flight, which bounds the memory held by items waiting on a slow one.
+ */
+template <typename T>
+class ReorderBuffer {
+    private:
+        size_t capacity;
+        std::unique_ptr<std::atomic<T*>[]> slots;
+
+        size_t head;  // Next sequence number to take, owned by the consumer
+        std::atomic<size_t> released;  // Sequence numbers below are done
+        std::atomic<size_t> end;  // Number of items once known
+
+        std::mutex mutex;
+        std::condition_variable producer_cond;
+        std::condition_variable consumer_cond;
+
+    public:
+        ReorderBuffer(size_t capacity)
+            : capacity(capacity)
+            , slots(new std::atomic<T*>[capacity])
+            , head(0)
+            , released(0)
+            , end(SIZE_MAX)
+        {
+            for (size_t i=0; i<capacity; ++i) slots[i].store(nullptr);
+        };
+
+        // Wait until seq fits in the buffer
+        void reserve(size_t seq) {
+            if (seq < released.load() + capacity) return;
+            std::unique_lock<std::mutex> lock(mutex);
+            producer_cond.wait(lock, [&] {
+                return seq < released.load() + capacity;
+            });
+        };
+
+        // Publish a finished item, seq has to be reserved beforehand
+        void put(size_t seq, T* item) {
+            slots[seq % capacity].store(item, std::memory_order_release);
+            { std::lock_guard<std::mutex> lock(mutex); }
+            consumer_cond.notify_one();
+        };
+
+        // No items will be published from num_items onwards
+        void close(size_t num_items) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                end.store(num_items);
+            }
+            consumer_cond.notify_one();
+        };
+
+        // Wait for the next item in order and take it together with up to
+        // max_items - 1 items that are ready right after it.
+        // Returns false once all items have been taken.
+        bool take(std::vector<T*>& items, size_t max_items) {
+            items.clear();
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                consumer_cond.wait(lock, [&] {
+                    return head == end.load() || slots[head % capacity].load(
+                        std::memory_order_acquire) != nullptr;
+                });
+                if (head == end.load()) return false;
+            }
+
+            while (items.size() < max_items && head < end.load()) {
+                T* item = slots[head % capacity].exchange(
+                    nullptr, std::memory_order_acq_rel);
+                if (item == nullptr) break;
+                items.push_back(item);
+                ++head;
+            };
+            return true;
+        };
+
+        // Make slots of taken items available to producers again
+        void release() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                released.store(head);
+            }
+            producer_cond.notify_all();
+        };
+};
+
+#endif
@@ -0,0 +1,171 @@
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "fasttokenizer/vocabulary.h"
+
+using namespace icu;
+
+#ifdef TOKENIZER_NAMESPACE
+namespace TOKENIZER_NAMESPACE {
+#endif
+
+static const size_t MIN_SLOTS = 16;
+
+Vocabulary::Vocabulary(const std::string& path, const std::string& unk_token)
+    : offsets(1, 0)
+    , mask(0)
+    , unk_id(-1)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("Failed to open vocabulary file.");
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t tab = line.find('\t');
+        if (tab != std::string::npos) line.resize(tab);
+        add(line);
+    };
+    build_table();
+
+    unk_id = find(unk_token);
+    if (unk_id < 0) unk_id = size();
+};
+
+Vocabulary::Vocabulary(
+    const std::vector<std::string>& tokens,
+    const std::string& unk_token
+)
+    : offsets(1, 0)
+    , mask(0)
+    , unk_id(-1)
+{
+    for (const std::string& token: tokens) add(token);
+    build_table();
+
+    unk_id = find(unk_token);
+    if (unk_id < 0) unk_id = size();
+};
+
+/**
+ * FNV-1a hash of token bytes.
+ */
+uint32_t Vocabulary::hash(const char* data, size_t size, uint32_t h) {
+    for (size_t i=0; i<size; ++i) {
+        h ^= (uint8_t) data[i];
+        h *= 16777619u;
+    };
+    return h;
+};
+
+void Vocabulary::add(StringPiece token) {
+    tokens.append(token.data(), token.length());
+    offsets.push_back(tokens.size());
+};
+
+/**
+ * Fill a table of at least twice as many slots as tokens, so probe
+ * sequences stay short. Tokens listed twice keep their first ID.
+ */
+void Vocabulary::build_table() {
+    size_t num_slots = MIN_SLOTS;
+    while (num_slots < 2 * size()) num_slots *= 2;
+    slots.assign(num_slots, {0, -1});
+    mask = num_slots - 1;
+
+    for (size_t id=0; id<size(); ++id) {
+        const char* token = tokens.data() + offsets[id];
+        size_t length = offsets[id + 1] - offsets[id];
+        uint32_t h = hash(token, length);
+
+        uint32_t i = h & mask;
+        while (slots[i].id >= 0) {
+            const Slot& slot = slots[i];
+            if (slot.hash == h
+                && offsets[slot.id + 1] - offsets[slot.id] == length
+                && std::memcmp(tokens.data() + offsets[slot.id],
+                    token, length) == 0
+            ) {
+                break;
+            };
+            i = (i + 1) & mask;
+        };
+        if (slots[i].id < 0) slots[i] = {h, (int32_t) id};
+    };
+};
+
+int32_t Vocabulary::find(StringPiece token) const {
+    const char* data = token.data();
+    size_t length = token.length();
+    uint32_t h = hash(data, length);
+
+    for (uint32_t i = h & mask; slots[i].id >= 0; i = (i + 1) & mask) {
+        const Slot& slot = slots[i];
+        if (slot.hash == h
+            && offsets[slot.id + 1] - offsets[slot.id] == length
+            && std::memcmp(tokens.data() + offsets[slot.id],
+                data, length) == 0
+        ) {
+            return slot.id;
+        };
+    };
+    return unk_id;
+};
+
+/**
+ * Same as find on the joined token, hashed and compared piece by piece so
+ * that lookups never allocate.
+ */
+int32_t Vocabulary::find_affixed(
+    StringPiece token,
+    bool at_prefix,
+    bool at_suffix
+) const {
+    size_t length = token.length() + at_prefix + at_suffix;
+    uint32_t h = hash("@", at_prefix);
+    h = hash(token.data(), token.length(), h);
+    h = hash("@", at_suffix, h);
+
+    for (uint32_t i = h & mask; slots[i].id >= 0; i = (i + 1) & mask) {
+        const Slot& slot = slots[i];
+        if (slot.hash != h
+            || offsets[slot.id + 1] - offsets[slot.id] != length
+        ) {
+            continue;
+        };
+        const char* candidate = tokens.data() + offsets[slot.id];
+        if ((!at_prefix || candidate[0] == '@')
+            && (!at_suffix || candidate[length - 1] == '@')
+            && std::memcmp(candidate + at_prefix,
+                token.data(), token.length()) == 0
+        ) {
+            return slot.id;
+        };
+    };
+    return unk_id;
+};
+
+void Vocabulary::find_spans(
+    StringPiece text,
+    const std::vector<TokenSpan>& spans,
+    std::vector<int32_t>& ids
+) const {
+    for (const TokenSpan& span: spans) {
+        StringPiece span_text(
+            text.data() + span.begin, span.end - span.begin);
+        if (!span.synthesized()) {
+            ids.push_back(find(span_text));
+            continue;
+        };
+
+        // Protected dashes are written with their @ in joined strings
+        ids.push_back(find_affixed(span_text,
+            span.flags & TokenSpan::AT_PREFIX,
+            span.flags & TokenSpan::AT_SUFFIX));
+    };
+};
+
+#ifdef TOKENIZER_NAMESPACE
+};
+#endif